@@ -21,6 +21,8 @@
  */
 
 #import "XMPPJID.h"
+#import "XMPPJIDCache.h"
+#import "XMPPStringPrep.h"
 
 #import "XMPPConnection.h"
 #import "XMPPExceptions.h"
@@ -0,0 +1,10 @@
+#import "XMPPConnection.h"
+
+OF_ASSUME_NONNULL_BEGIN
+
+@interface XMPPConnection ()
+- (void)xmpp_sendResourceBind;
+- (void)xmpp_didResumeWithJID: (XMPPJID *)JID;
+@end
+
+OF_ASSUME_NONNULL_END
@@ -30,12 +30,18 @@
 OF_ASSUME_NONNULL_BEGIN
 
 #define XMPPConnectionBufferLength 512
+#define XMPPConnectionMaximumBufferLength 65536
+#define XMPPConnectionWriteFlushThreshold 16384
+#define XMPPConnectionAttemptDelay 0.25
+#define XMPPConnectionIQTimeout 60
+#define XMPPConnectionMaximumPendingIQs 1024
 
 @class XMPPConnection;
 @class XMPPJID;
 @class XMPPIQ;
 @class XMPPMessage;
 @class XMPPPresence;
+@class XMPPStanza;
 @class XMPPAuthenticator;
 @class SSLSocket;
 @class XMPPMulticastDelegate;
@@ -79,6 +85,25 @@ OF_ASSUME_NONNULL_BEGIN
  */
 - (void)connection: (XMPPConnection *)connection wasBoundToJID: (XMPPJID *)JID;
 
+/*!
+ * @brief This callback is called before the connection binds a resource.
+ *
+ * @param connection The connection that is about to bind a resource
+ * @return Whether the delegate takes care of binding the connection instead,
+ *	   e.g. by resuming a previous stream
+ */
+- (bool)connectionWillBindResource: (XMPPConnection *)connection;
+
+/*!
+ * @brief This callback is called when a previous stream was resumed instead
+ *	  of binding a resource.
+ *
+ * @param connection The connection on which the stream was resumed
+ * @param JID The JID the resumed stream is bound to
+ */
+-  (void)connection: (XMPPConnection *)connection
+  wasResumedWithJID: (XMPPJID *)JID;
+
 /*!
  * @brief This callback is called when the connection received an IQ stanza.
  *
@@ -140,13 +165,74 @@ OF_ASSUME_NONNULL_BEGIN
 - (void)connectionDidUpgradeToTLS: (XMPPConnection *)connection;
 @end
 
+/*!
+ * @brief A protocol for objects handling IQ stanzas with a specific payload
+ *	  namespace, registered via
+ *	  @ref XMPPConnection::registerIQHandler:forNamespace:type:.
+ */
+@protocol XMPPIQHandler <OFObject>
+/*!
+ * @brief This callback is called when the connection received an IQ stanza
+ *	  whose first child element has a namespace the handler was registered
+ *	  for.
+ *
+ * @param connection The connection that received the stanza
+ * @param IQ The IQ stanza that was received
+ * @return Whether the IQ stanza was handled. If not, it is passed on to
+ *	   @ref XMPPConnectionDelegate::connection:didReceiveIQ:.
+ */
+- (bool)connection: (XMPPConnection *)connection handleIQ: (XMPPIQ *)IQ;
+@end
+
+/*!
+ * @brief A protocol for handlers that process the children of large payloads
+ *	  one by one while they are parsed, instead of waiting for the whole
+ *	  stanza.
+ */
+@protocol XMPPStreamingHandler <OFObject>
+/*!
+ * @brief This callback is called when a child element of a stanza that has a
+ *	  namespace the handler was registered for starts.
+ *
+ * @param connection The connection that is receiving the stanza
+ * @param element The child element of the stanza, without any children
+ * @param stanza The stanza, without any children
+ * @return Whether the children of the element should be passed to
+ *	   @ref connection:didReceiveChildElement:ofElement:inStanza: one by
+ *	   one. If true, they are not part of the stanza once it is received.
+ */
+-	 (bool)connection: (XMPPConnection *)connection
+  shouldStreamChildrenOfElement: (OFXMLElement *)element
+		       inStanza: (XMPPStanza *)stanza;
+
+/*!
+ * @brief This callback is called for each child of an element that is
+ *	  streamed.
+ *
+ * @param connection The connection that is receiving the stanza
+ * @param child The child that was received
+ * @param element The element the child belongs to, without any children
+ * @param stanza The stanza, without any children
+ */
+-	  (void)connection: (XMPPConnection *)connection
+  didReceiveChildElement: (OFXMLElement *)child
+	       ofElement: (OFXMLElement *)element
+		inStanza: (XMPPStanza *)stanza;
+@end
+
 /*!
  * @brief A class which abstracts a connection to an XMPP service.
  */
 @interface XMPPConnection: OFObject
 {
 	OF_KINDOF(OFStream *) _stream;
-	char _buffer[XMPPConnectionBufferLength];
+	char *_Nullable _buffer;
+	size_t _bufferLength, _readBufferSize, _maximumReadBufferSize;
+	unsigned int _shortReadsCount;
+	OFMutableData *_writeBuffer;
+	size_t _writeFlushThreshold;
+	bool _flushesAtEndOfRunLoopIteration, _flushScheduled;
+	unsigned long long _numberOfBytesWritten, _numberOfWrites;
 	OFXMLParser *_parser, *_oldParser;
 	OFXMLElementBuilder *_elementBuilder, *_oldElementBuilder;
 	OFString *_Nullable _username, *_Nullable _password, *_Nullable _server;
@@ -158,13 +244,34 @@ OF_ASSUME_NONNULL_BEGIN
 	uint16_t _port;
 	id <XMPPStorage> _Nullable _dataStorage;
 	OFString *_Nullable _language;
-	OFMutableArray *_nextSRVRecords;
+	OFDNSResolver *_Nullable _DNSResolver;
+	OFMutableArray *_Nullable _nextSRVRecords;
+	OFMutableArray *_SRVRecords, *_directTLSRecords;
+	unsigned int _pendingSRVQueries;
+	OFMutableArray OF_GENERIC(OFTCPSocket *) *_connectingSockets;
+	OFMutableArray OF_GENERIC(OFTCPSocket *) *_directTLSSockets;
+	OFTimer *_Nullable _nextSRVRecordTimer;
+	OFTimeInterval _connectionAttemptDelay;
+	bool _connecting;
 	XMPPMulticastDelegate *_delegates;
-	OFMutableDictionary OF_GENERIC(OFString *, XMPPCallback *) *_callbacks;
+	OFMapTable *_pendingIQs;
+	OFList *_pendingIQsList;
+	OFMutableDictionary OF_GENERIC(OFString *, OFNumber *) *_foreignIQIDs;
+	OFTimer *_Nullable _IQTimeoutTimer;
+	OFTimeInterval _IQTimeout;
+	size_t _maximumPendingIQs;
+	/*
+	 * Keyed by the pointer of the interned namespace. The element handlers
+	 * of a namespace are keyed by the pointer of the interned name.
+	 */
+	OFMapTable *_elementHandlers, *_IQHandlers, *_streamingHandlers;
+	id <XMPPStreamingHandler> _Nullable _streamingHandler;
+	XMPPStanza *_Nullable _streamedStanza;
 	XMPPAuthenticator *_authModule;
 	bool _streamOpen, _needsSession, _encryptionRequired, _encrypted;
+	bool _usesDirectTLS, _upgradingToTLS;
 	bool _supportsRosterVersioning, _supportsStreamManagement;
-	unsigned int _lastID;
+	unsigned long _lastID;
 }
 
 /*!
@@ -220,11 +327,110 @@ OF_ASSUME_NONNULL_BEGIN
  */
 @property (nonatomic) uint16_t port;
 
+/*!
+ * @brief The DNS resolver used to look up the SRV records of the domain.
+ *
+ * If this is nil, the DNS resolver of the current thread is used.
+ */
+@property OF_NULLABLE_PROPERTY (nonatomic, retain) OFDNSResolver *DNSResolver;
+
+/*!
+ * @brief The delay after which a connection attempt to the next SRV record is
+ *	  started while previous attempts are still in progress.
+ *
+ * The first attempt that succeeds is used for the connection.
+ *
+ * Defaults to `XMPPConnectionAttemptDelay`.
+ */
+@property (nonatomic) OFTimeInterval connectionAttemptDelay;
+
+/*!
+ * @brief The time after which the callback of an IQ sent via one of the
+ *	  `sendIQ:` methods is called with a `remote-server-timeout` error if
+ *	  no response was received, or 0 to wait indefinitely.
+ *
+ * Defaults to `XMPPConnectionIQTimeout`.
+ */
+@property (nonatomic) OFTimeInterval IQTimeout;
+
+/*!
+ * @brief The maximum number of IQs waiting for a response.
+ *
+ * If exceeded, the callback of the oldest IQ is called with a
+ * `resource-constraint` error.
+ *
+ * Defaults to `XMPPConnectionMaximumPendingIQs`.
+ */
+@property (nonatomic) size_t maximumPendingIQs;
+
+/*!
+ * @brief Whether TLS is started immediately after connecting (XEP-0368)
+ *	  instead of negotiating it via STARTTLS.
+ *
+ * If set, the `_xmpps-client._tcp` SRV records of the domain are looked up
+ * in addition to the `_xmpp-client._tcp` ones. Both are ordered by priority,
+ * preferring direct TLS within the same priority. If @ref server is set, TLS
+ * is started immediately after connecting to it.
+ */
+@property (nonatomic) bool usesDirectTLS;
+
 /*!
  * @brief An object for data storage, conforming to the XMPPStorage protocol.
  */
 @property OF_NULLABLE_PROPERTY (nonatomic, assign) id <XMPPStorage> dataStorage;
 
+/*!
+ * @brief The initial and minimum size of the buffer used for reading.
+ *
+ * The read buffer grows up to @ref maximumReadBufferSize while reads keep
+ * filling it. After several reads in a row that only used a small part of it,
+ * it shrinks again, but never below this size. As the buffer can only be
+ * resized between reads, it keeps its size while no data is received.
+ *
+ * Defaults to `XMPPConnectionBufferLength`.
+ */
+@property (nonatomic) size_t readBufferSize;
+
+/*!
+ * @brief The maximum size the read buffer may grow to.
+ *
+ * Defaults to `XMPPConnectionMaximumBufferLength`.
+ */
+@property (nonatomic) size_t maximumReadBufferSize;
+
+/*!
+ * @brief The number of buffered outgoing bytes at which they are written
+ *	  immediately.
+ *
+ * Stanzas are collected in a buffer and written with a single write call. If
+ * this is 0, every stanza is written as soon as it is sent.
+ *
+ * Defaults to `XMPPConnectionWriteFlushThreshold`.
+ */
+@property (nonatomic) size_t writeFlushThreshold;
+
+/*!
+ * @brief Whether buffered outgoing data is written at the end of the current
+ *	  run loop iteration.
+ *
+ * If this is false, buffered data is only written once
+ * @ref writeFlushThreshold is reached, @ref flush is called or the connection
+ * is closed.
+ *
+ * Defaults to true.
+ */
+@property (nonatomic) bool flushesAtEndOfRunLoopIteration;
+
+/*!
+ * @brief The number of bytes written to the stream.
+ */
+@property (readonly, nonatomic) unsigned long long numberOfBytesWritten;
+
+/*!
+ * @brief The number of write calls performed on the stream.
+ */
+@property (readonly, nonatomic) unsigned long long numberOfWrites;
+
 /*!
  * @brief The stream used for the connection.
  */
@@ -299,6 +505,110 @@ OF_ASSUME_NONNULL_BEGIN
  */
 - (void)sendStanza: (OFXMLElement *)element;
 
+/*!
+ * @brief Writes all buffered outgoing data to the stream.
+ */
+- (void)flush;
+
+/*!
+ * @brief Registers a handler for top-level elements with the specified name
+ *	  and namespace.
+ *
+ * Incoming elements are routed to their handler with a single lookup. This is
+ * also used for the elements handled by the connection itself, which can be
+ * replaced by registering a different handler for them. Unhandled elements in
+ * the `jabber:client` namespace cause an `unsupported-stanza-type` stream
+ * error, all other unhandled elements are ignored.
+ *
+ * @ref XMPPConnectionDelegate::connection:didReceiveElement: is still called
+ * for all elements before they are routed to their handler.
+ *
+ * @param target The object that handles the elements. It is not retained.
+ * @param selector The selector of the method handling the elements, must take
+ *		   exactly two parameters: the element of type `OFXMLElement *`
+ *		   and the connection of type `XMPPConnection *`
+ * @param name The name of the elements to handle
+ * @param ns The namespace of the elements to handle
+ */
+-  (void)registerHandlerWithTarget: (id)target
+			  selector: (SEL)selector
+		    forElementName: (OFString *)name
+			 namespace: (OFString *)ns;
+
+/*!
+ * @brief Unregisters the handler for top-level elements with the specified
+ *	  name and namespace.
+ *
+ * Nothing is unregistered if a different handler has been registered for the
+ * elements in the meantime.
+ *
+ * @param target The target the handler was registered with
+ * @param selector The selector the handler was registered with
+ * @param name The name of the elements
+ * @param ns The namespace of the elements
+ */
+-  (void)unregisterHandlerWithTarget: (id)target
+			    selector: (SEL)selector
+		      forElementName: (OFString *)name
+			   namespace: (OFString *)ns;
+
+/*!
+ * @brief Registers a handler for IQ stanzas whose first child element has the
+ *	  specified namespace.
+ *
+ * IQ stanzas are routed to their handler with a single lookup instead of
+ * being passed to all delegates. A handler registered for a specific type
+ * takes precedence over one registered for any type. If no handler is
+ * registered or the handler did not handle the IQ stanza, it is passed on to
+ * @ref XMPPConnectionDelegate::connection:didReceiveIQ:.
+ *
+ * @param handler The handler for the IQ stanzas. It is not retained.
+ * @param ns The namespace of the first child element of the IQ stanzas
+ * @param type The type of the IQ stanzas, or `nil` for any type
+ */
+- (void)registerIQHandler: (id <XMPPIQHandler>)handler
+	     forNamespace: (OFString *)ns
+		     type: (nullable OFString *)type;
+
+/*!
+ * @brief Unregisters the handler for IQ stanzas whose first child element has
+ *	  the specified namespace.
+ *
+ * Nothing is unregistered if a different handler has been registered for the
+ * namespace and type in the meantime.
+ *
+ * @param handler The handler to unregister
+ * @param ns The namespace the handler was registered for
+ * @param type The type the handler was registered for, or `nil` for any type
+ */
+- (void)unregisterIQHandler: (id <XMPPIQHandler>)handler
+	       forNamespace: (OFString *)ns
+		       type: (nullable OFString *)type;
+
+/*!
+ * @brief Registers a handler that can process the children of stanza payloads
+ *	  with the specified namespace one by one while they are parsed.
+ *
+ * This avoids building the whole payload in memory, e.g. for large rosters.
+ *
+ * @param handler The handler for the payloads. It is not retained.
+ * @param ns The namespace of the payloads
+ */
+- (void)registerStreamingHandler: (id <XMPPStreamingHandler>)handler
+		    forNamespace: (OFString *)ns;
+
+/*!
+ * @brief Unregisters the streaming handler for the specified namespace.
+ *
+ * Nothing is unregistered if a different handler has been registered for the
+ * namespace in the meantime.
+ *
+ * @param handler The handler to unregister
+ * @param ns The namespace the handler was registered for
+ */
+- (void)unregisterStreamingHandler: (id <XMPPStreamingHandler>)handler
+		      forNamespace: (OFString *)ns;
+
 /*!
  * @brief Sends an XMPPIQ, registering a callback method.
  *
@@ -321,6 +631,46 @@ OF_ASSUME_NONNULL_BEGIN
 -  (void)sendIQ: (XMPPIQ *)IQ callbackBlock: (XMPPCallbackBlock)block;
 #endif
 
+/*!
+ * @brief Sends an XMPPIQ, registering a callback method that is called with
+ *	  a `remote-server-timeout` error if no response was received in time.
+ *
+ * @param IQ The IQ to send
+ * @param target The object that contains the callback method
+ * @param selector The selector of the callback method,
+ *		   must take exactly one parameter of type `XMPPIQ *`
+ * @param timeout The time to wait for a response, or 0 to wait indefinitely
+ */
+-   (void)sendIQ: (XMPPIQ *)IQ
+  callbackTarget: (id)target
+	selector: (SEL)selector
+	 timeout: (OFTimeInterval)timeout;
+
+#ifdef OF_HAVE_BLOCKS
+/*!
+ * @brief Sends an XMPPIQ, registering a callback block that is called with a
+ *	  `remote-server-timeout` error if no response was received in time.
+ *
+ * @param IQ The IQ to send
+ * @param block The callback block
+ * @param timeout The time to wait for a response, or 0 to wait indefinitely
+ */
+-  (void)sendIQ: (XMPPIQ *)IQ
+  callbackBlock: (XMPPCallbackBlock)block
+	timeout: (OFTimeInterval)timeout;
+#endif
+
+/*!
+ * @brief Removes the callback registered for the IQ with the specified ID
+ *	  without calling it.
+ *
+ * If the connection is closed, the callbacks of all IQs still waiting for a
+ * response are called with a `recipient-unavailable` error instead.
+ *
+ * @param ID The ID of the IQ whose callback should be removed
+ */
+- (void)cancelCallbackForIQWithID: (OFString *)ID;
+
 /*!
  * @brief Generates a new, unique stanza ID.
  *
@@ -27,13 +27,13 @@
 #define XMPP_CONNECTION_M
 
 #include <assert.h>
-
-#include <stringprep.h>
-#include <idna.h>
+#include <limits.h>
+#include <string.h>
 
 #import <ObjFW/OFInvalidArgumentException.h>
 
 #import "XMPPConnection.h"
+#import "XMPPConnection+Private.h"
 #import "XMPPANONYMOUSAuth.h"
 #import "XMPPCallback.h"
 #import "XMPPEXTERNALAuth.h"
@@ -46,33 +46,249 @@
 #import "XMPPPresence.h"
 #import "XMPPSCRAMAuth.h"
 #import "XMPPStanza.h"
+#import "XMPPStringPrep.h"
 #import "XMPPXMLElementBuilder.h"
+#import "XMPPXMLSerializer.h"
 
 #import "namespaces.h"
 
 #import <ObjFW/macros.h>
 
+/*
+ * Number of consecutive reads using less than a quarter of the read buffer
+ * after which the connection is considered idle and the buffer is shrunk.
+ */
+#define SHRINK_THRESHOLD 8
+
+/* Interval in which IQs waiting for a response are checked for timeouts. */
+#define IQ_TIMEOUT_CHECK_INTERVAL 1
+
+/*
+ * Sorts SRV records by priority and orders them by weight (RFC 2782).
+ *
+ * Within a priority, the preferred records come before the others.
+ */
+static OFArray OF_GENERIC(OFSRVDNSResourceRecord *) *
+sortSRVRecords(OFArray OF_GENERIC(OFSRVDNSResourceRecord *) *records,
+    OFArray OF_GENERIC(OFSRVDNSResourceRecord *) *preferredRecords)
+{
+	OFMutableArray *sorted = [OFMutableArray array];
+	OFMutableArray *remaining = [[records mutableCopy] autorelease];
+
+	while (remaining.count > 0) {
+		OFMutableArray *group = [OFMutableArray array];
+		uint16_t priority = UINT16_MAX;
+		bool preferred;
+
+		for (OFSRVDNSResourceRecord *record in remaining)
+			if (record.priority < priority)
+				priority = record.priority;
+
+		preferred = false;
+		for (OFSRVDNSResourceRecord *record in remaining) {
+			if (record.priority == priority &&
+			    [preferredRecords containsObjectIdenticalTo: record]) {
+				preferred = true;
+				break;
+			}
+		}
+
+		/* Records with weight 0 need to be first in the group. */
+		for (OFSRVDNSResourceRecord *record in remaining)
+			if (record.priority == priority && record.weight == 0 &&
+			    [preferredRecords containsObjectIdenticalTo:
+			    record] == preferred)
+				[group addObject: record];
+		for (OFSRVDNSResourceRecord *record in remaining)
+			if (record.priority == priority && record.weight != 0 &&
+			    [preferredRecords containsObjectIdenticalTo:
+			    record] == preferred)
+				[group addObject: record];
+
+		for (OFSRVDNSResourceRecord *record in group)
+			[remaining removeObjectIdenticalTo: record];
+
+		while (group.count > 0) {
+			uint32_t totalWeight = 0, runningWeight = 0, random;
+			size_t i, count = group.count;
+
+			for (OFSRVDNSResourceRecord *record in group)
+				totalWeight += record.weight;
+
+			random = OFRandom32() % (totalWeight + 1);
+
+			for (i = 0; i < count - 1; i++) {
+				OFSRVDNSResourceRecord *record =
+				    [group objectAtIndex: i];
+
+				runningWeight += record.weight;
+
+				if (runningWeight >= random)
+					break;
+			}
+
+			[sorted addObject: [group objectAtIndex: i]];
+			[group removeObjectAtIndex: i];
+		}
+	}
+
+	[sorted makeImmutable];
+
+	return sorted;
+}
+
+/*
+ * A handler registered for a (namespace, name) pair. The target is not
+ * retained, as most handlers are modules that retain the connection.
+ */
+@interface XMPPElementHandler: OFObject
+{
+@public
+	id _target;
+	SEL _selector;
+}
+@end
+
+@implementation XMPPElementHandler
+@end
+
+static void *
+retainObject(void *object)
+{
+	return [(id)object retain];
+}
+
+static void
+releaseObject(void *object)
+{
+	[(id)object release];
+}
+
+static const OFMapTableFunctions objectFunctions = {
+	.retain = retainObject,
+	.release = releaseObject
+};
+
+/*
+ * Parses the numeric part of a stanza ID generated by generateStanzaID.
+ */
+static bool
+parseStanzaID(OFString *ID, unsigned long *key)
+{
+	const char *UTF8String = ID.UTF8String;
+	unsigned long value = 0;
+
+	if (strncmp(UTF8String, "objxmpp_", 8) != 0 || UTF8String[8] == '\0')
+		return false;
+
+	/*
+	 * Only accept the form generated by generateStanzaID, so that each
+	 * key belongs to exactly one ID. Otherwise, e.g. objxmpp_05 would
+	 * replace the pending IQ for objxmpp_5.
+	 */
+	if (UTF8String[8] == '0')
+		return false;
+
+	for (const char *iter = UTF8String + 8; *iter != '\0'; iter++) {
+		unsigned long digit;
+
+		if (*iter < '0' || *iter > '9')
+			return false;
+
+		digit = *iter - '0';
+
+		if (value > (ULONG_MAX - digit) / 10)
+			return false;
+
+		value = value * 10 + digit;
+	}
+
+	*key = value;
+
+	return true;
+}
+
+/*
+ * An IQ waiting for a response. It is stored in a map table keyed by the
+ * numeric part of its ID and in a list ordered by age.
+ */
+@interface XMPPPendingIQ: OFObject
+{
+@public
+	XMPPCallback *_callback;
+	OFString *_ID;
+	XMPPJID *_to;
+	unsigned long _key;
+	bool _foreignID;
+	OFTimeInterval _deadline;
+	OFListItem _listItem;
+}
+@end
+
+@implementation XMPPPendingIQ
+- (void)dealloc
+{
+	[_callback release];
+	[_ID release];
+	[_to release];
+
+	[super dealloc];
+}
+@end
+
 @interface XMPPConnection () <OFDNSResolverQueryDelegate, OFTCPSocketDelegate,
-    OFXMLParserDelegate, OFXMLElementBuilderDelegate>
+    OFTLSStreamDelegate, OFXMLParserDelegate, XMPPXMLElementBuilderDelegate>
+- (void)xmpp_connectToHost: (OFString *)host
+		      port: (uint16_t)port
+		 directTLS: (bool)directTLS;
 - (void)xmpp_tryNextSRVRecord;
 -  (bool)xmpp_parseBuffer: (const void *)buffer length: (size_t)length;
+- (void)xmpp_asyncRead;
+- (bool)xmpp_adaptReadBufferToLength: (size_t)length;
 - (void)xmpp_startStream;
-- (void)xmpp_handleStanza: (OFXMLElement *)element;
-- (void)xmpp_handleStream: (OFXMLElement *)element;
-- (void)xmpp_handleTLS: (OFXMLElement *)element;
-- (void)xmpp_handleSASL: (OFXMLElement *)element;
+- (void)xmpp_writeString: (OFString *)string;
+- (void)xmpp_didBufferData;
+- (void)xmpp_scheduledFlush;
+- (void)xmpp_handleIQElement: (OFXMLElement *)element
+		  connection: (XMPPConnection *)connection;
+- (void)xmpp_handleMessageElement: (OFXMLElement *)element
+		       connection: (XMPPConnection *)connection;
+- (void)xmpp_handlePresenceElement: (OFXMLElement *)element
+			connection: (XMPPConnection *)connection;
+- (void)xmpp_handleStreamError: (OFXMLElement *)element
+		    connection: (XMPPConnection *)connection;
+- (void)xmpp_handleTLSProceed: (OFXMLElement *)element
+		   connection: (XMPPConnection *)connection;
+- (void)xmpp_handleTLSFailure: (OFXMLElement *)element
+		   connection: (XMPPConnection *)connection;
+- (void)xmpp_handleSASLChallenge: (OFXMLElement *)element
+		      connection: (XMPPConnection *)connection;
+- (void)xmpp_handleSASLSuccess: (OFXMLElement *)element
+		    connection: (XMPPConnection *)connection;
+- (void)xmpp_handleSASLFailure: (OFXMLElement *)element
+		    connection: (XMPPConnection *)connection;
 - (void)xmpp_handleIQ: (XMPPIQ *)IQ;
-- (void)xmpp_handleMessage: (XMPPMessage *)message;
-- (void)xmpp_handlePresence: (XMPPPresence *)presence;
-- (void)xmpp_handleFeatures: (OFXMLElement *)element;
+- (void)xmpp_sendIQ: (XMPPIQ *)IQ
+	   callback: (XMPPCallback *)callback
+	    timeout: (OFTimeInterval)timeout;
+- (XMPPPendingIQ *)xmpp_pendingIQWithID: (OFString *)ID;
+- (bool)xmpp_isResponse: (XMPPIQ *)IQ toPendingIQ: (XMPPPendingIQ *)pending;
+- (void)xmpp_removePendingIQ: (XMPPPendingIQ *)pending;
+- (void)xmpp_failPendingIQ: (XMPPPendingIQ *)pending
+		      type: (OFString *)type
+		 condition: (OFString *)condition;
+- (void)xmpp_failAllPendingIQs;
+- (void)xmpp_checkIQTimeouts;
+- (void)xmpp_handleFeatures: (OFXMLElement *)element
+		 connection: (XMPPConnection *)connection;
 - (void)xmpp_sendAuth: (OFString *)authName;
-- (void)xmpp_sendResourceBind;
 - (void)xmpp_sendStreamError: (OFString *)condition text: (OFString *)text;
 - (void)xmpp_handleResourceBindForConnection: (XMPPConnection *)connection
 					  IQ: (XMPPIQ *)IQ;
 - (void)xmpp_sendSession;
 - (void)xmpp_handleSessionForConnection: (XMPPConnection *)connection
 				     IQ: (XMPPIQ *)IQ;
+- (void)xmpp_failEstablishingSession;
 - (OFString *)xmpp_IDNAToASCII: (OFString *)domain;
 - (XMPPMulticastDelegate *)xmpp_delegates;
 @end
@@ -86,6 +302,16 @@
 @synthesize encrypted = _encrypted;
 @synthesize supportsRosterVersioning = _supportsRosterVersioning;
 @synthesize supportsStreamManagement = _supportsStreamManagement;
+@synthesize readBufferSize = _readBufferSize;
+@synthesize maximumReadBufferSize = _maximumReadBufferSize;
+@synthesize writeFlushThreshold = _writeFlushThreshold;
+@synthesize flushesAtEndOfRunLoopIteration = _flushesAtEndOfRunLoopIteration;
+@synthesize numberOfBytesWritten = _numberOfBytesWritten;
+@synthesize numberOfWrites = _numberOfWrites;
+@synthesize DNSResolver = _DNSResolver;
+@synthesize connectionAttemptDelay = _connectionAttemptDelay;
+@synthesize usesDirectTLS = _usesDirectTLS;
+@synthesize IQTimeout = _IQTimeout, maximumPendingIQs = _maximumPendingIQs;
 
 + (instancetype)connection
 {
@@ -98,8 +324,94 @@
 
 	@try {
 		_port = 5222;
+		_readBufferSize = XMPPConnectionBufferLength;
+		_maximumReadBufferSize = XMPPConnectionMaximumBufferLength;
+		_writeBuffer = [[OFMutableData alloc] init];
+		_writeFlushThreshold = XMPPConnectionWriteFlushThreshold;
+		_flushesAtEndOfRunLoopIteration = true;
+		_connectingSockets = [[OFMutableArray alloc] init];
+		_directTLSSockets = [[OFMutableArray alloc] init];
+		_SRVRecords = [[OFMutableArray alloc] init];
+		_directTLSRecords = [[OFMutableArray alloc] init];
+		_connectionAttemptDelay = XMPPConnectionAttemptDelay;
 		_delegates = [[XMPPMulticastDelegate alloc] init];
-		_callbacks = [[OFMutableDictionary alloc] init];
+		_pendingIQs = [[OFMapTable alloc]
+		    initWithKeyFunctions: (OFMapTableFunctions){ NULL }
+			 objectFunctions: (OFMapTableFunctions){ NULL }];
+		_pendingIQsList = [[OFList alloc] init];
+		_foreignIQIDs = [[OFMutableDictionary alloc] init];
+		_IQTimeout = XMPPConnectionIQTimeout;
+		_maximumPendingIQs = XMPPConnectionMaximumPendingIQs;
+		_elementHandlers = [[OFMapTable alloc]
+		    initWithKeyFunctions: (OFMapTableFunctions){ NULL }
+			 objectFunctions: objectFunctions];
+		_IQHandlers = [[OFMapTable alloc]
+		    initWithKeyFunctions: (OFMapTableFunctions){ NULL }
+			 objectFunctions: objectFunctions];
+		/* Streaming handlers are not retained. */
+		_streamingHandlers = [[OFMapTable alloc]
+		    initWithKeyFunctions: (OFMapTableFunctions){ NULL }
+			 objectFunctions: (OFMapTableFunctions){ NULL }];
+
+		[self registerHandlerWithTarget: self
+				       selector: @selector(
+						     xmpp_handleIQElement:
+						     connection:)
+				 forElementName: @"iq"
+				      namespace: XMPPClientNS];
+		[self registerHandlerWithTarget: self
+				       selector: @selector(
+						     xmpp_handleMessageElement:
+						     connection:)
+				 forElementName: @"message"
+				      namespace: XMPPClientNS];
+		[self registerHandlerWithTarget: self
+				       selector: @selector(
+						     xmpp_handlePresenceElement:
+						     connection:)
+				 forElementName: @"presence"
+				      namespace: XMPPClientNS];
+		[self registerHandlerWithTarget: self
+				       selector: @selector(xmpp_handleFeatures:
+						     connection:)
+				 forElementName: @"features"
+				      namespace: XMPPStreamNS];
+		[self registerHandlerWithTarget: self
+				       selector: @selector(
+						     xmpp_handleStreamError:
+						     connection:)
+				 forElementName: @"error"
+				      namespace: XMPPStreamNS];
+		[self registerHandlerWithTarget: self
+				       selector: @selector(
+						     xmpp_handleTLSProceed:
+						     connection:)
+				 forElementName: @"proceed"
+				      namespace: XMPPStartTLSNS];
+		[self registerHandlerWithTarget: self
+				       selector: @selector(
+						     xmpp_handleTLSFailure:
+						     connection:)
+				 forElementName: @"failure"
+				      namespace: XMPPStartTLSNS];
+		[self registerHandlerWithTarget: self
+				       selector: @selector(
+						     xmpp_handleSASLChallenge:
+						     connection:)
+				 forElementName: @"challenge"
+				      namespace: XMPPSASLNS];
+		[self registerHandlerWithTarget: self
+				       selector: @selector(
+						     xmpp_handleSASLSuccess:
+						     connection:)
+				 forElementName: @"success"
+				      namespace: XMPPSASLNS];
+		[self registerHandlerWithTarget: self
+				       selector: @selector(
+						     xmpp_handleSASLFailure:
+						     connection:)
+				 forElementName: @"failure"
+				      namespace: XMPPSASLNS];
 	} @catch (id e) {
 		[self release];
 		@throw e;
@@ -121,9 +433,25 @@
 	[_resource release];
 	[_JID release];
 	[_nextSRVRecords release];
+	[_connectingSockets release];
+	[_directTLSSockets release];
+	[_SRVRecords release];
+	[_directTLSRecords release];
+	[_DNSResolver release];
 	[_delegates release];
-	[_callbacks release];
+	[_IQTimeoutTimer invalidate];
+	[_IQTimeoutTimer release];
+	[_pendingIQs release];
+	[_pendingIQsList release];
+	[_foreignIQIDs release];
+	[_elementHandlers release];
+	[_IQHandlers release];
+	[_streamingHandlers release];
+	[_streamedStanza release];
 	[_authModule release];
+	[_writeBuffer release];
+
+	OFFreeMemory(_buffer);
 
 	[super dealloc];
 }
@@ -133,23 +461,16 @@
 	OFString *old = _username;
 
 	if (username != nil) {
-		char *node;
-		Stringprep_rc rc;
+		OFString *prepared =
+		    XMPPStringPrep(username, XMPPStringPrepProfileSASLprep);
 
-		if ((rc = stringprep_profile(username.UTF8String, &node,
-		    "SASLprep", 0)) != STRINGPREP_OK)
+		if (prepared == nil)
 			@throw [XMPPStringPrepFailedException
 			    exceptionWithConnection: self
 					    profile: @"SASLprep"
 					     string: username];
 
-		@try {
-			_username = [[OFString alloc]
-			    initWithUTF8StringNoCopy: node
-					freeWhenDone: true];
-		} @catch (id e) {
-			free(node);
-		}
+		_username = [prepared retain];
 	} else
 		_username = nil;
 
@@ -161,29 +482,38 @@
 	OFString *old = _resource;
 
 	if (resource != nil) {
-		char *res;
-		Stringprep_rc rc;
+		OFString *prepared =
+		    XMPPStringPrep(resource, XMPPStringPrepProfileResourceprep);
 
-		if ((rc = stringprep_profile(resource.UTF8String, &res,
-		    "Resourceprep", 0)) != STRINGPREP_OK)
+		if (prepared == nil)
 			@throw [XMPPStringPrepFailedException
 			    exceptionWithConnection: self
 					    profile: @"Resourceprep"
 					     string: resource];
 
-		@try {
-			_resource = [[OFString alloc]
-			    initWithUTF8StringNoCopy: res
-					freeWhenDone: true];
-		} @catch (id e) {
-			free(res);
-		}
+		_resource = [prepared retain];
 	} else
 		_resource = nil;
 
 	[old release];
 }
 
+- (void)setReadBufferSize: (size_t)readBufferSize
+{
+	if (readBufferSize == 0 || readBufferSize > _maximumReadBufferSize)
+		@throw [OFInvalidArgumentException exception];
+
+	_readBufferSize = readBufferSize;
+}
+
+- (void)setMaximumReadBufferSize: (size_t)maximumReadBufferSize
+{
+	if (maximumReadBufferSize < _readBufferSize)
+		@throw [OFInvalidArgumentException exception];
+
+	_maximumReadBufferSize = maximumReadBufferSize;
+}
+
 - (void)setServer: (OFString *)server
 {
 	OFString *old = _server;
@@ -202,24 +532,16 @@
 	OFString *oldDomainToASCII = _domainToASCII;
 
 	if (domain != nil) {
-		char *srv;
-		Stringprep_rc rc;
+		OFString *prepared =
+		    XMPPStringPrep(domain, XMPPStringPrepProfileNameprep);
 
-		if ((rc = stringprep_profile(domain.UTF8String, &srv,
-		    "Nameprep", 0)) != STRINGPREP_OK)
+		if (prepared == nil)
 			@throw [XMPPStringPrepFailedException
 			    exceptionWithConnection: self
 					    profile: @"Nameprep"
 					     string: domain];
 
-		@try {
-			_domain = [[OFString alloc]
-			    initWithUTF8StringNoCopy: srv
-					freeWhenDone: true];
-		} @catch (id e) {
-			free(srv);
-		}
-
+		_domain = [prepared retain];
 		_domainToASCII = [self xmpp_IDNAToASCII: _domain];
 	} else {
 		_domain = nil;
@@ -235,23 +557,16 @@
 	OFString *old = _password;
 
 	if (password != nil) {
-		char *pass;
-		Stringprep_rc rc;
+		OFString *prepared =
+		    XMPPStringPrep(password, XMPPStringPrepProfileSASLprep);
 
-		if ((rc = stringprep_profile(password.UTF8String, &pass,
-		    "SASLprep", 0)) != STRINGPREP_OK)
+		if (prepared == nil)
 			@throw [XMPPStringPrepFailedException
 			    exceptionWithConnection: self
 					    profile: @"SASLprep"
 					     string: password];
 
-		@try {
-			_password = [[OFString alloc]
-			    initWithUTF8StringNoCopy: pass
-					freeWhenDone: true];
-		} @catch (id e) {
-			free(pass);
-		}
+		_password = [prepared retain];
 	} else
 		_password = nil;
 
@@ -263,12 +578,34 @@
 	      port: (uint16_t)port
 	 exception: (id)exception
 {
+	bool directTLS;
+
+	/* Another attempt already won or the connection was closed. */
+	if (![_connectingSockets containsObjectIdenticalTo: sock]) {
+		if (exception == nil)
+			[sock close];
+
+		return;
+	}
+
+	[[sock retain] autorelease];
+	[_connectingSockets removeObjectIdenticalTo: sock];
+	directTLS = [_directTLSSockets containsObjectIdenticalTo: sock];
+	[_directTLSSockets removeObjectIdenticalTo: sock];
+
 	if (exception != nil) {
+		/* No need to wait for the delay if an attempt failed. */
 		if (_nextSRVRecords.count > 0) {
 			[self xmpp_tryNextSRVRecord];
 			return;
 		}
 
+		/* Wait for the attempts that are still in progress. */
+		if (_connectingSockets.count > 0)
+			return;
+
+		_connecting = false;
+
 		[_delegates broadcastSelector: @selector(connection:
 						   didThrowException:)
 				   withObject: self
@@ -276,23 +613,91 @@
 		return;
 	}
 
+	/*
+	 * The remaining attempts are closed as soon as they connect, as they
+	 * are no longer in _connectingSockets.
+	 */
+	[_connectingSockets removeAllObjects];
+	[_directTLSSockets removeAllObjects];
+	[_directTLSRecords removeAllObjects];
+	[_nextSRVRecordTimer invalidate];
+	[_nextSRVRecordTimer release];
+	_nextSRVRecordTimer = nil;
+	[_nextSRVRecords release];
+	_nextSRVRecords = nil;
+	_connecting = false;
+
+	_stream = [sock retain];
+
+	if (directTLS) {
+		OFTLSStream *TLSStream;
+
+		[_delegates broadcastSelector: @selector(
+						   connectionWillUpgradeToTLS:)
+				   withObject: self];
+
+		TLSStream = [OFTLSStream streamWithStream: _stream];
+		TLSStream.certificateChain = _certificateChain;
+		TLSStream.delegate = self;
+
+		/* The stream is started once the handshake completed. */
+		_upgradingToTLS = true;
+
+		/* XEP-0368 requires the domain to be used for SNI. */
+		[TLSStream asyncPerformClientHandshakeWithHost: _domainToASCII];
+
+		return;
+	}
+
 	[self xmpp_startStream];
+	[self xmpp_asyncRead];
+}
 
-	[_stream asyncReadIntoBuffer: _buffer
-			      length: XMPPConnectionBufferLength];
+- (void)xmpp_connectToHost: (OFString *)host
+		      port: (uint16_t)port
+		 directTLS: (bool)directTLS
+{
+	OFTCPSocket *sock = [OFTCPSocket socket];
+
+	sock.delegate = self;
+	[_connectingSockets addObject: sock];
+
+	if (directTLS)
+		[_directTLSSockets addObject: sock];
+
+	[sock asyncConnectToHost: host port: port];
 }
 
 - (void)xmpp_tryNextSRVRecord
 {
-	OFSRVDNSResourceRecord *record =
-	    [[[_nextSRVRecords objectAtIndex: 0] copy] autorelease];
+	OFSRVDNSResourceRecord *record;
 
-	if (_nextSRVRecords.count == 0) {
-		[_nextSRVRecords release];
-		_nextSRVRecords = nil;
-	}
+	[_nextSRVRecordTimer invalidate];
+	[_nextSRVRecordTimer release];
+	_nextSRVRecordTimer = nil;
+
+	if (_nextSRVRecords.count == 0)
+		return;
+
+	record = [[[_nextSRVRecords objectAtIndex: 0] retain] autorelease];
+	[_nextSRVRecords removeObjectAtIndex: 0];
 
-	[_stream asyncConnectToHost: record.target port: record.port];
+	[self xmpp_connectToHost: record.target
+			    port: record.port
+		       directTLS: [_directTLSRecords
+				      containsObjectIdenticalTo: record]];
+
+	/*
+	 * Don't wait for a timeout of this attempt before trying the next
+	 * record, but race them after a short delay.
+	 */
+	if (_nextSRVRecords.count > 0)
+		_nextSRVRecordTimer = [[OFTimer
+		    scheduledTimerWithTimeInterval: _connectionAttemptDelay
+					    target: self
+					  selector: @selector(
+							xmpp_tryNextSRVRecord)
+					   repeats: false] retain];
 }
 
 -  (void)resolver: (OFDNSResolver *)resolver
@@ -300,28 +705,47 @@
 	 response: (OFDNSResponse *)response
 	exception: (id)exception
 {
-	OFMutableArray *records = [OFMutableArray array];
+	bool directTLS = [domainName hasPrefix: @"_xmpps-client."];
+
+	/* The connection was closed while waiting for the response. */
+	if (!_connecting)
+		return;
 
 	if (exception != nil)
 		response = nil;
 
 	for (OFDNSResourceRecord *record in
-	    [response.answerRecords objectForKey: domainName])
-		if ([record isKindOfClass: [OFSRVDNSResourceRecord class]])
-		       [records addObject: record];
+	    [response.answerRecords objectForKey: domainName]) {
+		if (![record isKindOfClass: [OFSRVDNSResourceRecord class]])
+			continue;
+
+		/* A target of "." means the service is not available. */
+		if ([[(OFSRVDNSResourceRecord *)record target] isEqual: @"."])
+			continue;
+
+		[_SRVRecords addObject: record];
 
-	/* TODO: Sort records */
-	[records makeImmutable];
+		if (directTLS)
+			[_directTLSRecords addObject: record];
+	}
+
+	/* Wait until all queries have been answered. */
+	if (--_pendingSRVQueries > 0)
+		return;
 
-	if (records.count == 0) {
+	if (_SRVRecords.count == 0) {
 		/* Fall back to A / AAAA record. */
-		[_stream asyncConnectToHost: _domainToASCII port: _port];
+		[self xmpp_connectToHost: _domainToASCII
+				    port: _port
+			       directTLS: false];
 		return;
 	}
 
 	[_nextSRVRecords release];
 	_nextSRVRecords = nil;
-	_nextSRVRecords = [records mutableCopy];
+	_nextSRVRecords =
+	    [sortSRVRecords(_SRVRecords, _directTLSRecords) mutableCopy];
+	[_SRVRecords removeAllObjects];
 	[self xmpp_tryNextSRVRecord];
 }
 
@@ -329,23 +753,45 @@
 {
 	void *pool = objc_autoreleasePoolPush();
 
-	if (_stream != nil)
+	if (_stream != nil || _connecting)
 		@throw [OFAlreadyOpenException exceptionWithObject: self];
 
-	_stream = [[OFTCPSocket alloc] init];
-	[_stream setDelegate: self];
+	_connecting = true;
 
 	if (_server != nil)
-		[_stream asyncConnectToHost: _server port: _port];
+		[self xmpp_connectToHost: _server
+				    port: _port
+			       directTLS: _usesDirectTLS];
 	else {
+		OFDNSResolver *resolver = _DNSResolver;
 		OFString *SRVDomain = [@"_xmpp-client._tcp."
 		    stringByAppendingString: _domainToASCII];
 		OFDNSQuery *query = [OFDNSQuery
 		    queryWithDomainName: SRVDomain
 			       DNSClass: OFDNSClassIN
 			     recordType: OFDNSRecordTypeSRV];
-		[[OFThread DNSResolver] asyncPerformQuery: query
-						 delegate: self];
+
+		if (resolver == nil)
+			resolver = [OFThread DNSResolver];
+
+		[_SRVRecords removeAllObjects];
+		[_directTLSRecords removeAllObjects];
+		_pendingSRVQueries = 1;
+
+		if (_usesDirectTLS) {
+			OFString *directTLSDomain = [@"_xmpps-client._tcp."
+			    stringByAppendingString: _domainToASCII];
+			OFDNSQuery *directTLSQuery = [OFDNSQuery
+			    queryWithDomainName: directTLSDomain
+				       DNSClass: OFDNSClassIN
+				     recordType: OFDNSRecordTypeSRV];
+
+			_pendingSRVQueries++;
+			[resolver asyncPerformQuery: directTLSQuery
+					   delegate: self];
+		}
+
+		[resolver asyncPerformQuery: query delegate: self];
 	}
 
 	objc_autoreleasePoolPop(pool);
@@ -372,6 +818,51 @@
 	return true;
 }
 
+- (void)xmpp_asyncRead
+{
+	if (_buffer == NULL) {
+		_buffer = OFAllocMemory(1, _readBufferSize);
+		_bufferLength = _readBufferSize;
+	}
+
+	[_stream asyncReadIntoBuffer: _buffer length: _bufferLength];
+}
+
+- (bool)xmpp_adaptReadBufferToLength: (size_t)length
+{
+	size_t newLength;
+
+	if (length == _bufferLength) {
+		/* The read filled the buffer, so there is likely more. */
+		_shortReadsCount = 0;
+
+		if (_bufferLength >= _maximumReadBufferSize)
+			return false;
+
+		newLength = _bufferLength * 2;
+		if (newLength > _maximumReadBufferSize)
+			newLength = _maximumReadBufferSize;
+	} else if (length < _bufferLength / 4 &&
+	    _bufferLength > _readBufferSize) {
+		if (++_shortReadsCount < SHRINK_THRESHOLD)
+			return false;
+
+		_shortReadsCount = 0;
+
+		newLength = _bufferLength / 2;
+		if (newLength < _readBufferSize)
+			newLength = _readBufferSize;
+	} else {
+		_shortReadsCount = 0;
+		return false;
+	}
+
+	_buffer = OFResizeMemory(_buffer, 1, newLength);
+	_bufferLength = newLength;
+
+	return true;
+}
+
 - (void)parseBuffer: (const void *)buffer length: (size_t)length
 {
 	[self xmpp_parseBuffer: buffer length: length];
@@ -409,15 +900,23 @@
 		return false;
 	}
 
-	if (_oldParser != nil || _oldElementBuilder != nil) {
+	/* Reading continues once the TLS handshake completed. */
+	if (_upgradingToTLS)
+		return false;
+
+	/*
+	 * The buffer may only be resized while no read is pending, so a new
+	 * read needs to be started if it was.
+	 */
+	if ([self xmpp_adaptReadBufferToLength: length] ||
+	    _oldParser != nil || _oldElementBuilder != nil) {
 		[_oldParser release];
 		[_oldElementBuilder release];
 
 		_oldParser = nil;
 		_oldElementBuilder = nil;
 
-		[_stream asyncReadIntoBuffer: _buffer
-				      length: XMPPConnectionBufferLength];
+		[self xmpp_asyncRead];
 		return false;
 	}
 
@@ -430,66 +929,286 @@
 			   withObject: self
 			   withObject: element];
 
-	[_stream writeString: element.XMLString];
+	[XMPPXMLSerializer appendElement: element toData: _writeBuffer];
+	[self xmpp_didBufferData];
+}
+
+- (void)xmpp_writeString: (OFString *)string
+{
+	[_writeBuffer addItems: string.UTF8String
+			 count: string.UTF8StringLength];
+	[self xmpp_didBufferData];
+}
+
+- (void)xmpp_didBufferData
+{
+	if (_writeBuffer.count >= _writeFlushThreshold) {
+		[self flush];
+		return;
+	}
+
+	if (_flushesAtEndOfRunLoopIteration && !_flushScheduled) {
+		_flushScheduled = true;
+		[self performSelector: @selector(xmpp_scheduledFlush)
+			   afterDelay: 0];
+	}
+}
+
+- (void)flush
+{
+	size_t count = _writeBuffer.count;
+
+	/* Writing is not possible in the middle of the TLS handshake. */
+	if (count == 0 || _upgradingToTLS)
+		return;
+
+	@try {
+		[_stream writeBuffer: _writeBuffer.items length: count];
+	} @finally {
+		[_writeBuffer removeAllItems];
+	}
+
+	if (_stream != nil) {
+		_numberOfBytesWritten += count;
+		_numberOfWrites++;
+	}
+}
+
+- (void)xmpp_scheduledFlush
+{
+	_flushScheduled = false;
+
+	@try {
+		[self flush];
+	} @catch (id e) {
+		[_delegates broadcastSelector: @selector(connection:
+						   didThrowException:)
+				   withObject: self
+				   withObject: e];
+		_streamOpen = false;
+		[self close];
+	}
+}
+
+-   (void)sendIQ: (XMPPIQ *)IQ
+  callbackTarget: (id)target
+	selector: (SEL)selector
+{
+	[self	    sendIQ: IQ
+	    callbackTarget: target
+		  selector: selector
+		   timeout: _IQTimeout];
 }
 
 -   (void)sendIQ: (XMPPIQ *)IQ
   callbackTarget: (id)target
 	selector: (SEL)selector
+	 timeout: (OFTimeInterval)timeout
+{
+	[self xmpp_sendIQ: IQ
+		 callback: [XMPPCallback callbackWithTarget: target
+						   selector: selector]
+		  timeout: timeout];
+}
+
+#ifdef OF_HAVE_BLOCKS
+-  (void)sendIQ: (XMPPIQ *)IQ callbackBlock: (XMPPCallbackBlock)block
+{
+	[self sendIQ: IQ callbackBlock: block timeout: _IQTimeout];
+}
+
+-  (void)sendIQ: (XMPPIQ *)IQ
+  callbackBlock: (XMPPCallbackBlock)block
+	timeout: (OFTimeInterval)timeout
+{
+	[self xmpp_sendIQ: IQ
+		 callback: [XMPPCallback callbackWithBlock: block]
+		  timeout: timeout];
+}
+#endif
+
+- (void)xmpp_sendIQ: (XMPPIQ *)IQ
+	   callback: (XMPPCallback *)callback
+	    timeout: (OFTimeInterval)timeout
 {
 	void *pool = objc_autoreleasePoolPush();
-	XMPPCallback *callback;
-	OFString *ID, *key;
+	XMPPPendingIQ *pending = [[[XMPPPendingIQ alloc] init] autorelease];
+	OFString *ID;
+	unsigned long key;
 
 	if ((ID = IQ.ID) == nil) {
 		ID = [self generateStanzaID];
 		IQ.ID = ID;
 	}
 
-	if ((key = IQ.to.fullJID) == nil)
-		key = _JID.bareJID;
-	if (key == nil) // Only happens for resource bind
-		key = @"bind";
-	key = [key stringByAppendingString: ID];
+	/* There can only be one callback per ID. */
+	[self cancelCallbackForIQWithID: ID];
+
+	/*
+	 * If the number is already used by an ID that was mapped to it, the
+	 * caller made the ID up and it needs to be mapped as well.
+	 */
+	if (!parseStanzaID(ID, &key) || key > _lastID ||
+	    [_pendingIQs objectForKey: (void *)(uintptr_t)key] != nil) {
+		/* Not generated by us, so map it to an unused number. */
+		key = ++_lastID;
+		pending->_foreignID = true;
+		[_foreignIQIDs setObject: [OFNumber numberWithUnsignedLong: key]
+				  forKey: ID];
+	}
 
-	callback = [XMPPCallback callbackWithTarget: target selector: selector];
-	[_callbacks setObject: callback forKey: key];
+	pending->_callback = [callback retain];
+	pending->_ID = [ID copy];
+	pending->_to = [IQ.to copy];
+	pending->_key = key;
+
+	if (timeout > 0)
+		pending->_deadline =
+		    [OFDate date].timeIntervalSince1970 + timeout;
+
+	pending->_listItem = [_pendingIQsList appendObject: pending];
+	[_pendingIQs setObject: pending forKey: (void *)(uintptr_t)key];
+
+	if (timeout > 0 && _IQTimeoutTimer == nil)
+		_IQTimeoutTimer = [[OFTimer
+		    scheduledTimerWithTimeInterval: IQ_TIMEOUT_CHECK_INTERVAL
+					    target: self
+					  selector: @selector(
+							xmpp_checkIQTimeouts)
+					   repeats: true] retain];
+
+	/* Keep memory bounded if responses never arrive. */
+	while (_pendingIQs.count > _maximumPendingIQs)
+		[self xmpp_failPendingIQ: _pendingIQsList.firstObject
+				    type: @"wait"
+			       condition: @"resource-constraint"];
 
 	objc_autoreleasePoolPop(pool);
 
 	[self sendStanza: IQ];
 }
 
-#ifdef OF_HAVE_BLOCKS
--  (void)sendIQ: (XMPPIQ *)IQ callbackBlock: (XMPPCallbackBlock)block
+- (XMPPPendingIQ *)xmpp_pendingIQWithID: (OFString *)ID
 {
-	void *pool = objc_autoreleasePoolPush();
-	XMPPCallback *callback;
-	OFString *ID, *key;
+	XMPPPendingIQ *pending;
+	OFNumber *foreignKey;
+	unsigned long key;
 
-	if ((ID = IQ.ID) == nil) {
-		ID = [self generateStanzaID];
-		IQ.ID = ID;
+	if (ID == nil)
+		return nil;
+
+	if (_foreignIQIDs.count > 0 &&
+	    (foreignKey = [_foreignIQIDs objectForKey: ID]) != nil)
+		key = foreignKey.unsignedLongValue;
+	else if (!parseStanzaID(ID, &key))
+		return nil;
+
+	pending = [_pendingIQs objectForKey: (void *)(uintptr_t)key];
+
+	if (pending == nil || ![pending->_ID isEqual: ID])
+		return nil;
+
+	return pending;
+}
+
+- (bool)xmpp_isResponse: (XMPPIQ *)IQ toPendingIQ: (XMPPPendingIQ *)pending
+{
+	XMPPJID *from = IQ.from;
+
+	if ([from isEqual: pending->_to])
+		return true;
+
+	/* Responses from our own account may omit the from attribute. */
+	if (pending->_to == nil)
+		return (from == nil || (from.resource == nil &&
+		    [from isEqualToBareJID: _JID]));
+	if (from == nil)
+		return (pending->_to.resource == nil &&
+		    [pending->_to isEqualToBareJID: _JID]);
+
+	return false;
+}
+
+- (void)xmpp_removePendingIQ: (XMPPPendingIQ *)pending
+{
+	[[pending retain] autorelease];
+
+	[_pendingIQs removeObjectForKey: (void *)(uintptr_t)pending->_key];
+	[_pendingIQsList removeListItem: pending->_listItem];
+
+	if (pending->_foreignID)
+		[_foreignIQIDs removeObjectForKey: pending->_ID];
+
+	if (_pendingIQs.count == 0) {
+		[_IQTimeoutTimer invalidate];
+		[_IQTimeoutTimer release];
+		_IQTimeoutTimer = nil;
 	}
+}
 
-	if ((key = IQ.to.fullJID) == nil)
-		key = _JID.bareJID;
-	if (key == nil) // Connection not yet bound, can't send stanzas
-		@throw [OFInvalidArgumentException exception];
-	key = [key stringByAppendingString: ID];
+- (void)xmpp_failPendingIQ: (XMPPPendingIQ *)pending
+		      type: (OFString *)type
+		 condition: (OFString *)condition
+{
+	XMPPIQ *request = [XMPPIQ IQWithType: @"get" ID: pending->_ID];
+	XMPPIQ *error = [request errorIQWithType: type condition: condition];
 
-	callback = [XMPPCallback callbackWithBlock: block];
-	[_callbacks setObject: callback forKey: key];
+	error.from = pending->_to;
+	error.to = _JID;
+
+	[self xmpp_removePendingIQ: pending];
+	[pending->_callback runWithIQ: error connection: self];
+}
+
+- (void)xmpp_failAllPendingIQs
+{
+	OFMutableArray *pendingIQs =
+	    [OFMutableArray arrayWithCapacity: _pendingIQs.count];
+
+	for (XMPPPendingIQ *pending in _pendingIQsList)
+		[pendingIQs addObject: pending];
+
+	/* Callbacks may cancel other pending IQs. */
+	for (XMPPPendingIQ *pending in pendingIQs)
+		if ([_pendingIQs objectForKey:
+		    (void *)(uintptr_t)pending->_key] == pending)
+			[self xmpp_failPendingIQ: pending
+					    type: @"wait"
+				       condition: @"recipient-unavailable"];
+}
+
+- (void)xmpp_checkIQTimeouts
+{
+	void *pool = objc_autoreleasePoolPush();
+	OFTimeInterval now = [OFDate date].timeIntervalSince1970;
+	OFMutableArray *expired = [OFMutableArray array];
+
+	for (XMPPPendingIQ *pending in _pendingIQsList)
+		if (pending->_deadline > 0 && pending->_deadline <= now)
+			[expired addObject: pending];
+
+	/* Callbacks may cancel other pending IQs. */
+	for (XMPPPendingIQ *pending in expired)
+		if ([_pendingIQs objectForKey:
+		    (void *)(uintptr_t)pending->_key] == pending)
+			[self xmpp_failPendingIQ: pending
+					    type: @"wait"
+				       condition: @"remote-server-timeout"];
 
 	objc_autoreleasePoolPop(pool);
+}
 
-	[self sendStanza: IQ];
+- (void)cancelCallbackForIQWithID: (OFString *)ID
+{
+	XMPPPendingIQ *pending = [self xmpp_pendingIQWithID: ID];
+
+	if (pending != nil)
+		[self xmpp_removePendingIQ: pending];
 }
-#endif
 
 - (OFString *)generateStanzaID
 {
-	return [OFString stringWithFormat: @"objxmpp_%u", _lastID++];
+	return [OFString stringWithFormat: @"objxmpp_%lu", ++_lastID];
 }
 
 -    (void)parser: (OFXMLParser *)parser
@@ -535,27 +1254,216 @@
 - (void)elementBuilder: (OFXMLElementBuilder *)builder
        didBuildElement: (OFXMLElement *)element
 {
+	void *pool;
+	OFString *namespace;
+	XMPPElementHandler *handler = nil;
+
 	/* Ignore whitespace elements */
 	if (element.name == nil)
 		return;
 
+	pool = objc_autoreleasePoolPush();
+
 	[element setPrefix: @"stream" forNamespace: XMPPStreamNS];
 
 	[_delegates broadcastSelector: @selector(connection:didReceiveElement:)
 			   withObject: self
 			   withObject: element];
 
-	if ([element.namespace isEqual: XMPPClientNS])
-		[self xmpp_handleStanza: element];
+	/*
+	 * The name and namespace were interned by XMPPXMLElementBuilder, and
+	 * so were those of all handlers, so they can be looked up by pointer.
+	 */
+	namespace = element.namespace;
+	if (namespace != nil)
+		handler = [(OFMapTable *)[_elementHandlers
+		    objectForKey: namespace] objectForKey: element.name];
+
+	if (handler != nil)
+		[handler->_target performSelector: handler->_selector
+				       withObject: element
+				       withObject: self];
+	else if (namespace == XMPPClientNS)
+		[self xmpp_sendStreamError: @"unsupported-stanza-type"
+				      text: nil];
+
+	_streamingHandler = nil;
+	[_streamedStanza release];
+	_streamedStanza = nil;
+
+	objc_autoreleasePoolPop(pool);
+}
+
+-		   (bool)elementBuilder: (XMPPXMLElementBuilder *)builder
+  shouldStreamChildrenOfElement: (OFXMLElement *)element
+		      inElement: (OFXMLElement *)stanzaElement
+{
+	void *pool;
+	id <XMPPStreamingHandler> handler;
+	XMPPStanza *stanza;
+	Class stanzaClass;
+	bool ret;
+
+	/* The namespaces were interned by XMPPXMLElementBuilder. */
+	if (stanzaElement.namespace != XMPPClientNS ||
+	    element.namespace == nil)
+		return false;
+
+	handler = [_streamingHandlers objectForKey: element.namespace];
+	if (handler == nil)
+		return false;
+
+	if ([stanzaElement.name isEqual: @"iq"])
+		stanzaClass = [XMPPIQ class];
+	else if ([stanzaElement.name isEqual: @"message"])
+		stanzaClass = [XMPPMessage class];
+	else if ([stanzaElement.name isEqual: @"presence"])
+		stanzaClass = [XMPPPresence class];
+	else
+		return false;
+
+	pool = objc_autoreleasePoolPush();
+
+	stanza = [stanzaClass stanzaWithElement: stanzaElement];
+	ret = [handler connection: self
+	    shouldStreamChildrenOfElement: element
+				 inStanza: stanza];
+
+	if (ret) {
+		[_streamedStanza release];
+		_streamedStanza = [stanza retain];
+		_streamingHandler = handler;
+	}
+
+	objc_autoreleasePoolPop(pool);
+
+	return ret;
+}
+
+-     (void)elementBuilder: (XMPPXMLElementBuilder *)builder
+  didBuildChildElement: (OFXMLElement *)child
+	     ofElement: (OFXMLElement *)element
+	     inElement: (OFXMLElement *)stanzaElement
+{
+	void *pool = objc_autoreleasePoolPush();
+
+	[_streamingHandler connection: self
+	       didReceiveChildElement: child
+			    ofElement: element
+			     inStanza: _streamedStanza];
+
+	objc_autoreleasePoolPop(pool);
+}
+
+-  (void)registerHandlerWithTarget: (id)target
+			  selector: (SEL)selector
+		    forElementName: (OFString *)name
+			 namespace: (OFString *)namespace
+{
+	OFMapTable *handlers;
+	XMPPElementHandler *handler;
+
+	name = XMPPInternString(name);
+	namespace = XMPPInternString(namespace);
+
+	handlers = [_elementHandlers objectForKey: namespace];
+	if (handlers == nil) {
+		handlers = [[[OFMapTable alloc]
+		    initWithKeyFunctions: (OFMapTableFunctions){ NULL }
+			 objectFunctions: objectFunctions] autorelease];
+		[_elementHandlers setObject: handlers forKey: namespace];
+	}
+
+	handler = [[[XMPPElementHandler alloc] init] autorelease];
+	handler->_target = target;
+	handler->_selector = selector;
+
+	[handlers setObject: handler forKey: name];
+}
+
+-  (void)unregisterHandlerWithTarget: (id)target
+			    selector: (SEL)selector
+		      forElementName: (OFString *)name
+			   namespace: (OFString *)namespace
+{
+	OFMapTable *handlers;
+	XMPPElementHandler *handler;
+
+	name = XMPPInternedString(name);
+	namespace = XMPPInternedString(namespace);
+	handlers = [_elementHandlers objectForKey: namespace];
+	handler = [handlers objectForKey: name];
+
+	/* Don't remove a handler someone else registered in the meantime. */
+	if (handler == nil || handler->_target != target ||
+	    !sel_isEqual(handler->_selector, selector))
+		return;
+
+	[handlers removeObjectForKey: name];
+
+	if (handlers.count == 0)
+		[_elementHandlers removeObjectForKey: namespace];
+}
+
+- (void)registerIQHandler: (id <XMPPIQHandler>)handler
+	     forNamespace: (OFString *)namespace
+		     type: (OFString *)type
+{
+	OFMutableDictionary *handlers;
+
+	namespace = XMPPInternString(namespace);
 
-	if ([element.namespace isEqual: XMPPStreamNS])
-		[self xmpp_handleStream: element];
+	handlers = [_IQHandlers objectForKey: namespace];
+	if (handlers == nil) {
+		handlers = [OFMutableDictionary dictionary];
+		[_IQHandlers setObject: handlers forKey: namespace];
+	}
+
+	[handlers setObject: [OFValue valueWithNonretainedObject: handler]
+		     forKey: (type != nil ? (id)type : [OFNull null])];
+}
 
-	if ([element.namespace isEqual: XMPPStartTLSNS])
-		[self xmpp_handleTLS: element];
+- (void)unregisterIQHandler: (id <XMPPIQHandler>)handler
+	       forNamespace: (OFString *)namespace
+		       type: (OFString *)type
+{
+	OFMutableDictionary *handlers;
+	id key = (type != nil ? (id)type : [OFNull null]);
 
-	if ([element.namespace isEqual: XMPPSASLNS])
-		[self xmpp_handleSASL: element];
+	namespace = XMPPInternedString(namespace);
+	handlers = [_IQHandlers objectForKey: namespace];
+
+	/* Don't remove a handler someone else registered in the meantime. */
+	if ([[handlers objectForKey: key] nonretainedObjectValue] != handler)
+		return;
+
+	[handlers removeObjectForKey: key];
+
+	if (handlers.count == 0)
+		[_IQHandlers removeObjectForKey: namespace];
+}
+
+- (void)registerStreamingHandler: (id <XMPPStreamingHandler>)handler
+		    forNamespace: (OFString *)namespace
+{
+	[_streamingHandlers setObject: handler
+			       forKey: XMPPInternString(namespace)];
+}
+
+- (void)unregisterStreamingHandler: (id <XMPPStreamingHandler>)handler
+		      forNamespace: (OFString *)namespace
+{
+	namespace = XMPPInternedString(namespace);
+
+	/* Don't remove a handler someone else registered in the meantime. */
+	if ([_streamingHandlers objectForKey: namespace] != handler)
+		return;
+
+	/* Don't pass the remaining children to a handler that is gone. */
+	if (handler == _streamingHandler)
+		_streamingHandler = nil;
+
+	[_streamingHandlers removeObjectForKey: namespace];
 }
 
 - (void)elementBuilder: (OFXMLElementBuilder *)builder
@@ -595,203 +1503,263 @@
 		langString = [OFString stringWithFormat: @"xml:lang='%@' ",
 							 _language];
 
-	[_stream writeFormat: @"<?xml version='1.0'?>\n"
-			      @"<stream:stream to='%@' "
-			      @"xmlns='%@' "
-			      @"xmlns:stream='%@' %@"
-			      @"version='1.0'>",
-			      _domain, 
-			      XMPPClientNS,
-			      XMPPStreamNS,
-			      langString];
+	[self xmpp_writeString: [OFString stringWithFormat:
+	    @"<?xml version='1.0'?>\n"
+	    @"<stream:stream to='%@' "
+	    @"xmlns='%@' "
+	    @"xmlns:stream='%@' %@"
+	    @"version='1.0'>",
+	    _domain,
+	    XMPPClientNS,
+	    XMPPStreamNS,
+	    langString]];
 
 	_streamOpen = true;
 }
 
 - (void)close
 {
-	if (_streamOpen)
-		[_stream writeString: @"</stream:stream>"];
+	if (!_upgradingToTLS) {
+		if (_streamOpen)
+			[self xmpp_writeString: @"</stream:stream>"];
+
+		[self flush];
+	}
+
+	[_writeBuffer removeAllItems];
 
 	[_oldParser release];
 	_oldParser = nil;
 	[_oldElementBuilder release];
 	_oldElementBuilder = nil;
+	[_connectingSockets removeAllObjects];
+	[_directTLSSockets removeAllObjects];
+	[_SRVRecords removeAllObjects];
+	[_directTLSRecords removeAllObjects];
+	[_nextSRVRecordTimer invalidate];
+	[_nextSRVRecordTimer release];
+	_nextSRVRecordTimer = nil;
+	[_nextSRVRecords release];
+	_nextSRVRecords = nil;
+	_connecting = false;
 	[_authModule release];
 	_authModule = nil;
 	[_stream release];
 	_stream = nil;
 	[_JID release];
 	_JID = nil;
-	_streamOpen = _needsSession = _encrypted = false;
+	_streamOpen = _needsSession = _encrypted = _upgradingToTLS = false;
 	_supportsRosterVersioning = _supportsStreamManagement = false;
-	_lastID = 0;
+
+	/* IDs are not reset, so late responses can't match new IQs. */
+	[self xmpp_failAllPendingIQs];
 }
 
-- (void)xmpp_handleStanza: (OFXMLElement *)element
+- (void)xmpp_handleIQElement: (OFXMLElement *)element
+		  connection: (XMPPConnection *)connection
 {
-	if ([element.name isEqual: @"iq"]) {
-		[self xmpp_handleIQ: [XMPPIQ stanzaWithElement: element]];
-		return;
-	}
-
-	if ([element.name isEqual: @"message"]) {
-		[self xmpp_handleMessage:
-		    [XMPPMessage stanzaWithElement: element]];
-		return;
-	}
-
-	if ([element.name isEqual: @"presence"]) {
-		[self xmpp_handlePresence:
-		    [XMPPPresence stanzaWithElement: element]];
-		return;
-	}
-
-	[self xmpp_sendStreamError: @"unsupported-stanza-type" text: nil];
+	[self xmpp_handleIQ: [XMPPIQ stanzaWithElement: element]];
 }
 
-
-- (void)xmpp_handleStream: (OFXMLElement *)element
+- (void)xmpp_handleMessageElement: (OFXMLElement *)element
+		       connection: (XMPPConnection *)connection
 {
-	if ([element.name isEqual: @"features"]) {
-		[self xmpp_handleFeatures: element];
-		return;
-	}
+	[_delegates broadcastSelector: @selector(connection:didReceiveMessage:)
+			   withObject: self
+			   withObject: [XMPPMessage stanzaWithElement: element]];
+}
 
-	if ([element.name isEqual: @"error"]) {
-		OFString *condition, *reason;
-		[self close];
+- (void)xmpp_handlePresenceElement: (OFXMLElement *)element
+			connection: (XMPPConnection *)connection
+{
+	[_delegates broadcastSelector: @selector(connection:didReceivePresence:)
+			   withObject: self
+			   withObject: [XMPPPresence stanzaWithElement: element]];
+}
 
-		[_delegates broadcastSelector: @selector(connectionWasClosed:)
-				   withObject: self
-				   withObject: element];
+- (void)xmpp_handleStreamError: (OFXMLElement *)element
+		    connection: (XMPPConnection *)connection
+{
+	OFString *condition, *reason;
+	[self close];
 
-		condition = [[element elementsForNamespace: XMPPXMPPStreamNS]
-		    .firstObject name];
+	[_delegates broadcastSelector: @selector(connectionWasClosed:error:)
+			   withObject: self
+			   withObject: element];
 
-		if (condition == nil)
-			condition = @"undefined";
+	condition = [[element elementsForNamespace: XMPPXMPPStreamNS]
+	    .firstObject name];
 
-		reason = [element elementForName: @"text"
-				       namespace: XMPPXMPPStreamNS].stringValue;
+	if (condition == nil)
+		condition = @"undefined";
 
-		@throw [XMPPStreamErrorException
-		    exceptionWithConnection: self
-				  condition: condition
-				     reason: reason];
-		return;
-	}
+	reason = [element elementForName: @"text"
+			       namespace: XMPPXMPPStreamNS].stringValue;
 
-	assert(0);
+	@throw [XMPPStreamErrorException
+	    exceptionWithConnection: self
+			  condition: condition
+			     reason: reason];
 }
 
-- (void)xmpp_handleTLS: (OFXMLElement *)element
+- (void)xmpp_handleTLSProceed: (OFXMLElement *)element
+		   connection: (XMPPConnection *)connection
 {
-	if ([element.name isEqual: @"proceed"]) {
-		OFTLSStream *newStream;
+	OFTLSStream *newStream;
 
-		[_delegates broadcastSelector: @selector(
-						   connectionWillUpgradeToTLS:)
-				   withObject: self];
+	[_delegates broadcastSelector: @selector(connectionWillUpgradeToTLS:)
+			   withObject: self];
 
-		newStream = [OFTLSStream streamWithStream: _stream];
-		newStream.certificateChain = _certificateChain;
+	newStream = [OFTLSStream streamWithStream: _stream];
+	newStream.certificateChain = _certificateChain;
+	newStream.delegate = self;
 
-		/* TODO: async */
-		[newStream performClientHandshakeWithHost: _server];
+	/* Reading and writing are suspended until the handshake completed. */
+	_upgradingToTLS = true;
 
-		[_stream release];
-		_stream = [newStream retain];
-		[_stream setDelegate: self];
+	/*
+	 * The certificate needs to be valid for the domain, not for the server
+	 * that was connected to, which is nil if it was looked up via SRV.
+	 */
+	[newStream asyncPerformClientHandshakeWithHost: _domainToASCII];
+}
 
-		_encrypted = true;
+- (void)xmpp_handleTLSFailure: (OFXMLElement *)element
+		   connection: (XMPPConnection *)connection
+{
+	/* TODO: Find/create an exception to throw here */
+	@throw [OFException exception];
+}
 
-		[_delegates broadcastSelector: @selector(
-						   connectionDidUpgradeToTLS:)
-				   withObject: self];
+-			  (void)stream: (OFTLSStream *)stream
+  didPerformClientHandshakeWithHost: (OFString *)host
+			     exception: (id)exception
+{
+	/* The connection was closed while performing the handshake. */
+	if (!_upgradingToTLS || stream.underlyingStream != _stream)
+		return;
 
-		/* Stream restart */
-		[self xmpp_startStream];
+	_upgradingToTLS = false;
 
+	if (exception != nil) {
+		[_delegates broadcastSelector: @selector(connection:
+						   didThrowException:)
+				   withObject: self
+				   withObject: exception];
+		[self close];
 		return;
 	}
 
-	if ([element.name isEqual: @"failure"])
-		/* TODO: Find/create an exception to throw here */
-		@throw [OFException exception];
+	[_stream release];
+	_stream = [stream retain];
 
-	assert(0);
-}
+	_encrypted = true;
 
-- (void)xmpp_handleSASL: (OFXMLElement *)element
-{
-	if ([element.name isEqual: @"challenge"]) {
-		OFXMLElement *responseTag;
-		OFData *challenge =
-		    [OFData dataWithBase64EncodedString: element.stringValue];
-		OFData *response = [_authModule continueWithData: challenge];
+	[_delegates broadcastSelector: @selector(connectionDidUpgradeToTLS:)
+			   withObject: self];
 
-		responseTag = [OFXMLElement elementWithName: @"response"
-						  namespace: XMPPSASLNS];
-		if (response) {
-			if (response.count == 0)
-				responseTag.stringValue = @"=";
-			else
-				responseTag.stringValue =
-				    response.stringByBase64Encoding;
-		}
-
-		[self sendStanza: responseTag];
-		return;
-	}
+	/* Stream restart */
+	[self xmpp_startStream];
 
-	if ([element.name isEqual: @"success"]) {
-		[_authModule continueWithData: [OFData
-		    dataWithBase64EncodedString: element.stringValue]];
+	/* We are not inside the old parser, so it can be released now. */
+	[_oldParser release];
+	[_oldElementBuilder release];
 
-		[_delegates broadcastSelector: @selector(
-						   connectionWasAuthenticated:)
-				   withObject: self];
+	_oldParser = nil;
+	_oldElementBuilder = nil;
 
-		/* Stream restart */
-		[self xmpp_startStream];
+	[self xmpp_asyncRead];
+}
 
-		return;
+- (void)xmpp_handleSASLChallenge: (OFXMLElement *)element
+		      connection: (XMPPConnection *)connection
+{
+	OFXMLElement *responseTag;
+	OFData *challenge =
+	    [OFData dataWithBase64EncodedString: element.stringValue];
+	OFData *response = [_authModule continueWithData: challenge];
+
+	responseTag = [OFXMLElement elementWithName: @"response"
+					  namespace: XMPPSASLNS];
+	if (response) {
+		if (response.count == 0)
+			responseTag.stringValue = @"=";
+		else
+			responseTag.stringValue =
+			    response.stringByBase64Encoding;
 	}
 
-	if ([element.name isEqual: @"failure"]) {
-		/* FIXME: Do more parsing/handling */
-		@throw [XMPPAuthFailedException
-		    exceptionWithConnection: self
-				     reason: element.XMLString];
-	}
+	[self sendStanza: responseTag];
+}
 
-	assert(0);
+- (void)xmpp_handleSASLSuccess: (OFXMLElement *)element
+		    connection: (XMPPConnection *)connection
+{
+	[_authModule continueWithData: [OFData
+	    dataWithBase64EncodedString: element.stringValue]];
+
+	[_delegates broadcastSelector: @selector(connectionWasAuthenticated:)
+			   withObject: self];
+
+	/* Stream restart */
+	[self xmpp_startStream];
+}
+
+- (void)xmpp_handleSASLFailure: (OFXMLElement *)element
+		    connection: (XMPPConnection *)connection
+{
+	/* FIXME: Do more parsing/handling */
+	@throw [XMPPAuthFailedException
+	    exceptionWithConnection: self
+			     reason: element.XMLString];
 }
 
 - (void)xmpp_handleIQ: (XMPPIQ *)IQ
 {
 	bool handled = false;
-	XMPPCallback *callback;
-	OFString *key;
-
-	if ((key = IQ.from.fullJID) == nil)
-		key = _JID.bareJID;
-	if (key == nil)
-		/* Only happens for resource bind */
-		key = @"bind";
-	key = [key stringByAppendingString: IQ.ID];
-
-	if ((callback = [_callbacks objectForKey: key])) {
-		[callback runWithIQ: IQ connection: self];
-		[_callbacks removeObjectForKey: key];
-		return;
+
+	if ([IQ.type isEqual: @"result"] || [IQ.type isEqual: @"error"]) {
+		XMPPPendingIQ *pending = [self xmpp_pendingIQWithID: IQ.ID];
+
+		if (pending != nil &&
+		    [self xmpp_isResponse: IQ toPendingIQ: pending]) {
+			[self xmpp_removePendingIQ: pending];
+			[pending->_callback runWithIQ: IQ connection: self];
+			return;
+		}
+	}
+
+	for (OFXMLNode *child in IQ.children) {
+		OFString *namespace;
+		OFMutableDictionary *handlers = nil;
+		OFValue *handler;
+
+		if (![child isKindOfClass: [OFXMLElement class]])
+			continue;
+
+		/* Interned by XMPPXMLElementBuilder, see above. */
+		namespace = ((OFXMLElement *)child).namespace;
+		if (namespace != nil)
+			handlers = [_IQHandlers objectForKey: namespace];
+
+		if (handlers != nil && IQ.type != nil)
+			handler = [handlers objectForKey: IQ.type];
+		else
+			handler = nil;
+		if (handler == nil)
+			handler = [handlers objectForKey: [OFNull null]];
+
+		handled = [handler.nonretainedObjectValue connection: self
+							    handleIQ: IQ];
+
+		break;
 	}
 
-	handled = [_delegates broadcastSelector: @selector(
-						     connection:didReceiveIQ:)
-				     withObject: self
-				     withObject: IQ];
+	if (!handled)
+		handled = [_delegates
+		    broadcastSelector: @selector(connection:didReceiveIQ:)
+			   withObject: self
+			   withObject: IQ];
 
 	if (!handled && ![IQ.type isEqual: @"error"] &&
 	    ![IQ.type isEqual: @"result"]) {
@@ -800,21 +1768,8 @@
 	}
 }
 
-- (void)xmpp_handleMessage: (XMPPMessage *)message
-{
-	[_delegates broadcastSelector: @selector(connection:didReceiveMessage:)
-			   withObject: self
-			   withObject: message];
-}
-
-- (void)xmpp_handlePresence: (XMPPPresence *)presence
-{
-	[_delegates broadcastSelector: @selector(connection:didReceivePresence:)
-			   withObject: self
-			   withObject: presence];
-}
-
 - (void)xmpp_handleFeatures: (OFXMLElement *)element
+		 connection: (XMPPConnection *)connection
 {
 	OFXMLElement *startTLS = [element elementForName: @"starttls"
 					       namespace: XMPPStartTLSNS];
@@ -910,7 +1865,11 @@
 		_needsSession = true;
 
 	if (bind != nil) {
-		[self xmpp_sendResourceBind];
+		if (![_delegates broadcastSelector: @selector(
+							connectionWillBindResource:)
+					withObject: self])
+			[self xmpp_sendResourceBind];
+
 		return;
 	}
 
@@ -951,10 +1910,12 @@
 
 	[IQ addChild: bind];
 
+	/* Without a bound resource there is nothing left to do anyway. */
 	[self	    sendIQ: IQ
 	    callbackTarget: self
 		  selector: @selector(xmpp_handleResourceBindForConnection:
-				IQ:)];
+				IQ:)
+		   timeout: 0];
 }
 
 - (void)xmpp_sendStreamError: (OFString *)condition
@@ -979,15 +1940,28 @@
 - (void)xmpp_handleResourceBindForConnection: (XMPPConnection *)connection
 					  IQ: (XMPPIQ *)IQ
 {
-	OFXMLElement *bindElement, *JIDElement;
+	OFXMLElement *bindElement, *JIDElement = nil;
 
-	assert([IQ.type isEqual: @"result"]);
+	/* The connection was closed before the response was received. */
+	if (_stream == nil)
+		return;
 
-	bindElement = [IQ elementForName: @"bind" namespace: XMPPBindNS];
+	/*
+	 * This also handles the IQ failing locally, e.g. because too many
+	 * IQs were pending.
+	 */
+	if ([IQ.type isEqual: @"result"]) {
+		bindElement = [IQ elementForName: @"bind"
+				       namespace: XMPPBindNS];
+		JIDElement = [bindElement elementForName: @"jid"
+					       namespace: XMPPBindNS];
+	}
 
-	assert(bindElement != nil);
+	if (JIDElement == nil) {
+		[self xmpp_failEstablishingSession];
+		return;
+	}
 
-	JIDElement = [bindElement elementForName: @"jid" namespace: XMPPBindNS];
 	_JID = [[XMPPJID alloc] initWithString: JIDElement.stringValue];
 
 	if (_needsSession) {
@@ -1000,6 +1974,20 @@
 			   withObject: _JID];
 }
 
+- (void)xmpp_didResumeWithJID: (XMPPJID *)JID
+{
+	XMPPJID *old = _JID;
+	_JID = [JID copy];
+	[old release];
+
+	/* The session was already established for the resumed stream. */
+	_needsSession = false;
+
+	[_delegates broadcastSelector: @selector(connection:wasResumedWithJID:)
+			   withObject: self
+			   withObject: _JID];
+}
+
 - (void)xmpp_sendSession
 {
 	XMPPIQ *IQ = [XMPPIQ IQWithType: @"set" ID: [self generateStanzaID]];
@@ -1009,41 +1997,48 @@
 
 	[self	    sendIQ: IQ
 	    callbackTarget: self
-		  selector: @selector(xmpp_handleSessionForConnection:IQ:)];
+		  selector: @selector(xmpp_handleSessionForConnection:IQ:)
+		   timeout: 0];
 }
 
 - (void)xmpp_handleSessionForConnection: (XMPPConnection *)connection
 				     IQ: (XMPPIQ *)IQ
 {
-	if (![IQ.type isEqual: @"result"])
-		OFEnsure(0);
+	/* The connection was closed before the response was received. */
+	if (_stream == nil)
+		return;
+
+	/* See -[xmpp_handleResourceBindForConnection:IQ:]. */
+	if (![IQ.type isEqual: @"result"]) {
+		[self xmpp_failEstablishingSession];
+		return;
+	}
 
 	[_delegates broadcastSelector: @selector(connection:wasBoundToJID:)
 			   withObject: self
 			   withObject: _JID];
 }
 
+- (void)xmpp_failEstablishingSession
+{
+	[_delegates broadcastSelector: @selector(connection:didThrowException:)
+			   withObject: self
+			   withObject: [XMPPException
+					   exceptionWithConnection: self]];
+	[self close];
+}
+
 - (OFString *)xmpp_IDNAToASCII: (OFString *)domain
 {
-	OFString *ret;
-	char *cDomain;
-	Idna_rc rc;
+	OFString *ret = XMPPIDNAToASCII(domain);
 
-	if ((rc = idna_to_ascii_8z(domain.UTF8String,
-	    &cDomain, IDNA_USE_STD3_ASCII_RULES)) != IDNA_SUCCESS)
+	if (ret == nil)
 		@throw [XMPPIDNATranslationFailedException
 		    exceptionWithConnection: self
 				  operation: @"ToASCII"
 				     string: domain];
 
-	@try {
-		ret = [[OFString alloc] initWithUTF8StringNoCopy: cDomain
-						    freeWhenDone: true];
-	} @catch (id e) {
-		free(cDomain);
-	}
-
-	return ret;
+	return [ret retain];
 }
 
 - (void)setDataStorage: (id <XMPPStorage>)dataStorage
@@ -38,6 +38,7 @@ OF_ASSUME_NONNULL_BEGIN
 {
 	XMPPRosterItem *_rosterItem;
 	OFMutableDictionary *_presences;
+	OFMutableArray OF_GENERIC(XMPPPresence *) *_orderedPresences;
 	XMPPJID *_lockedOnJID;
 }
 
@@ -51,9 +52,31 @@ OF_ASSUME_NONNULL_BEGIN
  */
 @property (readonly, nonatomic) OFDictionary *presences;
 
+/*!
+ * The available presence of the contact with the highest priority, or nil if
+ * the contact is not available.
+ *
+ * If several resources have the same priority, the one with the better show
+ * value wins, and if that is the same as well, the most recent one. The
+ * presences are kept in this order when they change, so this is cheap.
+ */
+@property OF_NULLABLE_PROPERTY (readonly, nonatomic)
+    XMPPPresence *highestPriorityPresence;
+
+/*!
+ * The JID messages to the contact are best sent to.
+ *
+ * This is the full JID of the @ref highestPriorityPresence, or the bare JID of
+ * the contact if it is not available or its highest priority is negative.
+ */
+@property (readonly, nonatomic) XMPPJID *routingJID;
+
 /*!
  * @brief Sends a message to the contact honoring resource locking
  *
+ * If the contact is not locked on a resource, the message is sent to the
+ * @ref routingJID.
+ *
  * @param message The message to send
  * @param connection The connection to use for sending the message
  */
@@ -26,8 +26,29 @@
 #import "XMPPConnection.h"
 #import "XMPPJID.h"
 #import "XMPPMessage.h"
+#import "XMPPPresence.h"
+#import "XMPPPresence+Private.h"
 #import "XMPPRosterItem.h"
 
+/* Orders the better presence first. */
+static OFComparisonResult
+comparePresences(XMPPPresence *presence1, XMPPPresence *presence2)
+{
+	/*
+	 * Higher priorities are better, but lower show values are better, so
+	 * the show bits of the sort key are inverted to get a single rank.
+	 */
+	const int showMask = (1 << XMPPPresenceSortKeyShowBits) - 1;
+	int rank1 = presence1.xmpp_sortKey ^ showMask;
+	int rank2 = presence2.xmpp_sortKey ^ showMask;
+
+	if (rank1 != rank2)
+		return (rank1 > rank2
+		    ? OFOrderedAscending : OFOrderedDescending);
+
+	return OFOrderedSame;
+}
+
 @implementation XMPPContact
 @synthesize rosterItem = _rosterItem;
 @synthesize presences = _presences;
@@ -38,6 +59,7 @@
 
 	@try {
 		_presences = [[OFMutableDictionary alloc] init];
+		_orderedPresences = [[OFMutableArray alloc] init];
 	} @catch (id e) {
 		[self release];
 		@throw e;
@@ -49,15 +71,36 @@
 - (void)dealloc
 {
 	[_presences release];
+	[_orderedPresences release];
+	[_lockedOnJID release];
+	[_rosterItem release];
 
 	[super dealloc];
 }
 
+- (XMPPPresence *)highestPriorityPresence
+{
+	return _orderedPresences.firstObject;
+}
+
+- (XMPPJID *)routingJID
+{
+	XMPPPresence *presence = _orderedPresences.firstObject;
+	XMPPJID *JID = presence.from;
+
+	/* Negative priorities mean that only messages to the full JID go. */
+	if (presence == nil || JID.resource == nil ||
+	    presence.xmpp_priorityValue < 0)
+		return _rosterItem.JID;
+
+	return JID;
+}
+
 - (void)sendMessage: (XMPPMessage *)message
 	 connection: (XMPPConnection *)connection
 {
 	if (_lockedOnJID == nil)
-		message.to = _rosterItem.JID;
+		message.to = self.routingJID;
 	else
 		message.to = _lockedOnJID;
 
@@ -74,21 +117,49 @@
 - (void)xmpp_setPresence: (XMPPPresence *)presence
 		resource: (OFString *)resource
 {
-	if (resource != nil)
-		[_presences setObject: presence forKey: resource];
-	else
-		[_presences setObject: presence forKey: @""];
+	XMPPPresence *oldPresence;
+	size_t low = 0, high;
+
+	if (resource == nil)
+		resource = @"";
+
+	oldPresence = [_presences objectForKey: resource];
+	if (oldPresence != nil)
+		[_orderedPresences removeObjectIdenticalTo: oldPresence];
+
+	[_presences setObject: presence forKey: resource];
+
+	/*
+	 * Insert before all presences that are not better, so that the most
+	 * recent one wins if they are equally good.
+	 */
+	high = _orderedPresences.count;
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+
+		if (comparePresences([_orderedPresences objectAtIndex: middle],
+		    presence) == OFOrderedAscending)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	[_orderedPresences insertObject: presence atIndex: low];
 
 	self.xmpp_lockedOnJID = nil;
 }
 
 - (void)xmpp_removePresenceForResource: (OFString *)resource
 {
-	if (resource != nil)
-		[_presences removeObjectForKey: resource];
-	else {
-		[_presences release];
-		_presences = [[OFMutableDictionary alloc] init];
+	if (resource != nil) {
+		XMPPPresence *presence = [_presences objectForKey: resource];
+
+		if (presence != nil) {
+			[_orderedPresences removeObjectIdenticalTo: presence];
+			[_presences removeObjectForKey: resource];
+		}
+	} else {
+		[_presences removeAllObjects];
+		[_orderedPresences removeAllObjects];
 	}
 
 	self.xmpp_lockedOnJID = nil;
@@ -28,6 +28,8 @@
 
 OF_ASSUME_NONNULL_BEGIN
 
+#define XMPPContactManagerDefaultPresenceBatchInterval 0
+
 @class XMPPContact;
 @class XMPPContactManager;
 @class XMPPMulticastDelegate;
@@ -67,6 +69,21 @@ OF_ASSUME_NONNULL_BEGIN
 -          (void)contactManager: (XMPPContactManager *)manager
   didReceiveSubscriptionRequest: (XMPPPresence *)presence;
 
+/*!
+ * @brief This callback is called with the contacts whose presences changed if
+ *	  @ref XMPPContactManager::batchesPresenceUpdates is enabled.
+ *
+ * In that case, it is called instead of @ref contact:didSendPresence: at most
+ * once per @ref XMPPContactManager::presenceBatchInterval. If a resource sent
+ * several presences in the meantime, only the latest one is in the presences
+ * of the contact.
+ *
+ * @param manager The contact manager that updated the presences
+ * @param contacts The contacts whose presences changed
+ */
+-         (void)contactManager: (XMPPContactManager *)manager
+  didUpdatePresencesOfContacts: (OFSet OF_GENERIC(XMPPContact *) *)contacts;
+
 /*!
  * @brief This callback is called whenever a contact is about to change its
  *	  roster item
@@ -80,6 +97,9 @@ OF_ASSUME_NONNULL_BEGIN
 /*!
  * @brief This callback is called whenever a contact send a presence stanza
  *
+ * This is not called if @ref XMPPContactManager::batchesPresenceUpdates is
+ * enabled.
+ *
  * @param contact The contact that send the presence
  * @param presence The presence which was send by the contact
  */
@@ -108,6 +128,10 @@ OF_ASSUME_NONNULL_BEGIN
 	XMPPConnection *_connection;
 	XMPPRoster *_roster;
 	XMPPMulticastDelegate *_delegates;
+	bool _batchesPresenceUpdates;
+	OFTimeInterval _presenceBatchInterval;
+	OFMutableSet OF_GENERIC(XMPPContact *) *_updatedContacts;
+	OFTimer *_Nullable _presenceBatchTimer;
 }
 
 /*!
@@ -116,6 +140,28 @@ OF_ASSUME_NONNULL_BEGIN
 @property (readonly, nonatomic)
     OFDictionary OF_GENERIC(OFString *, XMPPContact *) *contacts;
 
+/*!
+ * @brief Whether presence updates are delivered in batches.
+ *
+ * If enabled, presences are still applied to the contacts right away, but
+ * instead of calling @ref XMPPContactManagerDelegate::contact:didSendPresence:
+ * for each presence,
+ * @ref XMPPContactManagerDelegate::contactManager:didUpdatePresencesOfContacts:
+ * is called once with all contacts that changed within the
+ * @ref presenceBatchInterval. This avoids a flood of callbacks when logging in
+ * with a large roster. Defaults to false.
+ */
+@property (nonatomic) bool batchesPresenceUpdates;
+
+/*!
+ * @brief The time for which presence updates are collected if
+ *	  @ref batchesPresenceUpdates is enabled.
+ *
+ * An interval of 0 delivers the updates once per run loop iteration. Defaults
+ * to @ref XMPPContactManagerDefaultPresenceBatchInterval.
+ */
+@property (nonatomic) OFTimeInterval presenceBatchInterval;
+
 /*!
  * @brief Initializes an already allocated XMPPContactManager.
  *
@@ -130,6 +176,12 @@ OF_ASSUME_NONNULL_BEGIN
 - (void)sendSubscribedToJID: (XMPPJID *)subscriber;
 - (void)sendUnsubscribedToJID: (XMPPJID *)subscriber;
 
+/*!
+ * @brief Delivers pending presence updates right away if
+ *	  @ref batchesPresenceUpdates is enabled.
+ */
+- (void)flushPresenceUpdates;
+
 /*!
  * @brief Adds the specified delegate.
  *
@@ -21,6 +21,8 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#import <ObjFW/OFTimer.h>
+
 #import "XMPPContactManager.h"
 #import "XMPPContact.h"
 #import "XMPPContact+Private.h"
@@ -30,8 +32,15 @@
 #import "XMPPPresence.h"
 #import "XMPPRosterItem.h"
 
+@interface XMPPContactManager ()
+- (void)xmpp_contact: (XMPPContact *)contact
+     didSendPresence: (XMPPPresence *)presence;
+@end
+
 @implementation XMPPContactManager
 @synthesize contacts = _contacts;
+@synthesize batchesPresenceUpdates = _batchesPresenceUpdates;
+@synthesize presenceBatchInterval = _presenceBatchInterval;
 
 - (instancetype)initWithConnection: (XMPPConnection *)connection
 			    roster: (XMPPRoster *)roster
@@ -45,6 +54,9 @@
 		[_roster addDelegate: self];
 		_contacts = [[OFMutableDictionary alloc] init];
 		_delegates = [[XMPPMulticastDelegate alloc] init];
+		_updatedContacts = [[OFMutableSet alloc] init];
+		_presenceBatchInterval =
+		    XMPPContactManagerDefaultPresenceBatchInterval;
 	} @catch (id e) {
 		[self release];
 		@throw e;
@@ -59,6 +71,9 @@
 	[_roster removeDelegate: self];
 	[_delegates release];
 	[_contacts release];
+	[_updatedContacts release];
+	[_presenceBatchTimer invalidate];
+	[_presenceBatchTimer release];
 
 	[super dealloc];
 }
@@ -79,6 +94,46 @@
 	[_connection sendStanza: presence];
 }
 
+- (void)setBatchesPresenceUpdates: (bool)batchesPresenceUpdates
+{
+	_batchesPresenceUpdates = batchesPresenceUpdates;
+
+	if (!batchesPresenceUpdates)
+		[self flushPresenceUpdates];
+}
+
+- (void)flushPresenceUpdates
+{
+	OFMutableSet *contacts;
+
+	[_presenceBatchTimer invalidate];
+	[_presenceBatchTimer release];
+	_presenceBatchTimer = nil;
+
+	if (_updatedContacts.count == 0)
+		return;
+
+	contacts = [OFMutableSet setWithCapacity: _updatedContacts.count];
+
+	/* Contacts might have been removed in the meantime. */
+	for (XMPPContact *contact in _updatedContacts)
+		if ([_contacts objectForKey: contact.rosterItem.JID.bareJID] ==
+		    contact)
+			[contacts addObject: contact];
+
+	[_updatedContacts removeAllObjects];
+
+	if (contacts.count == 0)
+		return;
+
+	[contacts makeImmutable];
+
+	[_delegates broadcastSelector: @selector(contactManager:
+					   didUpdatePresencesOfContacts:)
+			   withObject: self
+			   withObject: contacts];
+}
+
 - (void)addDelegate: (id <XMPPContactManagerDelegate>)delegate
 {
 	[_delegates addDelegate: delegate];
@@ -91,28 +146,54 @@
 
 - (void)rosterWasReceived: (XMPPRoster *)roster
 {
-	OFDictionary *rosterItems;
+	void *pool = objc_autoreleasePoolPush();
+	OFDictionary *rosterItems = roster.rosterItems;
+	OFMutableArray *removedJIDs = [OFMutableArray array];
+
+	/*
+	 * Reconcile the contacts with the new roster instead of recreating
+	 * them, so that contacts which did not change keep their presences
+	 * and delegates only get notified about actual changes.
+	 */
+
+	for (OFString *bareJID in _contacts)
+		if ([rosterItems objectForKey: bareJID] == nil)
+			[removedJIDs addObject: bareJID];
+
+	for (OFString *bareJID in removedJIDs) {
+		XMPPContact *contact = [_contacts objectForKey: bareJID];
 
-	for (XMPPContact *contact in _contacts)
 		[_delegates broadcastSelector: @selector(contactManager:
 						   didRemoveContact:)
 				   withObject: self
 				   withObject: contact];
-	[_contacts release];
-	_contacts = nil;
-
-	_contacts = [[OFMutableDictionary alloc] init];
+		[_contacts removeObjectForKey: bareJID];
+	}
 
-	rosterItems = roster.rosterItems;
 	for (OFString *bareJID in rosterItems) {
-		XMPPContact *contact = [[[XMPPContact alloc] init] autorelease];
-		contact.rosterItem = [rosterItems objectForKey: bareJID];
-		[_contacts setObject: contact forKey: bareJID];
-		[_delegates broadcastSelector: @selector(contactManager:
-						   didAddContact:)
-				   withObject: self
-				   withObject: contact];
+		XMPPRosterItem *rosterItem =
+		    [rosterItems objectForKey: bareJID];
+		XMPPContact *contact = [_contacts objectForKey: bareJID];
+
+		if (contact == nil) {
+			contact = [[[XMPPContact alloc] init] autorelease];
+			contact.rosterItem = rosterItem;
+			[_contacts setObject: contact forKey: bareJID];
+			[_delegates broadcastSelector: @selector(contactManager:
+							   didAddContact:)
+					   withObject: self
+					   withObject: contact];
+		} else if (![contact.rosterItem isEqual: rosterItem]) {
+			[_delegates broadcastSelector: @selector(contact:
+						      willUpdateWithRosterItem:)
+					   withObject: contact
+					   withObject: rosterItem];
+			contact.rosterItem = rosterItem;
+		} else
+			contact.rosterItem = rosterItem;
 	}
+
+	objc_autoreleasePoolPop(pool);
 }
 
 -         (void)roster: (XMPPRoster *)roster
@@ -170,25 +251,46 @@
 	if (contact == nil)
 		return;
 
-	/* Available presence */
-	if ([type isEqual: @"available"]) {
+	/* Available presence, which usually has no type */
+	if (type == nil || [type isEqual: @"available"]) {
 		[contact xmpp_setPresence: presence resource: JID.resource];
-		[_delegates broadcastSelector: @selector(contact:
-						   didSendPresence:)
-				   withObject: contact
-				   withObject: presence];
+		[self xmpp_contact: contact didSendPresence: presence];
 		return;
 	}
 
 	/* Unavailable presence */
 	if ([type isEqual: @"unavailable"]) {
 		[contact xmpp_removePresenceForResource: JID.resource];
+		[self xmpp_contact: contact didSendPresence: presence];
+		return;
+	}
+}
+
+- (void)xmpp_contact: (XMPPContact *)contact
+     didSendPresence: (XMPPPresence *)presence
+{
+	if (!_batchesPresenceUpdates) {
 		[_delegates broadcastSelector: @selector(contact:
 						   didSendPresence:)
 				   withObject: contact
 				   withObject: presence];
 		return;
 	}
+
+	/*
+	 * The presence has already been applied to the contact, so later
+	 * presences of the same resource replace it and only the contact
+	 * needs to be remembered.
+	 */
+	[_updatedContacts addObject: contact];
+
+	if (_presenceBatchTimer == nil)
+		_presenceBatchTimer = [[OFTimer
+		    scheduledTimerWithTimeInterval: _presenceBatchInterval
+					    target: self
+					  selector: @selector(
+							flushPresenceUpdates)
+					   repeats: false] retain];
 }
 
 -  (void)connection: (XMPPConnection *)connection
@@ -34,7 +34,8 @@ OF_ASSUME_NONNULL_BEGIN
  * @brief A class representing an entity responding to Service Discovery
  *	  queries
  */
-@interface XMPPDiscoEntity: XMPPDiscoNode <XMPPConnectionDelegate>
+@interface XMPPDiscoEntity: XMPPDiscoNode <XMPPConnectionDelegate,
+    XMPPIQHandler>
 {
 	OFMutableDictionary *_discoNodes;
 	XMPPConnection *_connection;
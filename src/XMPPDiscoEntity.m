@@ -85,6 +85,12 @@
 		_capsNode = [capsNode copy];
 
 		[_connection addDelegate: self];
+		[_connection registerIQHandler: self
+				  forNamespace: XMPPDiscoItemsNS
+					  type: @"get"];
+		[_connection registerIQHandler: self
+				  forNamespace: XMPPDiscoInfoNS
+					  type: @"get"];
 	} @catch (id e) {
 		[self release];
 		@throw e;
@@ -95,6 +101,12 @@
 
 - (void)dealloc
 {
+	[_connection unregisterIQHandler: self
+			    forNamespace: XMPPDiscoItemsNS
+				    type: @"get"];
+	[_connection unregisterIQHandler: self
+			    forNamespace: XMPPDiscoInfoNS
+				    type: @"get"];
 	[_connection removeDelegate: self];
 	[_discoNodes release];
 
@@ -132,8 +144,7 @@
 	_JID = [JID copy];
 }
 
-- (bool)connection: (XMPPConnection *)connection
-      didReceiveIQ: (XMPPIQ *)IQ
+- (bool)connection: (XMPPConnection *)connection handleIQ: (XMPPIQ *)IQ
 {
 	if (![IQ.to isEqual: _JID])
 		return false;
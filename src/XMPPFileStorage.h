@@ -26,16 +26,67 @@
 
 OF_ASSUME_NONNULL_BEGIN
 
+#define XMPPFileStorageDefaultSaveDelay 0.5
+
 @class OFMutableDictionary;
+@class OFDictionary;
+@class OFTimer;
+@class OFThread;
+@class OFCondition;
 
 @interface XMPPFileStorage: OFObject <XMPPStorage>
 {
 	OFString *_file;
 	OFMutableDictionary *_data;
+	bool _savesAsynchronously;
+	OFTimeInterval _saveDelay;
+	OFTimer *_saveTimer;
+#ifdef OF_HAVE_THREADS
+	OFThread *_saveThread;
+	OFCondition *_saveCondition;
+	OFDictionary *_pendingSnapshot;
+	bool _saving, _stopsSaveThread;
+#endif
+	id _Nullable _saveException;
 }
 
+/*!
+ * @brief Whether @ref save returns immediately and writes the file later.
+ *
+ * If enabled, all calls to @ref save within @ref saveDelay are merged into a
+ * single write. The write takes a snapshot of the data on the run loop and
+ * serializes, writes and syncs it on a worker thread, if threads are
+ * available. A failed asynchronous write is reported by the next call to
+ * @ref flushSynchronously.
+ *
+ * If disabled, @ref save writes the file directly. Defaults to false.
+ */
+@property (nonatomic) bool savesAsynchronously;
+
+/*!
+ * @brief The time to wait for further calls to @ref save before writing the
+ *	  file if @ref savesAsynchronously is enabled.
+ *
+ * Defaults to @ref XMPPFileStorageDefaultSaveDelay.
+ */
+@property (nonatomic) OFTimeInterval saveDelay;
+
 - (instancetype)init OF_UNAVAILABLE;
 - (instancetype)initWithFile: (OFString *)file;
+
+/*!
+ * @brief Writes pending asynchronous saves and waits until they have been
+ *	  written.
+ *
+ * The file is written to a temporary file, synced and then renamed into
+ * place. If no save is pending, nothing is written. If an earlier
+ * asynchronous save failed, its exception is thrown after the current data
+ * has been written.
+ *
+ * This should be called before exiting when @ref savesAsynchronously is
+ * enabled.
+ */
+- (void)flushSynchronously;
 @end
 
 OF_ASSUME_NONNULL_END
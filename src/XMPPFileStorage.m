@@ -22,19 +22,99 @@
 
 #include "config.h"
 
-#include <stdlib.h>
-
 #import <ObjFW/OFString.h>
 #import <ObjFW/OFArray.h>
 #import <ObjFW/OFDictionary.h>
 #import <ObjFW/OFNumber.h>
 #import <ObjFW/OFData.h>
+#import <ObjFW/OFTimer.h>
+#ifdef OF_HAVE_THREADS
+# import <ObjFW/OFThread.h>
+# import <ObjFW/OFCondition.h>
+#endif
 
 #import <ObjFW/OFNotImplementedException.h>
 
 #import "XMPPFileStorage.h"
+#import "XMPPStoragePath.h"
+#import "XMPPSyncedFile.h"
+
+@interface XMPPFileStorage ()
+- (void)xmpp_saveTimerDidFire;
+#ifdef OF_HAVE_THREADS
+- (void)xmpp_runSaveThread;
+#endif
+@end
+
+#ifdef OF_HAVE_THREADS
+/*
+ * Runs the save loop of the storage. This is a subclass instead of a block so
+ * that it also works with compilers that don't support blocks.
+ */
+@interface XMPPFileStorageSaveThread: OFThread
+{
+@public
+	/* Not retained to avoid a retain cycle. */
+	XMPPFileStorage *_storage;
+}
+@end
+
+@implementation XMPPFileStorageSaveThread
+- (id)main
+{
+	[_storage xmpp_runSaveThread];
+
+	return nil;
+}
+@end
+#endif
+
+/* Copies the tree so that it can be serialized while the data changes. */
+static id
+immutableCopy(id object)
+{
+	if ([object isKindOfClass: [OFDictionary class]]) {
+		OFMutableDictionary *copy = [OFMutableDictionary
+		    dictionaryWithCapacity: [object count]];
+
+		for (id key in object)
+			[copy setObject: immutableCopy([object
+					     objectForKey: key])
+				 forKey: key];
+
+		[copy makeImmutable];
+		return copy;
+	}
+
+	if ([object isKindOfClass: [OFArray class]]) {
+		OFMutableArray *copy =
+		    [OFMutableArray arrayWithCapacity: [object count]];
+
+		for (id item in object)
+			[copy addObject: immutableCopy(item)];
+
+		[copy makeImmutable];
+		return copy;
+	}
+
+	return [[object copy] autorelease];
+}
+
+/* Serializes the data and atomically replaces the file with it. */
+static void
+writeData(OFDictionary *data, OFString *file)
+{
+	void *pool = objc_autoreleasePoolPush();
+
+	[XMPPSyncedFile replaceFileAtPath: file
+				 withData: data.messagePackRepresentation];
+
+	objc_autoreleasePoolPop(pool);
+}
 
 @implementation XMPPFileStorage
+@synthesize savesAsynchronously = _savesAsynchronously;
+@synthesize saveDelay = _saveDelay;
 - (instancetype)init
 {
 	OF_INVALID_INIT_METHOD
@@ -48,9 +128,11 @@
 		void *pool = objc_autoreleasePoolPush();
 
 		_file = [file copy];
+		_saveDelay = XMPPFileStorageDefaultSaveDelay;
+
 		@try {
 			_data = [[OFData dataWithContentsOfFile: file]
-			    .objectByParsingMessagePack copy];
+			    .objectByParsingMessagePack mutableCopy];
 		} @catch (id e) {
 			_data = [[OFMutableDictionary alloc] init];
 		}
@@ -66,158 +148,371 @@
 
 - (void)dealloc
 {
+	/* A scheduled save timer retains us, so there is none. */
+#ifdef OF_HAVE_THREADS
+	if (_saveThread != nil) {
+		[_saveCondition lock];
+		_stopsSaveThread = true;
+		[_saveCondition signal];
+		[_saveCondition unlock];
+
+		/* Finishes a pending snapshot first. */
+		[_saveThread join];
+	}
+
+	[_saveThread release];
+	[_saveCondition release];
+	[_pendingSnapshot release];
+#endif
+	[_saveException release];
 	[_file release];
 	[_data release];
 
 	[super dealloc];
 }
 
+- (void)setSavesAsynchronously: (bool)savesAsynchronously
+{
+	if (_savesAsynchronously && !savesAsynchronously)
+		[self flushSynchronously];
+
+	_savesAsynchronously = savesAsynchronously;
+}
+
 - (void)save
 {
-	[_data.messagePackRepresentation writeToFile: _file];
+	if (!_savesAsynchronously) {
+		writeData(_data, _file);
+		return;
+	}
+
+	/* Later saves are merged into the pending one. */
+	if (_saveTimer == nil)
+		_saveTimer = [[OFTimer
+		    scheduledTimerWithTimeInterval: _saveDelay
+					    target: self
+					  selector: @selector(
+							xmpp_saveTimerDidFire)
+					   repeats: false] retain];
+}
+
+#ifdef OF_HAVE_THREADS
+- (void)xmpp_startSaveThread
+{
+	XMPPFileStorageSaveThread *saveThread =
+	    [[[XMPPFileStorageSaveThread alloc] init] autorelease];
+
+	saveThread->_storage = self;
+	saveThread.name = @"XMPPFileStorage save";
+
+	_saveCondition = [[OFCondition alloc] init];
+	_saveThread = [saveThread retain];
+	[_saveThread start];
+}
+
+- (void)xmpp_runSaveThread
+{
+	for (;;) {
+		OFDictionary *snapshot;
+		id exception = nil;
+		void *pool;
+
+		[_saveCondition lock];
+		@try {
+			while (_pendingSnapshot == nil && !_stopsSaveThread)
+				[_saveCondition wait];
+
+			if (_pendingSnapshot == nil)
+				return;
+
+			snapshot = _pendingSnapshot;
+			_pendingSnapshot = nil;
+			_saving = true;
+		} @finally {
+			[_saveCondition unlock];
+		}
+
+		pool = objc_autoreleasePoolPush();
+		@try {
+			writeData(snapshot, _file);
+		} @catch (id e) {
+			exception = [e retain];
+		} @finally {
+			[snapshot release];
+		}
+		objc_autoreleasePoolPop(pool);
+
+		[_saveCondition lock];
+		/* Reported by -[flushSynchronously]. */
+		if (exception != nil) {
+			[_saveException release];
+			_saveException = exception;
+		}
+		_saving = false;
+		[_saveCondition broadcast];
+		[_saveCondition unlock];
+	}
+}
+#endif
+
+- (void)xmpp_saveTimerDidFire
+{
+#ifdef OF_HAVE_THREADS
+	void *pool = objc_autoreleasePoolPush();
+	OFDictionary *snapshot = [immutableCopy(_data) retain];
+
+	[_saveTimer release];
+	_saveTimer = nil;
+
+	if (_saveThread == nil)
+		[self xmpp_startSaveThread];
+
+	[_saveCondition lock];
+	@try {
+		/* An older snapshot that has not been written yet is stale. */
+		[_pendingSnapshot release];
+		_pendingSnapshot = snapshot;
+		[_saveCondition signal];
+	} @finally {
+		[_saveCondition unlock];
+	}
+
+	objc_autoreleasePoolPop(pool);
+#else
+	[_saveTimer release];
+	_saveTimer = nil;
+
+	/* There is nobody to report to, so -[flushSynchronously] does it. */
+	@try {
+		writeData(_data, _file);
+	} @catch (id e) {
+		[_saveException release];
+		_saveException = [e retain];
+	}
+#endif
+}
+
+- (void)flushSynchronously
+{
+	bool savePending = (_saveTimer != nil);
+	id exception;
+
+	[_saveTimer invalidate];
+	[_saveTimer release];
+	_saveTimer = nil;
+
+#ifdef OF_HAVE_THREADS
+	if (_saveThread != nil) {
+		[_saveCondition lock];
+		@try {
+			/* The current data supersedes a pending snapshot. */
+			if (_pendingSnapshot != nil)
+				savePending = true;
+
+			[_pendingSnapshot release];
+			_pendingSnapshot = nil;
+
+			while (_saving)
+				[_saveCondition wait];
+		} @finally {
+			[_saveCondition unlock];
+		}
+	}
+#endif
+
+	/* The worker is idle now and won't touch the exception anymore. */
+	exception = [_saveException autorelease];
+	_saveException = nil;
+
+	/* A failed save left older data in the file, so it is rewritten. */
+	if (savePending || exception != nil)
+		writeData(_data, _file);
+
+	/*
+	 * The current data has been written, but the caller still needs to
+	 * know that an earlier asynchronous save failed.
+	 */
+	if (exception != nil)
+		@throw exception;
 }
 
 - (void)xmpp_setObject: (id)object
-	       forPath: (OFString *)path
+     forPathComponents: (OFArray *)pathComponents
 {
-	OFArray *pathComponents = [path componentsSeparatedByString: @"."];
 	OFMutableDictionary *iter = _data;
 	size_t i = 0, components = pathComponents.count;
 
 	for (OFString *component in pathComponents) {
+		id iter2;
+
 		if (i++ == components - 1)
 			continue;
 
-		OFMutableDictionary *iter2 = [iter objectForKey: component];
+		iter2 = [iter objectForKey: component];
+
+		/* Dictionaries read from the file are immutable. */
+		if (![iter2 isKindOfClass: [OFMutableDictionary class]]) {
+			if ([iter2 isKindOfClass: [OFDictionary class]])
+				iter2 = [iter2 mutableCopy];
+			else
+				iter2 = [[OFMutableDictionary alloc] init];
 
-		if (iter2 == nil) {
-			iter2 = [OFMutableDictionary dictionary];
-			[iter setObject: iter2 forKey: component];
+			@try {
+				[iter setObject: iter2 forKey: component];
+			} @finally {
+				[iter2 release];
+			}
 		}
 
 		iter = iter2;
 	}
 
 	if (object != nil)
-		[iter setObject: object forKey: [pathComponents lastObject]];
+		[iter setObject: object forKey: pathComponents.lastObject];
 	else
 		[iter removeObjectForKey: pathComponents.lastObject];
 }
 
-- (id)xmpp_objectForPath: (OFString *)path
+- (id)xmpp_objectForPathComponents: (OFArray *)pathComponents
 {
 	id object = _data;
 
-	for (OFString *component in [path componentsSeparatedByString: @"."])
+	for (OFString *component in pathComponents)
 		object = [object objectForKey: component];
 
 	return object;
 }
 
-- (void)setStringValue: (OFString *)string
-	       forPath: (OFString *)path
+- (void)xmpp_setObject: (id)object forPath: (OFString *)path
 {
 	void *pool = objc_autoreleasePoolPush();
 
-	[self xmpp_setObject: string forPath: path];
+	[self xmpp_setObject: object
+	   forPathComponents: [path componentsSeparatedByString: @"."]];
 
 	objc_autoreleasePoolPop(pool);
 }
 
-- (OFString *)stringValueForPath: (OFString *)path
+- (id)xmpp_objectForPath: (OFString *)path
 {
 	void *pool = objc_autoreleasePoolPush();
-	OFString *string;
-
-	string = [self xmpp_objectForPath: path];
+	id object = [self xmpp_objectForPathComponents:
+	    [path componentsSeparatedByString: @"."]];
 
 	objc_autoreleasePoolPop(pool);
 
-	return string;
+	return object;
 }
 
-- (void)setBooleanValue: (bool)boolean forPath: (OFString *)path
+- (void)setStringValue: (OFString *)string forPath: (OFString *)path
 {
-	void *pool = objc_autoreleasePoolPush();
+	[self xmpp_setObject: string forPath: path];
+}
 
-	[self xmpp_setObject: [OFNumber numberWithBool: boolean] forPath: path];
+- (OFString *)stringValueForPath: (OFString *)path
+{
+	return [self xmpp_objectForPath: path];
+}
 
-	objc_autoreleasePoolPop(pool);
+- (void)setBooleanValue: (bool)boolean forPath: (OFString *)path
+{
+	[self xmpp_setObject: [OFNumber numberWithBool: boolean] forPath: path];
 }
 
 - (bool)booleanValueForPath: (OFString *)path
 {
-	void *pool = objc_autoreleasePoolPush();
-	bool boolean;
-
-	boolean = [[self xmpp_objectForPath: path] boolValue];
-
-	objc_autoreleasePoolPop(pool);
-
-	return boolean;
+	return [[self xmpp_objectForPath: path] boolValue];
 }
 
 - (void)setIntegerValue: (long long)integer forPath: (OFString *)path
 {
-	void *pool = objc_autoreleasePoolPush();
-
 	[self xmpp_setObject: [OFNumber numberWithLongLong: integer]
 		     forPath: path];
-
-	objc_autoreleasePoolPop(pool);
 }
 
 - (long long)integerValueForPath: (OFString *)path
 {
-	void *pool = objc_autoreleasePoolPush();
-	long long integer;
-
-	integer = [[self xmpp_objectForPath: path] longLongValue];
-
-	objc_autoreleasePoolPop(pool);
-
-	return integer;
+	return [[self xmpp_objectForPath: path] longLongValue];
 }
 
 - (void)setArray: (OFArray *)array forPath: (OFString *)path
 {
-	void *pool = objc_autoreleasePoolPush();
-
 	[self xmpp_setObject: array forPath: path];
-
-	objc_autoreleasePoolPop(pool);
 }
 
 - (OFArray *)arrayForPath: (OFString *)path
 {
-	void *pool = objc_autoreleasePoolPush();
-	OFArray *array;
+	return [self xmpp_objectForPath: path];
+}
 
-	array = [self xmpp_objectForPath: path];
+- (void)setDictionary: (OFDictionary *)dictionary forPath: (OFString *)path
+{
+	[self xmpp_setObject: dictionary forPath: path];
+}
 
-	objc_autoreleasePoolPop(pool);
+- (OFDictionary *)dictionaryForPath: (OFString *)path
+{
+	return [self xmpp_objectForPath: path];
+}
 
-	return array;
+- (XMPPStoragePath *)pathHandleForPath: (OFString *)path
+{
+	return [XMPPStoragePath pathWithString: path];
 }
 
-- (void)setDictionary: (OFDictionary *)dictionary forPath: (OFString *)path
+- (void)setStringValue: (OFString *)string
+	 forPathHandle: (XMPPStoragePath *)path
 {
-	void *pool = objc_autoreleasePoolPush();
+	[self xmpp_setObject: string forPathComponents: path.components];
+}
 
-	[self xmpp_setObject: dictionary forPath: path];
+- (OFString *)stringValueForPathHandle: (XMPPStoragePath *)path
+{
+	return [self xmpp_objectForPathComponents: path.components];
+}
 
-	objc_autoreleasePoolPop(pool);
+- (void)setBooleanValue: (bool)boolean forPathHandle: (XMPPStoragePath *)path
+{
+	[self xmpp_setObject: [OFNumber numberWithBool: boolean]
+	   forPathComponents: path.components];
 }
 
-- (OFDictionary *)dictionaryForPath: (OFString *)path
+- (bool)booleanValueForPathHandle: (XMPPStoragePath *)path
 {
-	void *pool = objc_autoreleasePoolPush();
-	OFDictionary *dictionary;
+	return [[self xmpp_objectForPathComponents: path.components] boolValue];
+}
 
-	dictionary = [self xmpp_objectForPath: path];
+- (void)setIntegerValue: (long long)integer
+	  forPathHandle: (XMPPStoragePath *)path
+{
+	[self xmpp_setObject: [OFNumber numberWithLongLong: integer]
+	   forPathComponents: path.components];
+}
 
-	objc_autoreleasePoolPop(pool);
+- (long long)integerValueForPathHandle: (XMPPStoragePath *)path
+{
+	return [[self xmpp_objectForPathComponents: path.components]
+	    longLongValue];
+}
 
-	return dictionary;
+- (void)setArray: (OFArray *)array forPathHandle: (XMPPStoragePath *)path
+{
+	[self xmpp_setObject: array forPathComponents: path.components];
+}
+
+- (OFArray *)arrayForPathHandle: (XMPPStoragePath *)path
+{
+	return [self xmpp_objectForPathComponents: path.components];
+}
+
+- (void)setDictionary: (OFDictionary *)dictionary
+	forPathHandle: (XMPPStoragePath *)path
+{
+	[self xmpp_setObject: dictionary forPathComponents: path.components];
+}
+
+- (OFDictionary *)dictionaryForPathHandle: (XMPPStoragePath *)path
+{
+	return [self xmpp_objectForPathComponents: path.components];
 }
 @end
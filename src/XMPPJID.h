@@ -31,6 +31,9 @@ OF_ASSUME_NONNULL_BEGIN
 @interface XMPPJID: OFObject <OFCopying>
 {
 	OFString *_node, *_domain, *_resource;
+	OFString *_bareJID, *_fullJID;
+	unsigned long _hash;
+	bool _hashed;
 }
 
 /*!
@@ -74,6 +77,8 @@ OF_ASSUME_NONNULL_BEGIN
 /*!
  * @brief Returns the bare JID.
  *
+ * The string is only created once and cached until the JID is changed.
+ *
  * @return An OFString containing the bare JID
  */
 - (OFString *)bareJID;
@@ -81,9 +86,20 @@ OF_ASSUME_NONNULL_BEGIN
 /*!
  * @brief Returns the full JID.
  *
+ * The string is only created once and cached until the JID is changed.
+ *
  * @return An OFString containing the full JID
  */
 - (OFString *)fullJID;
+
+/*!
+ * @brief Checks whether the bare JID of the JID is equal to the bare JID of
+ *	  the specified JID, without creating any strings.
+ *
+ * @param JID The JID to compare the bare JID with
+ * @return Whether the bare JIDs are equal
+ */
+- (bool)isEqualToBareJID: (nullable XMPPJID *)JID;
 @end
 
 OF_ASSUME_NONNULL_END
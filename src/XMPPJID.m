@@ -24,12 +24,15 @@
 
 #include "config.h"
 
-#include <string.h>
-
-#include <stringprep.h>
-
 #import "XMPPJID.h"
+#import "XMPPJIDCache.h"
+#import "XMPPJIDCache+Private.h"
 #import "XMPPExceptions.h"
+#import "XMPPStringPrep.h"
+
+@interface XMPPJID ()
+- (void)xmpp_invalidateCache;
+@end
 
 @implementation XMPPJID
 @synthesize node = _node, domain = _domain, resource = _resource;
@@ -49,11 +52,25 @@
 	self = [super init];
 
 	@try {
+		XMPPJIDCache *cache = [XMPPJIDCache sharedCache];
+		XMPPJID *cached;
 		size_t nodesep, resourcesep;
 
 		if (string == nil)
 			@throw [OFInvalidArgumentException exception];
 
+		if ((cached = [cache xmpp_JIDForString: string]) != nil) {
+			_node = [cached->_node retain];
+			_domain = [cached->_domain retain];
+			_resource = [cached->_resource retain];
+			_bareJID = [cached->_bareJID retain];
+			_fullJID = [cached->_fullJID retain];
+			_hash = cached->_hash;
+			_hashed = cached->_hashed;
+
+			return self;
+		}
+
 		nodesep = [string rangeOfString: @"@"].location;
 		resourcesep = [string rangeOfString: @"/"].location;
 
@@ -71,6 +88,14 @@
 
 		self.domain = [string substringWithRange:
 		    OFMakeRange(nodesep + 1, resourcesep - nodesep - 1)];
+
+		if (cache.enabled) {
+			/* Build the strings now so that hits can share them. */
+			[self fullJID];
+			[self hash];
+
+			[cache xmpp_setJID: self forString: string];
+		}
 	} @catch (id e) {
 		[self release];
 		@throw e;
@@ -84,6 +109,8 @@
 	[_node release];
 	[_domain release];
 	[_resource release];
+	[_bareJID release];
+	[_fullJID release];
 
 	[super dealloc];
 }
@@ -96,6 +123,10 @@
 		new->_node = [_node copy];
 		new->_domain = [_domain copy];
 		new->_resource = [_resource copy];
+		new->_bareJID = [_bareJID copy];
+		new->_fullJID = [_fullJID copy];
+		new->_hash = _hash;
+		new->_hashed = _hashed;
 	} @catch (id e) {
 		[new release];
 		@throw e;
@@ -104,11 +135,21 @@
 	return new;
 }
 
+- (void)xmpp_invalidateCache
+{
+	[_bareJID release];
+	_bareJID = nil;
+	[_fullJID release];
+	_fullJID = nil;
+	_hashed = false;
+}
+
 - (void)setNode: (OFString *)node
 {
 	OFString *old = _node;
-	char *nodepart;
-	Stringprep_rc rc;
+	OFString *prepared;
+
+	[self xmpp_invalidateCache];
 
 	if (node == nil) {
 		[old release];
@@ -116,53 +157,43 @@
 		return;
 	}
 
-	if (((rc = stringprep_profile(node.UTF8String, &nodepart,
-	    "Nodeprep", 0)) != STRINGPREP_OK) || (nodepart[0] == '\0') ||
-	    (strlen(nodepart) > 1023))
+	prepared = XMPPStringPrep(node, XMPPStringPrepProfileNodeprep);
+	if (prepared == nil || prepared.length == 0 ||
+	    prepared.UTF8StringLength > 1023)
 		@throw [XMPPStringPrepFailedException
 		    exceptionWithConnection: nil
 				    profile: @"Nodeprep"
 				     string: node];
 
-	@try {
-		_node = [[OFString alloc] initWithUTF8StringNoCopy: nodepart
-						      freeWhenDone: true];
-	} @catch (id e) {
-		free(nodepart);
-	}
-
+	_node = [prepared retain];
 	[old release];
 }
 
 - (void)setDomain: (OFString *)domain
 {
 	OFString *old = _domain;
-	char *srv;
-	Stringprep_rc rc;
+	OFString *prepared;
+
+	[self xmpp_invalidateCache];
 
-	if (((rc = stringprep_profile(domain.UTF8String, &srv,
-	    "Nameprep", 0)) != STRINGPREP_OK) || (srv[0] == '\0') ||
-	    (strlen(srv) > 1023))
+	prepared = XMPPStringPrep(domain, XMPPStringPrepProfileNameprep);
+	if (prepared == nil || prepared.length == 0 ||
+	    prepared.UTF8StringLength > 1023)
 		@throw [XMPPStringPrepFailedException
 		    exceptionWithConnection: nil
 				    profile: @"Nameprep"
 				     string: domain];
 
-	@try {
-		_domain = [[OFString alloc] initWithUTF8StringNoCopy: srv
-							freeWhenDone: true];
-	} @catch (id e) {
-		free(srv);
-	}
-
+	_domain = [prepared retain];
 	[old release];
 }
 
 - (void)setResource: (OFString *)resource
 {
 	OFString *old = _resource;
-	char *res;
-	Stringprep_rc rc;
+	OFString *prepared;
+
+	[self xmpp_invalidateCache];
 
 	if (resource == nil) {
 		[old release];
@@ -170,44 +201,62 @@
 		return;
 	}
 
-	if (((rc = stringprep_profile(resource.UTF8String, &res,
-	    "Resourceprep", 0)) != STRINGPREP_OK) || (res[0] == '\0') ||
-	    (strlen(res) > 1023))
+	prepared = XMPPStringPrep(resource, XMPPStringPrepProfileResourceprep);
+	if (prepared == nil || prepared.length == 0 ||
+	    prepared.UTF8StringLength > 1023)
 		@throw [XMPPStringPrepFailedException
 		    exceptionWithConnection: nil
 				    profile: @"Resourceprep"
 				     string: resource];
 
-	@try {
-		_resource = [[OFString alloc] initWithUTF8StringNoCopy: res
-							  freeWhenDone: true];
-	} @catch (id e) {
-		free(res);
-	}
-
+	_resource = [prepared retain];
 	[old release];
 }
 
 - (OFString *)bareJID
 {
-	if (_node != nil)
-		return [OFString stringWithFormat: @"%@@%@", _node, _domain];
-	else
-		return [OFString stringWithFormat: @"%@", _domain];
+	if (_bareJID == nil) {
+		if (_node != nil)
+			_bareJID = [[OFString alloc] initWithFormat: @"%@@%@",
+			    _node, _domain];
+		else
+			_bareJID = [_domain copy];
+	}
+
+	return [[_bareJID retain] autorelease];
 }
 
 - (OFString *)fullJID
 {
-	/* If we don't have a resource, the full JID is equal to the bare JID */
-	if (_resource == nil)
-		return self.bareJID;
-
-	if (_node != nil)
-		return [OFString stringWithFormat: @"%@@%@/%@",
-		    _node, _domain, _resource];
-	else
-		return [OFString stringWithFormat: @"%@/%@",
-		    _domain, _resource];
+	if (_fullJID == nil) {
+		/*
+		 * If we don't have a resource, the full JID is equal to the
+		 * bare JID.
+		 */
+		if (_resource == nil)
+			_fullJID = [self.bareJID copy];
+		else if (_node != nil)
+			_fullJID = [[OFString alloc] initWithFormat:
+			    @"%@@%@/%@", _node, _domain, _resource];
+		else
+			_fullJID = [[OFString alloc] initWithFormat: @"%@/%@",
+			    _domain, _resource];
+	}
+
+	return [[_fullJID retain] autorelease];
+}
+
+- (bool)isEqualToBareJID: (XMPPJID *)JID
+{
+	if (JID == self)
+		return true;
+
+	if (JID == nil)
+		return false;
+
+	// Node may be nil
+	return ((_node == JID->_node || [_node isEqual: JID->_node]) &&
+	    [_domain isEqual: JID->_domain]);
 }
 
 - (OFString *)description
@@ -227,6 +276,9 @@
 
 	JID = object;
 
+	if (self.hash != JID.hash)
+		return false;
+
 	// Node and resource may be nil
 	if ((_node == JID->_node || [_node isEqual: JID->_node]) &&
 	    [_domain isEqual: JID->_domain] && (_resource == JID->_resource ||
@@ -240,6 +292,9 @@
 {
 	unsigned long hash;
 
+	if (_hashed)
+		return _hash;
+
 	OFHashInit(&hash);
 
 	OFHashAddHash(&hash, _node.hash);
@@ -248,6 +303,9 @@
 
 	OFHashFinalize(&hash);
 
+	_hash = hash;
+	_hashed = true;
+
 	return hash;
 }
 @end
@@ -0,0 +1,16 @@
+#import "XMPPJIDCache.h"
+
+OF_ASSUME_NONNULL_BEGIN
+
+@class XMPPJID;
+
+/*
+ * The cached JIDs are never handed out, as XMPPJID is mutable. Instead,
+ * XMPPJID copies their prepared parts and cached strings.
+ */
+@interface XMPPJIDCache ()
+- (nullable XMPPJID *)xmpp_JIDForString: (OFString *)string;
+- (void)xmpp_setJID: (XMPPJID *)JID forString: (OFString *)string;
+@end
+
+OF_ASSUME_NONNULL_END
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2026, Jonathan Schleifer <js@nil.im>
+ *
+ * https://nil.im/objxmpp/
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice is present in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#import <ObjFW/ObjFW.h>
+
+OF_ASSUME_NONNULL_BEGIN
+
+#define XMPPJIDCacheDefaultMemoryLimit (1024 * 1024)
+
+@class XMPPJIDCacheEntry;
+
+/*!
+ * @brief A process-wide cache of prepared JIDs.
+ *
+ * Preparing a JID requires running stringprep on all of its parts. As most
+ * received JIDs have been seen before, @ref XMPPJID looks up the prepared
+ * parts of a JID string in this cache first. The least recently used entries
+ * are evicted when the memory limit is exceeded.
+ */
+@interface XMPPJIDCache: OFObject
+{
+	OFMutableDictionary *_entries;
+	XMPPJIDCacheEntry *_Nullable _mostRecentlyUsed;
+	XMPPJIDCacheEntry *_Nullable _leastRecentlyUsed;
+	size_t _memoryUsage, _memoryLimit;
+	unsigned long long _numberOfHits, _numberOfMisses;
+	bool _enabled;
+#ifdef OF_HAVE_THREADS
+	OFMutex *_mutex;
+#endif
+}
+
+/*!
+ * @brief Whether the cache is used.
+ *
+ * Defaults to true.
+ */
+@property (nonatomic) bool enabled;
+
+/*!
+ * @brief The approximate amount of memory the cache may use.
+ *
+ * Defaults to `XMPPJIDCacheDefaultMemoryLimit`.
+ */
+@property (nonatomic) size_t memoryLimit;
+
+/*!
+ * @brief The approximate amount of memory the cache currently uses.
+ */
+@property (readonly, nonatomic) size_t memoryUsage;
+
+/*!
+ * @brief The number of lookups that found a prepared JID.
+ */
+@property (readonly, nonatomic) unsigned long long numberOfHits;
+
+/*!
+ * @brief The number of lookups that did not find a prepared JID.
+ */
+@property (readonly, nonatomic) unsigned long long numberOfMisses;
+
+/*!
+ * @brief Returns the process-wide cache used by @ref XMPPJID.
+ *
+ * @return The process-wide cache used by @ref XMPPJID
+ */
++ (XMPPJIDCache *)sharedCache;
+
+/*!
+ * @brief Removes all entries from the cache.
+ */
+- (void)removeAllEntries;
+@end
+
+OF_ASSUME_NONNULL_END
@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2026, Jonathan Schleifer <js@nil.im>
+ *
+ * https://nil.im/objxmpp/
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice is present in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#import "XMPPJIDCache.h"
+#import "XMPPJIDCache+Private.h"
+#import "XMPPJID.h"
+
+/* Approximate memory used by an entry in addition to its strings. */
+#define ENTRY_OVERHEAD 128
+
+@interface XMPPJIDCacheEntry: OFObject
+{
+@public
+	OFString *_string;
+	XMPPJID *_JID;
+	size_t _size;
+	/* Not retained, the entry is retained by the dictionary. */
+	XMPPJIDCacheEntry *_previous, *_next;
+}
+@end
+
+@implementation XMPPJIDCacheEntry
+- (void)dealloc
+{
+	[_string release];
+	[_JID release];
+
+	[super dealloc];
+}
+@end
+
+static XMPPJIDCache *sharedCache = nil;
+
+static void
+initSharedCache(void)
+{
+	sharedCache = [[XMPPJIDCache alloc] init];
+}
+
+@interface XMPPJIDCache ()
+- (void)xmpp_unlinkEntry: (XMPPJIDCacheEntry *)entry;
+- (void)xmpp_linkEntry: (XMPPJIDCacheEntry *)entry;
+- (void)xmpp_evictEntries;
+@end
+
+@implementation XMPPJIDCache
+@synthesize memoryUsage = _memoryUsage;
+
++ (XMPPJIDCache *)sharedCache
+{
+	static OFOnceControl onceControl = OFOnceControlInitValue;
+
+	OFOnce(&onceControl, initSharedCache);
+
+	return sharedCache;
+}
+
+- (instancetype)init
+{
+	self = [super init];
+
+	@try {
+		_entries = [[OFMutableDictionary alloc] init];
+		_memoryLimit = XMPPJIDCacheDefaultMemoryLimit;
+		_enabled = true;
+#ifdef OF_HAVE_THREADS
+		_mutex = [[OFMutex alloc] init];
+#endif
+	} @catch (id e) {
+		[self release];
+		@throw e;
+	}
+
+	return self;
+}
+
+- (void)dealloc
+{
+	[_entries release];
+#ifdef OF_HAVE_THREADS
+	[_mutex release];
+#endif
+
+	[super dealloc];
+}
+
+- (bool)enabled
+{
+	return _enabled;
+}
+
+- (void)setEnabled: (bool)enabled
+{
+	_enabled = enabled;
+
+	if (!enabled)
+		[self removeAllEntries];
+}
+
+- (size_t)memoryLimit
+{
+	return _memoryLimit;
+}
+
+- (void)setMemoryLimit: (size_t)memoryLimit
+{
+#ifdef OF_HAVE_THREADS
+	[_mutex lock];
+	@try {
+#endif
+		_memoryLimit = memoryLimit;
+		[self xmpp_evictEntries];
+#ifdef OF_HAVE_THREADS
+	} @finally {
+		[_mutex unlock];
+	}
+#endif
+}
+
+- (unsigned long long)numberOfHits
+{
+	unsigned long long numberOfHits;
+
+#ifdef OF_HAVE_THREADS
+	[_mutex lock];
+#endif
+	numberOfHits = _numberOfHits;
+#ifdef OF_HAVE_THREADS
+	[_mutex unlock];
+#endif
+
+	return numberOfHits;
+}
+
+- (unsigned long long)numberOfMisses
+{
+	unsigned long long numberOfMisses;
+
+#ifdef OF_HAVE_THREADS
+	[_mutex lock];
+#endif
+	numberOfMisses = _numberOfMisses;
+#ifdef OF_HAVE_THREADS
+	[_mutex unlock];
+#endif
+
+	return numberOfMisses;
+}
+
+- (void)removeAllEntries
+{
+#ifdef OF_HAVE_THREADS
+	[_mutex lock];
+	@try {
+#endif
+		[_entries removeAllObjects];
+		_mostRecentlyUsed = _leastRecentlyUsed = nil;
+		_memoryUsage = 0;
+#ifdef OF_HAVE_THREADS
+	} @finally {
+		[_mutex unlock];
+	}
+#endif
+}
+
+- (XMPPJID *)xmpp_JIDForString: (OFString *)string
+{
+	XMPPJIDCacheEntry *entry;
+	XMPPJID *JID;
+
+	if (!_enabled)
+		return nil;
+
+#ifdef OF_HAVE_THREADS
+	[_mutex lock];
+	@try {
+#endif
+		if ((entry = [_entries objectForKey: string]) == nil) {
+			_numberOfMisses++;
+			return nil;
+		}
+
+		_numberOfHits++;
+
+		if (entry != _mostRecentlyUsed) {
+			[self xmpp_unlinkEntry: entry];
+			[self xmpp_linkEntry: entry];
+		}
+
+		/* The entry might be evicted by another thread. */
+		JID = [[entry->_JID retain] autorelease];
+#ifdef OF_HAVE_THREADS
+	} @finally {
+		[_mutex unlock];
+	}
+#endif
+
+	return JID;
+}
+
+- (void)xmpp_setJID: (XMPPJID *)JID forString: (OFString *)string
+{
+	XMPPJIDCacheEntry *entry;
+
+	if (!_enabled)
+		return;
+
+	entry = [[[XMPPJIDCacheEntry alloc] init] autorelease];
+	entry->_string = [string copy];
+	entry->_JID = [JID copy];
+	/* Counts the parts, the bare JID and the full JID. */
+	entry->_size = ENTRY_OVERHEAD + string.UTF8StringLength +
+	    2 * (JID.node.UTF8StringLength + JID.domain.UTF8StringLength +
+	    JID.resource.UTF8StringLength);
+
+#ifdef OF_HAVE_THREADS
+	[_mutex lock];
+	@try {
+#endif
+		XMPPJIDCacheEntry *old = [_entries objectForKey: string];
+
+		if (old != nil) {
+			[self xmpp_unlinkEntry: old];
+			_memoryUsage -= old->_size;
+		}
+
+		[_entries setObject: entry forKey: entry->_string];
+		[self xmpp_linkEntry: entry];
+		_memoryUsage += entry->_size;
+
+		[self xmpp_evictEntries];
+#ifdef OF_HAVE_THREADS
+	} @finally {
+		[_mutex unlock];
+	}
+#endif
+}
+
+- (void)xmpp_unlinkEntry: (XMPPJIDCacheEntry *)entry
+{
+	if (entry->_previous != nil)
+		entry->_previous->_next = entry->_next;
+	else
+		_mostRecentlyUsed = entry->_next;
+
+	if (entry->_next != nil)
+		entry->_next->_previous = entry->_previous;
+	else
+		_leastRecentlyUsed = entry->_previous;
+
+	entry->_previous = entry->_next = nil;
+}
+
+- (void)xmpp_linkEntry: (XMPPJIDCacheEntry *)entry
+{
+	entry->_previous = nil;
+	entry->_next = _mostRecentlyUsed;
+
+	if (_mostRecentlyUsed != nil)
+		_mostRecentlyUsed->_previous = entry;
+	else
+		_leastRecentlyUsed = entry;
+
+	_mostRecentlyUsed = entry;
+}
+
+- (void)xmpp_evictEntries
+{
+	while (_memoryUsage > _memoryLimit && _leastRecentlyUsed != nil) {
+		XMPPJIDCacheEntry *entry = _leastRecentlyUsed;
+
+		[self xmpp_unlinkEntry: entry];
+		_memoryUsage -= entry->_size;
+
+		[entry retain];
+		[_entries removeObjectForKey: entry->_string];
+		[entry release];
+	}
+}
+@end
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2026, Jonathan Schleifer <js@nil.im>
+ *
+ * https://nil.im/objxmpp/
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice is present in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#import <ObjFW/OFObject.h>
+
+#import "XMPPStorage.h"
+
+OF_ASSUME_NONNULL_BEGIN
+
+#define XMPPJournalStorageDefaultCompactionRatio 2.0
+#define XMPPJournalStorageMinimumCompactionSize (64 * 1024)
+
+@class OFMutableData;
+@class OFMutableDictionary;
+@class OFThread;
+@class XMPPSyncedFile;
+
+/*!
+ * @brief A storage that appends changes to a journal instead of rewriting
+ *	  all data on every save.
+ *
+ * The data consists of a MessagePack snapshot at the specified path and
+ * numbered journal files next to it. Every change is recorded as a
+ * checksummed record of its path and value, which is appended to the journal
+ * on save. When opening the storage, the journal is replayed on top of the
+ * snapshot and a torn record at the end of the journal is discarded.
+ *
+ * Once the journal grows beyond the compaction ratio times the size of the
+ * snapshot, a new journal is started and a new snapshot is written in the
+ * background, which is atomically renamed into place before the old journal
+ * is removed.
+ */
+@interface XMPPJournalStorage: OFObject <XMPPStorage>
+{
+	OFString *_file;
+	OFMutableDictionary *_data;
+	OFMutableData *_pendingRecords;
+	unsigned long long _generation;
+	unsigned long long _snapshotSize, _journalSize, _journalFileSize;
+	XMPPSyncedFile *_Nullable _journalFile;
+	double _compactionRatio;
+#ifdef OF_HAVE_THREADS
+	OFThread *_compactionThread;
+#endif
+}
+
+/*!
+ * @brief The ratio between the size of the journal and the size of the
+ *	  snapshot at which the journal is compacted.
+ *
+ * Defaults to @ref XMPPJournalStorageDefaultCompactionRatio. Journals smaller
+ * than @ref XMPPJournalStorageMinimumCompactionSize are never compacted.
+ */
+@property (nonatomic) double compactionRatio;
+
+- (instancetype)init OF_UNAVAILABLE;
+
+/*!
+ * @brief Initializes an already allocated XMPPJournalStorage with the
+ *	  specified snapshot file.
+ *
+ * A snapshot written by @ref XMPPFileStorage can be opened as well.
+ *
+ * @param file The path of the snapshot. The journal files are created next to
+ *	       it.
+ * @return An initialized XMPPJournalStorage
+ */
+- (instancetype)initWithFile: (OFString *)file;
+
+/*!
+ * @brief Writes a new snapshot and removes the journal, waiting until this is
+ *	  done.
+ */
+- (void)compact;
+@end
+
+OF_ASSUME_NONNULL_END
@@ -0,0 +1,722 @@
+/*
+ * Copyright (c) 2026, Jonathan Schleifer <js@nil.im>
+ *
+ * https://nil.im/objxmpp/
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice is present in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#import <ObjFW/OFString.h>
+#import <ObjFW/OFArray.h>
+#import <ObjFW/OFDictionary.h>
+#import <ObjFW/OFNumber.h>
+#import <ObjFW/OFNull.h>
+#import <ObjFW/OFData.h>
+#import <ObjFW/OFFileManager.h>
+#import <ObjFW/OFOnce.h>
+#ifdef OF_HAVE_THREADS
+# import <ObjFW/OFThread.h>
+#endif
+
+#import <ObjFW/OFInvalidFormatException.h>
+#import <ObjFW/OFOpenItemFailedException.h>
+#import <ObjFW/OFOutOfRangeException.h>
+#import <ObjFW/OFWriteFailedException.h>
+
+#import "XMPPJournalStorage.h"
+#import "XMPPStoragePath.h"
+#import "XMPPSyncedFile.h"
+
+/*
+ * A record consists of the length and the CRC32 of the payload, both as
+ * big endian uint32_t, followed by the payload, which is the MessagePack
+ * representation of an array of the path components and the value. A
+ * removed value is stored as null.
+ */
+#define RECORD_HEADER_SIZE 8
+
+@interface XMPPJournalStorage ()
+- (OFString *)xmpp_journalPathForGeneration: (unsigned long long)generation;
+- (size_t)xmpp_replayJournalAtPath: (OFString *)path torn: (bool *)torn;
+- (void)xmpp_setObject: (id)object
+     forPathComponents: (OFArray *)pathComponents;
+- (id)xmpp_objectForPathComponents: (OFArray *)pathComponents;
+- (void)xmpp_appendRecordWithObject: (id)object
+		  forPathComponents: (OFArray *)pathComponents;
+- (void)xmpp_setAndRecordObject: (id)object
+	      forPathComponents: (OFArray *)pathComponents;
+- (void)xmpp_writePendingRecords;
+- (void)xmpp_startCompaction;
+- (void)xmpp_waitForCompaction;
+@end
+
+static uint32_t CRC32Table[256];
+
+static void
+initCRC32Table(void)
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t CRC = i;
+
+		for (uint_fast8_t j = 0; j < 8; j++)
+			CRC = (CRC >> 1) ^ (CRC & 1 ? 0xEDB88320 : 0);
+
+		CRC32Table[i] = CRC;
+	}
+}
+
+static uint32_t
+CRC32(const unsigned char *bytes, size_t length)
+{
+	static OFOnceControl onceControl = OFOnceControlInitValue;
+	uint32_t CRC = 0xFFFFFFFF;
+
+	OFOnce(&onceControl, initCRC32Table);
+
+	for (size_t i = 0; i < length; i++)
+		CRC = CRC32Table[(CRC ^ bytes[i]) & 0xFF] ^ (CRC >> 8);
+
+	return ~CRC;
+}
+
+/* Copies the tree so that the storage can keep mutating its own copy. */
+static id
+immutableCopy(id object)
+{
+	if ([object isKindOfClass: [OFDictionary class]]) {
+		OFMutableDictionary *copy = [OFMutableDictionary
+		    dictionaryWithCapacity: [object count]];
+
+		for (id key in object)
+			[copy setObject: immutableCopy([object
+					     objectForKey: key])
+				 forKey: key];
+
+		[copy makeImmutable];
+		return copy;
+	}
+
+	if ([object isKindOfClass: [OFArray class]]) {
+		OFMutableArray *copy =
+		    [OFMutableArray arrayWithCapacity: [object count]];
+
+		for (id item in object)
+			[copy addObject: immutableCopy(item)];
+
+		[copy makeImmutable];
+		return copy;
+	}
+
+	return [[object copy] autorelease];
+}
+
+/*
+ * Writes a snapshot that is followed by the journal of the specified
+ * generation and removes all older journals. Returns the size of the
+ * snapshot, or 0 if it could not be written, in which case the journals are
+ * kept.
+ */
+static size_t
+writeSnapshot(OFString *file, OFDictionary *data,
+    unsigned long long generation)
+{
+	void *pool = objc_autoreleasePoolPush();
+	OFFileManager *fileManager = [OFFileManager defaultManager];
+	OFData *snapshot;
+
+	snapshot = [[OFArray arrayWithObjects:
+	    [OFNumber numberWithUnsignedLongLong: generation], data, nil]
+	    messagePackRepresentation];
+
+	@try {
+		[XMPPSyncedFile replaceFileAtPath: file withData: snapshot];
+	} @catch (OFOpenItemFailedException *e) {
+		objc_autoreleasePoolPop(pool);
+		return 0;
+	} @catch (OFWriteFailedException *e) {
+		objc_autoreleasePoolPop(pool);
+		return 0;
+	}
+
+	/* The journals are contiguous, so stop at the first missing one. */
+	while (generation-- > 0) {
+		OFString *journal = [OFString stringWithFormat:
+		    @"%@.journal.%llu", file, generation];
+
+		if (![fileManager fileExistsAtPath: journal])
+			break;
+
+		[fileManager removeItemAtPath: journal];
+	}
+
+	objc_autoreleasePoolPop(pool);
+
+	return snapshot.count;
+}
+
+#ifdef OF_HAVE_THREADS
+/*
+ * Writes a snapshot in the background. This is a subclass instead of a block
+ * so that it also works with compilers that don't support blocks.
+ */
+@interface XMPPJournalCompactionThread: OFThread
+{
+@public
+	OFString *_file;
+	OFDictionary *_snapshot;
+	unsigned long long _generation;
+}
+@end
+
+@implementation XMPPJournalCompactionThread
+- (void)dealloc
+{
+	[_file release];
+	[_snapshot release];
+
+	[super dealloc];
+}
+
+- (id)main
+{
+	return [OFNumber numberWithUnsignedLongLong:
+	    writeSnapshot(_file, _snapshot, _generation)];
+}
+@end
+#endif
+
+@implementation XMPPJournalStorage
+@synthesize compactionRatio = _compactionRatio;
+
+- (instancetype)init
+{
+	OF_INVALID_INIT_METHOD
+}
+
+- (instancetype)initWithFile: (OFString *)file
+{
+	self = [super init];
+
+	@try {
+		void *pool = objc_autoreleasePoolPush();
+		OFFileManager *fileManager = [OFFileManager defaultManager];
+		unsigned long long snapshotGeneration = 0;
+		bool torn = false;
+
+		_file = [file copy];
+		_pendingRecords = [[OFMutableData alloc] init];
+		_compactionRatio = XMPPJournalStorageDefaultCompactionRatio;
+
+		if ([fileManager fileExistsAtPath: file]) {
+			OFData *data = [OFData dataWithContentsOfFile: file];
+			id snapshot = data.objectByParsingMessagePack;
+
+			/* Snapshots of XMPPFileStorage have no generation. */
+			if ([snapshot isKindOfClass: [OFArray class]] &&
+			    [snapshot count] == 2) {
+				snapshotGeneration = [[snapshot
+				    objectAtIndex: 0] unsignedLongLongValue];
+				snapshot = [snapshot objectAtIndex: 1];
+			}
+
+			if (![snapshot isKindOfClass: [OFDictionary class]])
+				@throw [OFInvalidFormatException exception];
+
+			_data = [snapshot mutableCopy];
+			_snapshotSize = data.count;
+		} else
+			_data = [[OFMutableDictionary alloc] init];
+
+		/*
+		 * If a compaction was interrupted before the snapshot was
+		 * renamed into place, there is more than one journal.
+		 */
+		_generation = snapshotGeneration;
+		for (;;) {
+			OFString *journal =
+			    [self xmpp_journalPathForGeneration: _generation];
+
+			if (![fileManager fileExistsAtPath: journal])
+				break;
+
+			/* Only a torn record in the last journal matters. */
+			torn = false;
+			_journalFileSize = [self
+			    xmpp_replayJournalAtPath: journal
+						torn: &torn];
+			_journalSize += _journalFileSize;
+
+			if (![fileManager fileExistsAtPath:
+			    [self xmpp_journalPathForGeneration:
+			    _generation + 1]])
+				break;
+
+			_generation++;
+		}
+
+		/*
+		 * Never append after a torn record, as it would hide all
+		 * records appended after it. The torn record is cut off and
+		 * only if that fails, a new journal is started.
+		 */
+		if (torn) {
+			OFString *journal =
+			    [self xmpp_journalPathForGeneration: _generation];
+			XMPPSyncedFile *journalFile = nil;
+
+			@try {
+				journalFile = [XMPPSyncedFile
+				    fileWithPath: journal
+					  append: true];
+			} @catch (OFOpenItemFailedException *e) {
+			}
+
+			if ([journalFile truncateToLength: _journalFileSize])
+				_journalFile = [journalFile retain];
+			else {
+				_generation++;
+				_journalFileSize = 0;
+			}
+		}
+
+		/*
+		 * Journals older than the snapshot are left over if a
+		 * compaction was interrupted before removing them.
+		 */
+		while (snapshotGeneration-- > 0) {
+			OFString *journal = [self
+			    xmpp_journalPathForGeneration: snapshotGeneration];
+
+			if (![fileManager fileExistsAtPath: journal])
+				break;
+
+			[fileManager removeItemAtPath: journal];
+		}
+
+		objc_autoreleasePoolPop(pool);
+	} @catch (id e) {
+		[self release];
+		@throw e;
+	}
+
+	return self;
+}
+
+- (void)dealloc
+{
+	[self xmpp_waitForCompaction];
+
+	[_journalFile release];
+	[_file release];
+	[_data release];
+	[_pendingRecords release];
+
+	[super dealloc];
+}
+
+- (OFString *)xmpp_journalPathForGeneration: (unsigned long long)generation
+{
+	return [OFString stringWithFormat: @"%@.journal.%llu",
+	    _file, generation];
+}
+
+- (size_t)xmpp_replayJournalAtPath: (OFString *)path torn: (bool *)torn
+{
+	OFData *journal = [OFData dataWithContentsOfFile: path];
+	const unsigned char *items = journal.items;
+	size_t count = journal.count, offset = 0;
+
+	while (count - offset >= RECORD_HEADER_SIZE) {
+		void *pool = objc_autoreleasePoolPush();
+		uint32_t length, checksum;
+		id record, object;
+
+		memcpy(&length, items + offset, 4);
+		length = OFFromBigEndian32(length);
+		memcpy(&checksum, items + offset + 4, 4);
+		checksum = OFFromBigEndian32(checksum);
+
+		/* Records are never empty, so this is a zeroed tail. */
+		if (length == 0 ||
+		    length > count - offset - RECORD_HEADER_SIZE ||
+		    CRC32(items + offset + RECORD_HEADER_SIZE, length) !=
+		    checksum) {
+			objc_autoreleasePoolPop(pool);
+			break;
+		}
+
+		@try {
+			record = [[journal subdataWithRange: OFMakeRange(
+			    offset + RECORD_HEADER_SIZE, length)]
+			    objectByParsingMessagePack];
+		} @catch (OFInvalidFormatException *e) {
+			objc_autoreleasePoolPop(pool);
+			break;
+		}
+
+		if (![record isKindOfClass: [OFArray class]] ||
+		    [record count] != 2 || ![[record objectAtIndex: 0]
+		    isKindOfClass: [OFArray class]]) {
+			objc_autoreleasePoolPop(pool);
+			break;
+		}
+
+		object = [record objectAtIndex: 1];
+		if ([object isKindOfClass: [OFNull class]])
+			object = nil;
+
+		[self xmpp_setObject: object
+		   forPathComponents: [record objectAtIndex: 0]];
+
+		offset += RECORD_HEADER_SIZE + length;
+
+		objc_autoreleasePoolPop(pool);
+	}
+
+	if (offset < count)
+		*torn = true;
+
+	return offset;
+}
+
+- (void)xmpp_setObject: (id)object
+     forPathComponents: (OFArray *)pathComponents
+{
+	OFMutableDictionary *iter = _data;
+	size_t i = 0, components = pathComponents.count;
+
+	for (OFString *component in pathComponents) {
+		id iter2;
+
+		if (i++ == components - 1)
+			continue;
+
+		iter2 = [iter objectForKey: component];
+
+		/* Dictionaries read from the snapshot are immutable. */
+		if (![iter2 isKindOfClass: [OFMutableDictionary class]]) {
+			if ([iter2 isKindOfClass: [OFDictionary class]])
+				iter2 = [[iter2 mutableCopy] autorelease];
+			else
+				iter2 = [OFMutableDictionary dictionary];
+
+			[iter setObject: iter2 forKey: component];
+		}
+
+		iter = iter2;
+	}
+
+	if (object != nil)
+		[iter setObject: object forKey: pathComponents.lastObject];
+	else
+		[iter removeObjectForKey: pathComponents.lastObject];
+}
+
+- (id)xmpp_objectForPathComponents: (OFArray *)pathComponents
+{
+	id object = _data;
+
+	for (OFString *component in pathComponents)
+		object = [object objectForKey: component];
+
+	return object;
+}
+
+- (void)xmpp_appendRecordWithObject: (id)object
+		  forPathComponents: (OFArray *)pathComponents
+{
+	OFData *payload = [[OFArray arrayWithObjects: pathComponents,
+	    (object != nil ? object : [OFNull null]), nil]
+	    messagePackRepresentation];
+	uint32_t header[2];
+
+	if (payload.count > UINT32_MAX)
+		@throw [OFOutOfRangeException exception];
+
+	header[0] = OFToBigEndian32((uint32_t)payload.count);
+	header[1] = OFToBigEndian32(CRC32(payload.items, payload.count));
+
+	[_pendingRecords addItems: header count: sizeof(header)];
+	[_pendingRecords addItems: payload.items count: payload.count];
+}
+
+- (void)xmpp_setAndRecordObject: (id)object
+	      forPathComponents: (OFArray *)pathComponents
+{
+	void *pool = objc_autoreleasePoolPush();
+
+	object = [[object copy] autorelease];
+
+	[self xmpp_appendRecordWithObject: object
+			forPathComponents: pathComponents];
+	[self xmpp_setObject: object forPathComponents: pathComponents];
+
+	objc_autoreleasePoolPop(pool);
+}
+
+- (void)xmpp_writePendingRecords
+{
+	if (_pendingRecords.count == 0)
+		return;
+
+	if (_journalFile == nil) {
+		OFString *journal =
+		    [self xmpp_journalPathForGeneration: _generation];
+
+		_journalFile = [[XMPPSyncedFile alloc] initWithPath: journal
+							     append: true];
+
+		/* Make sure the new journal itself survives a crash. */
+		[XMPPSyncedFile synchronizeDirectoryOfFileAtPath: journal];
+	}
+
+	@try {
+		[_journalFile writeBuffer: _pendingRecords.items
+				   length: _pendingRecords.count];
+		[_journalFile synchronize];
+	} @catch (OFWriteFailedException *e) {
+		/* Don't leave a torn record for the next append. */
+		if (![_journalFile truncateToLength: _journalFileSize]) {
+			[_journalFile release];
+			_journalFile = nil;
+			_generation++;
+			_journalFileSize = 0;
+		}
+
+		@throw e;
+	}
+
+	_journalSize += _pendingRecords.count;
+	_journalFileSize += _pendingRecords.count;
+	[_pendingRecords removeAllItems];
+}
+
+- (void)save
+{
+	[self xmpp_writePendingRecords];
+
+	if (_journalSize >= XMPPJournalStorageMinimumCompactionSize &&
+	    _journalSize > _snapshotSize * _compactionRatio)
+		[self xmpp_startCompaction];
+}
+
+- (void)compact
+{
+	[self xmpp_writePendingRecords];
+	[self xmpp_startCompaction];
+	[self xmpp_waitForCompaction];
+}
+
+- (void)xmpp_startCompaction
+{
+	void *pool = objc_autoreleasePoolPush();
+	OFString *file = _file;
+	OFDictionary *snapshot;
+	unsigned long long generation;
+#ifdef OF_HAVE_THREADS
+	XMPPJournalCompactionThread *compactionThread;
+#endif
+
+	[self xmpp_waitForCompaction];
+
+	/*
+	 * Everything up to here is in the snapshot, everything from here on
+	 * goes into the journal of the next generation.
+	 */
+	[_journalFile release];
+	_journalFile = nil;
+	generation = ++_generation;
+	_journalSize = _journalFileSize = 0;
+
+	snapshot = immutableCopy(_data);
+
+#ifdef OF_HAVE_THREADS
+	compactionThread = [[XMPPJournalCompactionThread alloc] init];
+	compactionThread->_file = [file copy];
+	compactionThread->_snapshot = [snapshot retain];
+	compactionThread->_generation = generation;
+	_compactionThread = compactionThread;
+	_compactionThread.name = @"XMPPJournalStorage compaction";
+	[_compactionThread start];
+#else
+	size_t snapshotSize = writeSnapshot(file, snapshot, generation);
+
+	if (snapshotSize > 0)
+		_snapshotSize = snapshotSize;
+#endif
+
+	objc_autoreleasePoolPop(pool);
+}
+
+- (void)xmpp_waitForCompaction
+{
+#ifdef OF_HAVE_THREADS
+	size_t snapshotSize;
+
+	if (_compactionThread == nil)
+		return;
+
+	snapshotSize = (size_t)[[_compactionThread join] unsignedLongLongValue];
+	[_compactionThread release];
+	_compactionThread = nil;
+
+	if (snapshotSize > 0)
+		_snapshotSize = snapshotSize;
+#endif
+}
+
+- (void)xmpp_setAndRecordObject: (id)object forPath: (OFString *)path
+{
+	void *pool = objc_autoreleasePoolPush();
+
+	[self xmpp_setAndRecordObject: object
+		    forPathComponents: [path componentsSeparatedByString: @"."]];
+
+	objc_autoreleasePoolPop(pool);
+}
+
+- (id)xmpp_objectForPath: (OFString *)path
+{
+	void *pool = objc_autoreleasePoolPush();
+	id object = [self xmpp_objectForPathComponents:
+	    [path componentsSeparatedByString: @"."]];
+
+	objc_autoreleasePoolPop(pool);
+
+	return object;
+}
+
+- (void)setStringValue: (OFString *)string forPath: (OFString *)path
+{
+	[self xmpp_setAndRecordObject: string forPath: path];
+}
+
+- (OFString *)stringValueForPath: (OFString *)path
+{
+	return [self xmpp_objectForPath: path];
+}
+
+- (void)setBooleanValue: (bool)boolean forPath: (OFString *)path
+{
+	[self xmpp_setAndRecordObject: [OFNumber numberWithBool: boolean]
+			      forPath: path];
+}
+
+- (bool)booleanValueForPath: (OFString *)path
+{
+	return [[self xmpp_objectForPath: path] boolValue];
+}
+
+- (void)setIntegerValue: (long long)integer forPath: (OFString *)path
+{
+	[self xmpp_setAndRecordObject: [OFNumber numberWithLongLong: integer]
+			      forPath: path];
+}
+
+- (long long)integerValueForPath: (OFString *)path
+{
+	return [[self xmpp_objectForPath: path] longLongValue];
+}
+
+- (void)setArray: (OFArray *)array forPath: (OFString *)path
+{
+	[self xmpp_setAndRecordObject: array forPath: path];
+}
+
+- (OFArray *)arrayForPath: (OFString *)path
+{
+	return [self xmpp_objectForPath: path];
+}
+
+- (void)setDictionary: (OFDictionary *)dictionary forPath: (OFString *)path
+{
+	[self xmpp_setAndRecordObject: dictionary forPath: path];
+}
+
+- (OFDictionary *)dictionaryForPath: (OFString *)path
+{
+	return [self xmpp_objectForPath: path];
+}
+
+- (XMPPStoragePath *)pathHandleForPath: (OFString *)path
+{
+	return [XMPPStoragePath pathWithString: path];
+}
+
+- (void)setStringValue: (OFString *)string
+	 forPathHandle: (XMPPStoragePath *)path
+{
+	[self xmpp_setAndRecordObject: string
+		    forPathComponents: path.components];
+}
+
+- (OFString *)stringValueForPathHandle: (XMPPStoragePath *)path
+{
+	return [self xmpp_objectForPathComponents: path.components];
+}
+
+- (void)setBooleanValue: (bool)boolean forPathHandle: (XMPPStoragePath *)path
+{
+	[self xmpp_setAndRecordObject: [OFNumber numberWithBool: boolean]
+		    forPathComponents: path.components];
+}
+
+- (bool)booleanValueForPathHandle: (XMPPStoragePath *)path
+{
+	return [[self xmpp_objectForPathComponents: path.components] boolValue];
+}
+
+- (void)setIntegerValue: (long long)integer
+	  forPathHandle: (XMPPStoragePath *)path
+{
+	[self xmpp_setAndRecordObject: [OFNumber numberWithLongLong: integer]
+		    forPathComponents: path.components];
+}
+
+- (long long)integerValueForPathHandle: (XMPPStoragePath *)path
+{
+	return [[self xmpp_objectForPathComponents: path.components]
+	    longLongValue];
+}
+
+- (void)setArray: (OFArray *)array forPathHandle: (XMPPStoragePath *)path
+{
+	[self xmpp_setAndRecordObject: array
+		    forPathComponents: path.components];
+}
+
+- (OFArray *)arrayForPathHandle: (XMPPStoragePath *)path
+{
+	return [self xmpp_objectForPathComponents: path.components];
+}
+
+- (void)setDictionary: (OFDictionary *)dictionary
+	forPathHandle: (XMPPStoragePath *)path
+{
+	[self xmpp_setAndRecordObject: dictionary
+		    forPathComponents: path.components];
+}
+
+- (OFDictionary *)dictionaryForPathHandle: (XMPPStoragePath *)path
+{
+	return [self xmpp_objectForPathComponents: path.components];
+}
+@end
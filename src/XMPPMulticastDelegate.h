@@ -24,6 +24,7 @@
 
 OF_ASSUME_NONNULL_BEGIN
 
+@class OFMapTable;
 @class OFMutableData;
 
 /*!
@@ -32,6 +33,7 @@ OF_ASSUME_NONNULL_BEGIN
 @interface XMPPMulticastDelegate: OFObject
 {
 	OFMutableData *_delegates;
+	OFMapTable *_responders;
 }
 
 /*!
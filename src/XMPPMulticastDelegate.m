@@ -27,6 +27,32 @@
 
 #import "XMPPMulticastDelegate.h"
 
+struct responder {
+	id object;
+	IMP method;
+};
+
+static void *
+retainObject(void *object)
+{
+	return [(id)object retain];
+}
+
+static void
+releaseObject(void *object)
+{
+	[(id)object release];
+}
+
+static const OFMapTableFunctions objectFunctions = {
+	.retain = retainObject,
+	.release = releaseObject
+};
+
+@interface XMPPMulticastDelegate ()
+- (OFData *)xmpp_respondersForSelector: (SEL)selector;
+@end
+
 @implementation XMPPMulticastDelegate
 - (instancetype)init
 {
@@ -35,6 +61,9 @@
 	@try {
 		_delegates = [[OFMutableData alloc]
 		    initWithItemSize: sizeof(id)];
+		_responders = [[OFMapTable alloc]
+		    initWithKeyFunctions: (OFMapTableFunctions){ NULL }
+			 objectFunctions: objectFunctions];
 	} @catch (id e) {
 		[self release];
 		@throw e;
@@ -46,6 +75,7 @@
 - (void)dealloc
 {
 	[_delegates release];
+	[_responders release];
 
 	[super dealloc];
 }
@@ -53,6 +83,7 @@
 - (void)addDelegate: (id)delegate
 {
 	[_delegates addItem: &delegate];
+	[_responders removeAllObjects];
 }
 
 - (void)removeDelegate: (id)delegate
@@ -65,28 +96,71 @@
 			continue;
 
 		[_delegates removeItemAtIndex: i];
+		[_responders removeAllObjects];
 		return;
 	}
 }
 
-- (bool)broadcastSelector: (SEL)selector withObject: (id)object
+/*
+ * Returns the delegates responding to the selector together with their
+ * implementation of it. The result is cached until a delegate is added or
+ * removed.
+ */
+- (OFData *)xmpp_respondersForSelector: (SEL)selector
 {
-	void *pool = objc_autoreleasePoolPush();
-	OFMutableData *currentDelegates = [[_delegates copy] autorelease];
-	id const *items = currentDelegates.items;
-	size_t i, count = currentDelegates.count;
-	bool handled = false;
+	OFMutableData *responders;
+	id const *items;
+	size_t i, count;
+
+	if ((responders = [_responders objectForKey: (void *)selector]) != nil)
+		return responders;
+
+	responders = [OFMutableData
+	    dataWithItemSize: sizeof(struct responder)];
+	items = _delegates.items;
+	count = _delegates.count;
 
 	for (i = 0; i < count; i++) {
-		id responder = items[i];
+		struct responder responder;
 
-		if (![responder respondsToSelector: selector])
+		if (![items[i] respondsToSelector: selector])
 			continue;
 
-		bool (*imp)(id, SEL, id) = (bool(*)(id, SEL, id))
-		    [responder methodForSelector: selector];
+		responder.object = items[i];
+		responder.method = [items[i] methodForSelector: selector];
+
+		[responders addItem: &responder];
+	}
+
+	[responders makeImmutable];
+	[_responders setObject: responders forKey: (void *)selector];
+
+	return responders;
+}
+
+- (bool)broadcastSelector: (SEL)selector withObject: (id)object
+{
+	/*
+	 * Delegates autorelease objects while handling the broadcast, which
+	 * would otherwise pile up in the pool of the run loop iteration.
+	 */
+	void *pool = objc_autoreleasePoolPush();
+	/*
+	 * Retained, as adding or removing a delegate during the broadcast
+	 * releases the cached responders. Delegates removed during the
+	 * broadcast still receive it.
+	 */
+	OFData *responders =
+	    [[[self xmpp_respondersForSelector: selector] retain] autorelease];
+	const struct responder *items = responders.items;
+	size_t i, count = responders.count;
+	bool handled = false;
+
+	for (i = 0; i < count; i++) {
+		bool (*imp)(id, SEL, id) =
+		    (bool (*)(id, SEL, id))items[i].method;
 
-		handled |= imp(responder, selector, object);
+		handled |= imp(items[i].object, selector, object);
 	}
 
 	objc_autoreleasePoolPop(pool);
@@ -98,22 +172,19 @@
 	       withObject: (id)object1
 	       withObject: (id)object2
 {
+	/* See above for why there is a pool and this is retained. */
 	void *pool = objc_autoreleasePoolPush();
-	OFMutableData *currentDelegates = [[_delegates copy] autorelease];
-	id const *items = currentDelegates.items;
-	size_t i, count = currentDelegates.count;
+	OFData *responders =
+	    [[[self xmpp_respondersForSelector: selector] retain] autorelease];
+	const struct responder *items = responders.items;
+	size_t i, count = responders.count;
 	bool handled = false;
 
 	for (i = 0; i < count; i++) {
-		id responder = items[i];
-
-		if (![responder respondsToSelector: selector])
-			continue;
-
-		bool (*imp)(id, SEL, id, id) = (bool(*)(id, SEL, id, id))
-		    [responder methodForSelector: selector];
+		bool (*imp)(id, SEL, id, id) =
+		    (bool (*)(id, SEL, id, id))items[i].method;
 
-		handled |= imp(responder, selector, object1, object2);
+		handled |= imp(items[i].object, selector, object1, object2);
 	}
 
 	objc_autoreleasePoolPop(pool);
@@ -0,0 +1,29 @@
+#import "XMPPPresence.h"
+
+OF_ASSUME_NONNULL_BEGIN
+
+/* Ordered the same way as by -[XMPPPresence compare:]. */
+typedef enum {
+	XMPPPresenceShowChat,
+	XMPPPresenceShowAvailable,
+	XMPPPresenceShowAway,
+	XMPPPresenceShowDND,
+	XMPPPresenceShowXA,
+	XMPPPresenceShowUnknown
+} XMPPPresenceShow;
+
+/* The number of bits of the sort key used for the show value. */
+#define XMPPPresenceSortKeyShowBits 3
+
+@interface XMPPPresence ()
+@property (readonly, nonatomic) XMPPPresenceShow xmpp_showValue;
+@property (readonly, nonatomic) int xmpp_priorityValue;
+
+/*
+ * The priority and the show value packed into an integer, so that comparing
+ * two presences is a single subtraction.
+ */
+@property (readonly, nonatomic) int xmpp_sortKey;
+@end
+
+OF_ASSUME_NONNULL_END
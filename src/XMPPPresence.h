@@ -32,6 +32,7 @@ OF_ASSUME_NONNULL_BEGIN
 {
 	OFString *_status, *_show;
 	OFNumber *_priority;
+	int _sortKey;
 }
 
 /*!
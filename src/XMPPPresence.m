@@ -27,24 +27,31 @@
 #include <inttypes.h>
 
 #import "XMPPPresence.h"
+#import "XMPPPresence+Private.h"
 #import "namespaces.h"
 
-/* This provides us with sortable values for show values */
-static int
-showToInt(OFString *show)
+static XMPPPresenceShow
+parseShow(OFString *show)
 {
+	if (show == nil)
+		return XMPPPresenceShowAvailable;
 	if ([show isEqual: @"chat"])
-		return 0;
-	if (show == nil) /* available */
-		return 1;
+		return XMPPPresenceShowChat;
 	if ([show isEqual: @"away"])
-		return 2;
+		return XMPPPresenceShowAway;
 	if ([show isEqual: @"dnd"])
-		return 3;
+		return XMPPPresenceShowDND;
 	if ([show isEqual: @"xa"])
-		return 4;
+		return XMPPPresenceShowXA;
 
-	OFEnsure(0);
+	return XMPPPresenceShowUnknown;
+}
+
+static OF_INLINE int
+makeSortKey(int priority, XMPPPresenceShow show)
+{
+	/* Priorities are in the range -128 to 127. */
+	return ((priority + 128) << XMPPPresenceSortKeyShowBits) | show;
 }
 
 @implementation XMPPPresence
@@ -87,13 +94,19 @@ showToInt(OFString *show)
 
 - (instancetype)initWithType: (OFString *)type ID: (OFString *)ID
 {
-	return [super initWithName: @"presence" type: type ID: ID];
+	self = [super initWithName: @"presence" type: type ID: ID];
+
+	_sortKey = makeSortKey(0, XMPPPresenceShowAvailable);
+
+	return self;
 }
 
 - (instancetype)initWithElement: (OFXMLElement *)element
 {
 	self = [super initWithElement: element];
 
+	_sortKey = makeSortKey(0, XMPPPresenceShowAvailable);
+
 	@try {
 		OFXMLElement *subElement;
 
@@ -143,6 +156,8 @@ showToInt(OFString *show)
 	old = _show;
 	_show = [show copy];
 	[old release];
+
+	_sortKey = makeSortKey(self.xmpp_priorityValue, parseShow(_show));
 }
 
 - (void)setStatus: (OFString *)status
@@ -187,14 +202,28 @@ showToInt(OFString *show)
 	old = _priority;
 	_priority = [priority copy];
 	[old release];
+
+	_sortKey = makeSortKey((int)prio, self.xmpp_showValue);
+}
+
+- (XMPPPresenceShow)xmpp_showValue
+{
+	return _sortKey & ((1 << XMPPPresenceSortKeyShowBits) - 1);
+}
+
+- (int)xmpp_priorityValue
+{
+	return (_sortKey >> XMPPPresenceSortKeyShowBits) - 128;
+}
+
+- (int)xmpp_sortKey
+{
+	return _sortKey;
 }
 
 - (OFComparisonResult)compare: (id <OFComparing>)object
 {
-	XMPPPresence *otherPresence;
-	OFNumber *otherPriority;
-	OFString *otherShow;
-	OFComparisonResult priorityOrder;
+	int difference;
 
 	if (object == self)
 		return OFOrderedSame;
@@ -202,27 +231,13 @@ showToInt(OFString *show)
 	if (![(id)object isKindOfClass: [XMPPPresence class]])
 		@throw [OFInvalidArgumentException exception];
 
-	otherPresence = (XMPPPresence *)object;
-	otherPriority = otherPresence.priority;
-	if (otherPriority == nil)
-		otherPriority = [OFNumber numberWithChar: 0];
-
-	if (_priority != nil)
-		priorityOrder = [_priority compare: otherPriority];
-	else
-		priorityOrder =
-		    [[OFNumber numberWithChar: 0] compare: otherPriority];
-
-	if (priorityOrder != OFOrderedSame)
-		return priorityOrder;
-
-	otherShow = otherPresence.show;
-	if ([_show isEqual: otherShow])
-		return OFOrderedSame;
+	difference = _sortKey - ((XMPPPresence *)object)->_sortKey;
 
-	if (showToInt(_show) < showToInt(otherShow))
+	if (difference < 0)
 		return OFOrderedAscending;
+	if (difference > 0)
+		return OFOrderedDescending;
 
-	return OFOrderedDescending;
+	return OFOrderedSame;
 }
 @end
@@ -28,10 +28,13 @@
 
 OF_ASSUME_NONNULL_BEGIN
 
+#define XMPPRosterDefaultItemsChunkSize 1000
+
 @class XMPPRosterItem;
 @class XMPPIQ;
 @class XMPPRoster;
 @class XMPPMulticastDelegate;
+@class XMPPStoragePath;
 
 /*!
  * @brief A protocol that should be (partially) implemented by delegates
@@ -47,6 +50,23 @@ OF_ASSUME_NONNULL_BEGIN
  */
 - (void)rosterWasReceived: (XMPPRoster *)roster;
 
+/*!
+ * @brief This callback is called for every chunk of roster items while a
+ *	  roster requested with -requestRoster is being received.
+ *
+ * The items are processed as soon as they have been parsed, so this can be
+ * used to report progress for large rosters. All chunks have been delivered
+ * before @ref rosterWasReceived: is called.
+ *
+ * The roster itself is only replaced once the complete roster has been
+ * received. If receiving it fails, the previous roster is kept.
+ *
+ * @param roster The roster that is being received
+ * @param rosterItems The roster items received since the last chunk
+ */
+-          (void)roster: (XMPPRoster *)roster
+  didReceiveRosterItems: (OFArray OF_GENERIC(XMPPRosterItem *) *)rosterItems;
+
 /*!
  * @brief This callback is called whenever a roster push was received.
  *
@@ -60,13 +80,22 @@ OF_ASSUME_NONNULL_BEGIN
 /*!
  * @brief A class implementing roster related functionality.
  */
-@interface XMPPRoster: OFObject <XMPPConnectionDelegate>
+@interface XMPPRoster: OFObject <XMPPConnectionDelegate, XMPPIQHandler,
+    XMPPStreamingHandler>
 {
 	XMPPConnection *_connection;
 	OFMutableDictionary *_rosterItems;
+	OFMutableDictionary *_indexEntries, *_groupIndex;
+	OFMutableArray *_nameIndex;
 	XMPPMulticastDelegate *_delegates;
 	id <XMPPStorage> _dataStorage;
-	bool _rosterRequested;
+	XMPPStoragePath *_versionPath, *_itemsPath;
+	OFString *_Nullable _rosterRequestID;
+	OFMutableDictionary *_Nullable _initialRosterItems;
+	OFMutableDictionary *_Nullable _initialStorageItems;
+	OFMutableArray OF_GENERIC(XMPPRosterItem *) *_itemsChunk;
+	size_t _itemsChunkSize;
+	bool _rosterRequested, _streamingRoster, _nameIndexNeedsSorting;
 }
 
 /*!
@@ -88,6 +117,20 @@ OF_ASSUME_NONNULL_BEGIN
 @property (readonly, nonatomic)
     OFDictionary OF_GENERIC(OFString *, XMPPRosterItem *) *rosterItems;
 
+/*!
+ * @brief The names of all groups which contain at least one roster item.
+ */
+@property (readonly, nonatomic) OFArray OF_GENERIC(OFString *) *groups;
+
+/*!
+ * @brief The number of roster items after which
+ *	  @ref XMPPRosterDelegate::roster:didReceiveRosterItems: is called while
+ *	  receiving the roster.
+ *
+ * Defaults to @ref XMPPRosterDefaultItemsChunkSize.
+ */
+@property (nonatomic) size_t itemsChunkSize;
+
 - (instancetype)init OF_UNAVAILABLE;
 
 /*!
@@ -105,6 +148,31 @@ OF_ASSUME_NONNULL_BEGIN
  */
 - (void)requestRoster;
 
+/*!
+ * @brief Returns the roster items in the specified group.
+ *
+ * This uses an index and does not need to look at the other roster items.
+ *
+ * @param group The name of the group
+ * @return The roster items in the specified group
+ */
+- (OFArray OF_GENERIC(XMPPRosterItem *) *)rosterItemsInGroup:
+    (OFString *)group;
+
+/*!
+ * @brief Returns the roster items whose display name starts with the specified
+ *	  prefix, ignoring case, sorted by their display name.
+ *
+ * The display name is the name of the roster item or its bare JID if it has
+ * no name. This uses a sorted index, so it is suitable for autocompletion
+ * even with large rosters.
+ *
+ * @param prefix The prefix of the display name
+ * @return The roster items whose display name starts with the prefix
+ */
+- (OFArray OF_GENERIC(XMPPRosterItem *) *)rosterItemsWithNamePrefix:
+    (OFString *)prefix;
+
 /*!
  * @brief Adds a new contact to the roster.
  *
@@ -36,22 +36,118 @@
 #import "XMPPIQ.h"
 #import "XMPPJID.h"
 #import "XMPPMulticastDelegate.h"
+#import "XMPPStoragePath.h"
 #import "namespaces.h"
 
 OF_ASSUME_NONNULL_BEGIN
 
+/*
+ * The indexed state of a roster item. This is kept separately so that the
+ * item can be removed from the indexes even if it was modified in the
+ * meantime.
+ */
+@interface XMPPRosterIndexEntry: OFObject
+{
+@public
+	OFString *_bareJID, *_foldedName;
+	OFArray *_Nullable _groups;
+	XMPPRosterItem *_rosterItem;
+}
+
+- (OFComparisonResult)compare: (XMPPRosterIndexEntry *)entry;
+@end
+
 @interface XMPPRoster ()
+- (void)xmpp_addIndexEntryForRosterItem: (XMPPRosterItem *)rosterItem;
+- (void)xmpp_removeIndexEntryForBareJID: (OFString *)bareJID;
 - (void)xmpp_updateRosterItem: (XMPPRosterItem *)rosterItem;
+- (void)xmpp_applyRosterItem: (XMPPRosterItem *)rosterItem;
+- (void)xmpp_replaceRosterItems: (OFDictionary *)rosterItems;
+- (void)xmpp_addInitialRosterItem: (XMPPRosterItem *)rosterItem;
+- (void)xmpp_flushItemsChunk;
+- (OFDictionary *)xmpp_storageDictionaryForRosterItem:
+    (XMPPRosterItem *)rosterItem;
+- (XMPPRosterItem *)xmpp_rosterItemWithStorageDictionary:
+    (OFDictionary *)item;
 - (void)xmpp_handleInitialRosterForConnection: (XMPPConnection *)connection
 					   IQ: (XMPPIQ *)IQ;
 - (XMPPRosterItem *)xmpp_rosterItemWithXMLElement: (OFXMLElement *)element;
+- (nullable OFString *)xmpp_storedVersion;
+- (void)xmpp_setStoredVersion: (nullable OFString *)version;
+- (nullable OFDictionary *)xmpp_storedItems;
+- (void)xmpp_setStoredItems: (nullable OFDictionary *)items;
+- (void)xmpp_setStoredItem: (nullable OFDictionary *)item
+		forBareJID: (OFString *)bareJID;
 @end
 
 OF_ASSUME_NONNULL_END
 
+@implementation XMPPRosterIndexEntry
+- (void)dealloc
+{
+	[_bareJID release];
+	[_foldedName release];
+	[_groups release];
+	[_rosterItem release];
+
+	[super dealloc];
+}
+
+/* The order of the name index. */
+- (OFComparisonResult)compare: (XMPPRosterIndexEntry *)entry
+{
+	OFComparisonResult result = [_foldedName compare: entry->_foldedName];
+
+	if (result == OFOrderedSame)
+		result = [_bareJID compare: entry->_bareJID];
+
+	return result;
+}
+@end
+
+static OFString *
+foldedDisplayName(XMPPRosterItem *rosterItem)
+{
+	OFString *name = rosterItem.name;
+
+	if (name == nil)
+		name = rosterItem.JID.bareJID;
+
+	return name.lowercaseString;
+}
+
+/*
+ * Returns the index of the first entry in the name index that is not ordered
+ * before the specified folded name and bare JID. If no bare JID is specified,
+ * this is the first entry whose name is not ordered before the name.
+ */
+static size_t
+nameIndexLowerBound(OFArray *nameIndex, OFString *foldedName,
+    OFString *_Nullable bareJID)
+{
+	size_t low = 0, high = nameIndex.count;
+
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		XMPPRosterIndexEntry *entry = [nameIndex objectAtIndex: middle];
+		OFComparisonResult result =
+		    [entry->_foldedName compare: foldedName];
+
+		if (result == OFOrderedSame && bareJID != nil)
+			result = [entry->_bareJID compare: bareJID];
+
+		if (result == OFOrderedAscending)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return low;
+}
+
 @implementation XMPPRoster
 @synthesize connection = _connection, dataStorage = _dataStorage;
-@synthesize rosterItems = _rosterItems;
+@synthesize rosterItems = _rosterItems, itemsChunkSize = _itemsChunkSize;
 
 - (instancetype)init
 {
@@ -64,10 +160,20 @@ OF_ASSUME_NONNULL_END
 
 	@try {
 		_rosterItems = [[OFMutableDictionary alloc] init];
+		_indexEntries = [[OFMutableDictionary alloc] init];
+		_groupIndex = [[OFMutableDictionary alloc] init];
+		_nameIndex = [[OFMutableArray alloc] init];
 		_connection = connection;
 		[_connection addDelegate: self];
+		[_connection registerIQHandler: self
+				  forNamespace: XMPPRosterNS
+					  type: @"set"];
+		[_connection registerStreamingHandler: self
+					 forNamespace: XMPPRosterNS];
+		_itemsChunk = [[OFMutableArray alloc] init];
+		_itemsChunkSize = XMPPRosterDefaultItemsChunkSize;
 		_delegates = [[XMPPMulticastDelegate alloc] init];
-		_dataStorage = _connection.dataStorage;
+		self.dataStorage = _connection.dataStorage;
 	} @catch (id e) {
 		[self release];
 		@throw e;
@@ -78,9 +184,23 @@ OF_ASSUME_NONNULL_END
 
 - (void)dealloc
 {
+	[_connection unregisterIQHandler: self
+			    forNamespace: XMPPRosterNS
+				    type: @"set"];
+	[_connection unregisterStreamingHandler: self
+				   forNamespace: XMPPRosterNS];
 	[_connection removeDelegate: self];
 	[_delegates release];
 	[_rosterItems release];
+	[_indexEntries release];
+	[_groupIndex release];
+	[_nameIndex release];
+	[_versionPath release];
+	[_itemsPath release];
+	[_rosterRequestID release];
+	[_initialRosterItems release];
+	[_initialStorageItems release];
+	[_itemsChunk release];
 
 	[super dealloc];
 }
@@ -98,8 +218,7 @@ OF_ASSUME_NONNULL_END
 				    namespace: XMPPRosterNS];
 
 	if (_connection.supportsRosterVersioning) {
-		OFString *ver =
-		    [_dataStorage stringValueForPath: @"roster.ver"];
+		OFString *ver = [self xmpp_storedVersion];
 
 		if (ver == nil)
 			ver = @"";
@@ -109,30 +228,31 @@ OF_ASSUME_NONNULL_END
 
 	[IQ addChild: query];
 
+	[_rosterRequestID release];
+	_rosterRequestID = [IQ.ID copy];
+
 	[_connection sendIQ: IQ
 	     callbackTarget: self
 		   selector: @selector(xmpp_handleInitialRosterForConnection:
 				IQ:)];
 }
 
-- (bool)connection: (XMPPConnection *)connection didReceiveIQ: (XMPPIQ *)IQ
+- (bool)connection: (XMPPConnection *)connection handleIQ: (XMPPIQ *)IQ
 {
 	OFXMLElement *rosterElement;
 	OFXMLElement *element;
 	XMPPRosterItem *rosterItem;
-	OFString *origin;
+	XMPPJID *origin;
 
 	rosterElement = [IQ elementForName: @"query" namespace: XMPPRosterNS];
 
 	if (rosterElement == nil)
 		return false;
 
-	if (![IQ.type isEqual: @"set"])
-		return false;
-
 	/* Ensure the roster push has been sent by the server */
-	origin = IQ.from.fullJID;
-	if (origin != nil && ![origin isEqual: connection.JID.bareJID])
+	origin = IQ.from;
+	if (origin != nil && (origin.resource != nil ||
+	    ![origin isEqualToBareJID: connection.JID]))
 		return false;
 
 	element = [rosterElement elementForName: @"item"
@@ -152,7 +272,7 @@ OF_ASSUME_NONNULL_END
 	if (_connection.supportsRosterVersioning) {
 		OFString *ver =
 		    [rosterElement attributeForName: @"ver"].stringValue;
-		[_dataStorage setStringValue: ver forPath: @"roster.ver"];
+		[self xmpp_setStoredVersion: ver];
 		[_dataStorage save];
 	}
 
@@ -161,6 +281,91 @@ OF_ASSUME_NONNULL_END
 	return true;
 }
 
+-	 (bool)connection: (XMPPConnection *)connection
+  shouldStreamChildrenOfElement: (OFXMLElement *)element
+		       inStanza: (XMPPStanza *)stanza
+{
+	XMPPJID *from = stanza.from;
+
+	/* Only the result of our roster request, pushes are handled as IQs. */
+	if (![stanza isKindOfClass: [XMPPIQ class]] ||
+	    ![stanza.type isEqual: @"result"] ||
+	    ![stanza.ID isEqual: _rosterRequestID] ||
+	    ![element.name isEqual: @"query"])
+		return false;
+
+	/* Same check as for the response, as items are applied right away. */
+	if (from != nil && (from.resource != nil ||
+	    ![from isEqualToBareJID: connection.JID]))
+		return false;
+
+	if (connection.supportsRosterVersioning &&
+	    _initialStorageItems == nil)
+		_initialStorageItems = [[OFMutableDictionary alloc] init];
+
+	/*
+	 * The items are collected separately and only replace the roster of a
+	 * previous connection once the result is complete.
+	 */
+	[_initialRosterItems release];
+	_initialRosterItems = [[OFMutableDictionary alloc] init];
+	_streamingRoster = true;
+
+	return true;
+}
+
+-	  (void)connection: (XMPPConnection *)connection
+  didReceiveChildElement: (OFXMLElement *)child
+	       ofElement: (OFXMLElement *)element
+		inStanza: (XMPPStanza *)stanza
+{
+	if (![child.name isEqual: @"item"] ||
+	    ![child.namespace isEqual: XMPPRosterNS])
+		return;
+
+	[self xmpp_addInitialRosterItem:
+	    [self xmpp_rosterItemWithXMLElement: child]];
+}
+
+- (OFArray *)groups
+{
+	return _groupIndex.allKeys;
+}
+
+- (OFArray *)rosterItemsInGroup: (OFString *)group
+{
+	OFDictionary *members = [_groupIndex objectForKey: group];
+
+	if (members == nil)
+		return [OFArray array];
+
+	return members.allObjects;
+}
+
+- (OFArray *)rosterItemsWithNamePrefix: (OFString *)prefix
+{
+	OFMutableArray *ret = [OFMutableArray array];
+	void *pool = objc_autoreleasePoolPush();
+	OFString *foldedPrefix = prefix.lowercaseString;
+	size_t count = _nameIndex.count;
+
+	for (size_t i = nameIndexLowerBound(_nameIndex, foldedPrefix, nil);
+	    i < count; i++) {
+		XMPPRosterIndexEntry *entry = [_nameIndex objectAtIndex: i];
+
+		if (![entry->_foldedName hasPrefix: foldedPrefix])
+			break;
+
+		[ret addObject: entry->_rosterItem];
+	}
+
+	objc_autoreleasePoolPop(pool);
+
+	[ret makeImmutable];
+
+	return ret;
+}
+
 - (void)addRosterItem: (XMPPRosterItem *)rosterItem
 {
 	[self updateRosterItem: rosterItem];
@@ -226,44 +431,251 @@ OF_ASSUME_NONNULL_END
 		@throw [OFInvalidArgumentException exception];
 
 	_dataStorage = dataStorage;
+
+	[_versionPath release];
+	_versionPath = nil;
+	[_itemsPath release];
+	_itemsPath = nil;
+
+	/* Path handles are optional, fall back to string paths otherwise. */
+	if ([dataStorage respondsToSelector: @selector(pathHandleForPath:)]) {
+		_versionPath =
+		    [[dataStorage pathHandleForPath: @"roster.ver"] retain];
+		_itemsPath =
+		    [[dataStorage pathHandleForPath: @"roster.items"] retain];
+	}
+}
+
+- (OFString *)xmpp_storedVersion
+{
+	if (_versionPath != nil)
+		return [_dataStorage stringValueForPathHandle: _versionPath];
+
+	return [_dataStorage stringValueForPath: @"roster.ver"];
+}
+
+- (void)xmpp_setStoredVersion: (OFString *)version
+{
+	if (_versionPath != nil)
+		[_dataStorage setStringValue: version
+			       forPathHandle: _versionPath];
+	else
+		[_dataStorage setStringValue: version forPath: @"roster.ver"];
+}
+
+- (OFDictionary *)xmpp_storedItems
+{
+	if (_itemsPath != nil)
+		return [_dataStorage dictionaryForPathHandle: _itemsPath];
+
+	return [_dataStorage dictionaryForPath: @"roster.items"];
+}
+
+- (void)xmpp_setStoredItems: (OFDictionary *)items
+{
+	if (_itemsPath != nil)
+		[_dataStorage setDictionary: items forPathHandle: _itemsPath];
+	else
+		[_dataStorage setDictionary: items forPath: @"roster.items"];
+}
+
+- (void)xmpp_setStoredItem: (OFDictionary *)item
+		forBareJID: (OFString *)bareJID
+{
+	void *pool = objc_autoreleasePoolPush();
+
+	if (_itemsPath != nil) {
+		XMPPStoragePath *path =
+		    [_itemsPath pathByAppendingComponent: bareJID];
+
+		[_dataStorage setDictionary: item forPathHandle: path];
+	} else {
+		OFString *path =
+		    [@"roster.items." stringByAppendingString: bareJID];
+
+		[_dataStorage setDictionary: item forPath: path];
+	}
+
+	objc_autoreleasePoolPop(pool);
 }
 
 - (void)xmpp_updateRosterItem: (XMPPRosterItem *)rosterItem
 {
 	if (_connection.supportsRosterVersioning) {
-		OFMutableDictionary *items = [[[_dataStorage dictionaryForPath:
-		    @"roster.items"] mutableCopy] autorelease];
+		/* Only write the changed item instead of all items. */
+		OFDictionary *item = nil;
 
-		if (items == nil)
-			items = [OFMutableDictionary dictionary];
+		if (![rosterItem.subscription isEqual: @"remove"])
+			item = [self
+			    xmpp_storageDictionaryForRosterItem: rosterItem];
 
-		if (![rosterItem.subscription isEqual: @"remove"]) {
-			OFMutableDictionary *item = [OFMutableDictionary
-			    dictionaryWithKeysAndObjects:
-			    @"JID", rosterItem.JID.bareJID,
-			    @"subscription", rosterItem.subscription,
-			    nil];
+		[self xmpp_setStoredItem: item
+			      forBareJID: rosterItem.JID.bareJID];
+	}
 
-			if (rosterItem.name != nil)
-				[item setObject: rosterItem.name
-					 forKey: @"name"];
+	[self xmpp_applyRosterItem: rosterItem];
+}
 
-			if ([rosterItem groups] != nil)
-				[item setObject: rosterItem.groups
-					 forKey: @"groups"];
+- (void)xmpp_applyRosterItem: (XMPPRosterItem *)rosterItem
+{
+	OFString *bareJID = rosterItem.JID.bareJID;
 
-			[items setObject: item forKey: rosterItem.JID.bareJID];
-		} else
-			[items removeObjectForKey: rosterItem.JID.bareJID];
+	[self xmpp_removeIndexEntryForBareJID: bareJID];
 
-		[_dataStorage setDictionary: items forPath: @"roster.items"];
+	if (![rosterItem.subscription isEqual: @"remove"]) {
+		[_rosterItems setObject: rosterItem forKey: bareJID];
+		[self xmpp_addIndexEntryForRosterItem: rosterItem];
+	} else
+		[_rosterItems removeObjectForKey: bareJID];
+}
+
+- (void)xmpp_replaceRosterItems: (OFDictionary *)rosterItems
+{
+	[_rosterItems removeAllObjects];
+	[_indexEntries removeAllObjects];
+	[_groupIndex removeAllObjects];
+	[_nameIndex removeAllObjects];
+
+	/* Sorting once is cheaper than inserting each item in order. */
+	_nameIndexNeedsSorting = true;
+
+	for (OFString *bareJID in rosterItems) {
+		XMPPRosterItem *rosterItem =
+		    [rosterItems objectForKey: bareJID];
+
+		[_rosterItems setObject: rosterItem forKey: bareJID];
+		[self xmpp_addIndexEntryForRosterItem: rosterItem];
 	}
 
-	if (![rosterItem.subscription isEqual: @"remove"])
-		[_rosterItems setObject: rosterItem
-				 forKey: rosterItem.JID.bareJID];
+	[_nameIndex sort];
+	_nameIndexNeedsSorting = false;
+}
+
+- (void)xmpp_addIndexEntryForRosterItem: (XMPPRosterItem *)rosterItem
+{
+	XMPPRosterIndexEntry *entry =
+	    [[[XMPPRosterIndexEntry alloc] init] autorelease];
+
+	entry->_bareJID = [rosterItem.JID.bareJID copy];
+	entry->_foldedName = [foldedDisplayName(rosterItem) copy];
+	entry->_groups = [rosterItem.groups copy];
+	entry->_rosterItem = [rosterItem retain];
+
+	[_indexEntries setObject: entry forKey: entry->_bareJID];
+
+	for (OFString *group in entry->_groups) {
+		OFMutableDictionary *members =
+		    [_groupIndex objectForKey: group];
+
+		if (members == nil) {
+			members = [OFMutableDictionary dictionary];
+			[_groupIndex setObject: members forKey: group];
+		}
+
+		[members setObject: rosterItem forKey: entry->_bareJID];
+	}
+
+	if (_nameIndexNeedsSorting)
+		[_nameIndex addObject: entry];
 	else
-		[_rosterItems removeObjectForKey: rosterItem.JID.bareJID];
+		[_nameIndex insertObject: entry
+				 atIndex: nameIndexLowerBound(_nameIndex,
+					      entry->_foldedName,
+					      entry->_bareJID)];
+}
+
+- (void)xmpp_removeIndexEntryForBareJID: (OFString *)bareJID
+{
+	XMPPRosterIndexEntry *entry = [_indexEntries objectForKey: bareJID];
+	size_t idx;
+
+	if (entry == nil)
+		return;
+
+	for (OFString *group in entry->_groups) {
+		OFMutableDictionary *members =
+		    [_groupIndex objectForKey: group];
+
+		[members removeObjectForKey: bareJID];
+
+		if (members.count == 0)
+			[_groupIndex removeObjectForKey: group];
+	}
+
+	idx = nameIndexLowerBound(_nameIndex, entry->_foldedName, bareJID);
+	assert(idx < _nameIndex.count &&
+	    [_nameIndex objectAtIndex: idx] == entry);
+	[_nameIndex removeObjectAtIndex: idx];
+
+	[_indexEntries removeObjectForKey: bareJID];
+}
+
+- (void)xmpp_addInitialRosterItem: (XMPPRosterItem *)rosterItem
+{
+	OFString *bareJID = rosterItem.JID.bareJID;
+
+	if ([rosterItem.subscription isEqual: @"remove"])
+		[_initialRosterItems removeObjectForKey: bareJID];
+	else {
+		[_initialRosterItems setObject: rosterItem forKey: bareJID];
+
+		if (_initialStorageItems != nil)
+			[_initialStorageItems setObject: [self
+			    xmpp_storageDictionaryForRosterItem: rosterItem]
+						 forKey: bareJID];
+	}
+
+	[_itemsChunk addObject: rosterItem];
+	if (_itemsChunk.count >= _itemsChunkSize)
+		[self xmpp_flushItemsChunk];
+}
+
+- (void)xmpp_flushItemsChunk
+{
+	OFArray *rosterItems;
+
+	if (_itemsChunk.count == 0)
+		return;
+
+	rosterItems = [[_itemsChunk copy] autorelease];
+	[_itemsChunk removeAllObjects];
+
+	[_delegates broadcastSelector: @selector(roster:didReceiveRosterItems:)
+			   withObject: self
+			   withObject: rosterItems];
+}
+
+- (OFDictionary *)xmpp_storageDictionaryForRosterItem:
+    (XMPPRosterItem *)rosterItem
+{
+	OFMutableDictionary *item = [OFMutableDictionary
+	    dictionaryWithKeysAndObjects:
+	    @"JID", rosterItem.JID.bareJID,
+	    @"subscription", rosterItem.subscription,
+	    nil];
+
+	if (rosterItem.name != nil)
+		[item setObject: rosterItem.name forKey: @"name"];
+
+	if (rosterItem.groups != nil)
+		[item setObject: rosterItem.groups forKey: @"groups"];
+
+	[item makeImmutable];
+
+	return item;
+}
+
+- (XMPPRosterItem *)xmpp_rosterItemWithStorageDictionary:
+    (OFDictionary *)item
+{
+	XMPPRosterItem *rosterItem = [XMPPRosterItem rosterItem];
+
+	rosterItem.JID = [XMPPJID JIDWithString: [item objectForKey: @"JID"]];
+	rosterItem.name = [item objectForKey: @"name"];
+	rosterItem.subscription = [item objectForKey: @"subscription"];
+	rosterItem.groups = [item objectForKey: @"groups"];
+
+	return rosterItem;
 }
 
 - (XMPPRosterItem *)xmpp_rosterItemWithXMLElement: (OFXMLElement *)element
@@ -299,53 +711,89 @@ OF_ASSUME_NONNULL_END
 - (void)xmpp_handleInitialRosterForConnection: (XMPPConnection *)connection
 					   IQ: (XMPPIQ *)IQ
 {
-	OFXMLElement *rosterElement = [IQ elementForName: @"query"
-					       namespace: XMPPRosterNS];
-
-	if (connection.supportsRosterVersioning) {
-		if (rosterElement == nil) {
-			for (OFDictionary *item in
-			    [_dataStorage dictionaryForPath: @"roster.items"]) {
-				XMPPRosterItem *rosterItem;
-				XMPPJID *JID;
-
-				rosterItem = [XMPPRosterItem rosterItem];
-				JID = [XMPPJID JIDWithString:
-				    [item objectForKey: @"JID"]];
-				rosterItem.JID = JID;
-				rosterItem.name = [item objectForKey: @"name"];
-				rosterItem.subscription =
-				    [item objectForKey: @"subscription"];
-				rosterItem.groups =
-				    [item objectForKey: @"groups"];
-
-				[_rosterItems setObject: rosterItem
-						 forKey: JID.bareJID];
-			}
-		} else
-			[_dataStorage setDictionary: nil
-					    forPath: @"roster.items"];
+	OFXMLElement *rosterElement;
+	bool streamed = _streamingRoster;
+
+	[_rosterRequestID release];
+	_rosterRequestID = nil;
+	_streamingRoster = false;
+
+	/*
+	 * Timed out, failed or the connection was closed. The items streamed
+	 * so far are discarded, so the previous roster is kept intact.
+	 */
+	if (![IQ.type isEqual: @"result"]) {
+		[_initialRosterItems release];
+		_initialRosterItems = nil;
+		[_initialStorageItems release];
+		_initialStorageItems = nil;
+		[_itemsChunk removeAllObjects];
+		return;
 	}
 
+	/* Already done when streaming started. */
+	if (!streamed) {
+		[_initialRosterItems release];
+		_initialRosterItems = [[OFMutableDictionary alloc] init];
+	}
+
+	rosterElement = [IQ elementForName: @"query" namespace: XMPPRosterNS];
+
+	/* The roster did not change since the stored version. */
+	if (connection.supportsRosterVersioning && rosterElement == nil) {
+		for (OFDictionary *item in
+		    [[self xmpp_storedItems] objectEnumerator]) {
+			void *pool = objc_autoreleasePoolPush();
+			XMPPRosterItem *rosterItem =
+			    [self xmpp_rosterItemWithStorageDictionary: item];
+
+			[_initialRosterItems setObject: rosterItem
+						forKey: rosterItem.JID.bareJID];
+
+			objc_autoreleasePoolPop(pool);
+		}
+	}
+
+	/*
+	 * Collect the items and write them with a single store instead of
+	 * one per item. Usually, the items have already been streamed and the
+	 * query is empty.
+	 */
+	if (connection.supportsRosterVersioning && rosterElement != nil &&
+	    _initialStorageItems == nil)
+		_initialStorageItems = [[OFMutableDictionary alloc] init];
+
 	for (OFXMLElement *element in rosterElement.children) {
-		void *pool = objc_autoreleasePoolPush();
-		XMPPRosterItem *rosterItem;
+		void *pool;
 
 		if (![element.name isEqual: @"item"] ||
 		    ![element.namespace isEqual: XMPPRosterNS])
 			continue;
 
-		rosterItem = [self xmpp_rosterItemWithXMLElement: element];
+		pool = objc_autoreleasePoolPush();
 
-		[self xmpp_updateRosterItem: rosterItem];
+		[self xmpp_addInitialRosterItem:
+		    [self xmpp_rosterItemWithXMLElement: element]];
 
 		objc_autoreleasePoolPop(pool);
 	}
 
+	[self xmpp_flushItemsChunk];
+
+	[self xmpp_replaceRosterItems: _initialRosterItems];
+	[_initialRosterItems release];
+	_initialRosterItems = nil;
+
+	if (_initialStorageItems != nil) {
+		[self xmpp_setStoredItems: _initialStorageItems];
+		[_initialStorageItems release];
+		_initialStorageItems = nil;
+	}
+
 	if (connection.supportsRosterVersioning && rosterElement != nil) {
 		OFString *ver =
 		    [rosterElement attributeForName: @"ver"].stringValue;
-		[_dataStorage setStringValue: ver forPath: @"roster.ver"];
+		[self xmpp_setStoredVersion: ver];
 		[_dataStorage save];
 	}
 
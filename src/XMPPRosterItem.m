@@ -64,6 +64,45 @@
 	return new;
 }
 
+- (bool)isEqual: (id)object
+{
+	XMPPRosterItem *item;
+
+	if (object == self)
+		return true;
+
+	if (![object isKindOfClass: [XMPPRosterItem class]])
+		return false;
+
+	item = object;
+
+	// All properties may be nil
+	if ((_JID == item->_JID || [_JID isEqual: item->_JID]) &&
+	    (_name == item->_name || [_name isEqual: item->_name]) &&
+	    (_subscription == item->_subscription ||
+	    [_subscription isEqual: item->_subscription]) &&
+	    (_groups == item->_groups || [_groups isEqual: item->_groups]))
+		return true;
+
+	return false;
+}
+
+- (unsigned long)hash
+{
+	unsigned long hash;
+
+	OFHashInit(&hash);
+
+	OFHashAddHash(&hash, _JID.hash);
+	OFHashAddHash(&hash, _name.hash);
+	OFHashAddHash(&hash, _subscription.hash);
+	OFHashAddHash(&hash, _groups.hash);
+
+	OFHashFinalize(&hash);
+
+	return hash;
+}
+
 - (OFString *)description
 {
 	return [OFString stringWithFormat: @"<XMPPRosterItem, JID=%@, name=%@, "
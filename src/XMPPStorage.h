@@ -27,6 +27,7 @@ OF_ASSUME_NONNULL_BEGIN
 @class OFString;
 @class OFArray;
 @class OFDictionary;
+@class XMPPStoragePath;
 
 @protocol XMPPStorage <OFObject>
 - (void)save;
@@ -41,6 +42,28 @@ OF_ASSUME_NONNULL_BEGIN
 - (void)setDictionary: (nullable OFDictionary *)dictionary
 	      forPath: (OFString *)path;
 - (nullable OFDictionary *)dictionaryForPath: (OFString *)path;
+
+@optional
+/*
+ * Path handles are split into their components only once and should be used
+ * for paths that are accessed repeatedly. They are optional and users need to
+ * fall back to string paths if they are not implemented.
+ */
+- (XMPPStoragePath *)pathHandleForPath: (OFString *)path;
+- (void)setStringValue: (nullable OFString *)string
+	 forPathHandle: (XMPPStoragePath *)path;
+- (nullable OFString *)stringValueForPathHandle: (XMPPStoragePath *)path;
+- (void)setBooleanValue: (bool)boolean forPathHandle: (XMPPStoragePath *)path;
+- (bool)booleanValueForPathHandle: (XMPPStoragePath *)path;
+- (void)setIntegerValue: (long long)integer
+	  forPathHandle: (XMPPStoragePath *)path;
+- (long long)integerValueForPathHandle: (XMPPStoragePath *)path;
+- (void)setArray: (nullable OFArray *)array
+   forPathHandle: (XMPPStoragePath *)path;
+- (nullable OFArray *)arrayForPathHandle: (XMPPStoragePath *)path;
+- (void)setDictionary: (nullable OFDictionary *)dictionary
+	forPathHandle: (XMPPStoragePath *)path;
+- (nullable OFDictionary *)dictionaryForPathHandle: (XMPPStoragePath *)path;
 @end
 
 OF_ASSUME_NONNULL_END
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2026, Jonathan Schleifer <js@nil.im>
+ *
+ * https://nil.im/objxmpp/
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice is present in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#import <ObjFW/ObjFW.h>
+
+OF_ASSUME_NONNULL_BEGIN
+
+/*!
+ * @brief A path into an @ref XMPPStorage that has been split into its
+ *	  components once.
+ *
+ * Path handles are obtained with @ref XMPPStorage::pathHandleForPath: and
+ * can be used repeatedly without splitting the path again.
+ */
+@interface XMPPStoragePath: OFObject <OFCopying>
+{
+	OFString *_path;
+	OFArray OF_GENERIC(OFString *) *_components;
+}
+
+/*!
+ * @brief The path as a string with the components separated by dots.
+ */
+@property (readonly, nonatomic) OFString *path;
+
+/*!
+ * @brief The components of the path.
+ */
+@property (readonly, nonatomic) OFArray OF_GENERIC(OFString *) *components;
+
+/*!
+ * @brief Creates a new path handle for the specified path.
+ *
+ * @param path The path with the components separated by dots
+ * @return A new, autoreleased XMPPStoragePath
+ */
++ (instancetype)pathWithString: (OFString *)path;
+
+/*!
+ * @brief Creates a new path handle with the specified components.
+ *
+ * @param components The components of the path, which may contain dots
+ * @return A new, autoreleased XMPPStoragePath
+ */
++ (instancetype)pathWithComponents: (OFArray OF_GENERIC(OFString *) *)components;
+
+- (instancetype)init OF_UNAVAILABLE;
+
+/*!
+ * @brief Initializes an already allocated XMPPStoragePath with the specified
+ *	  path.
+ *
+ * @param path The path with the components separated by dots
+ * @return An initialized XMPPStoragePath
+ */
+- (instancetype)initWithString: (OFString *)path;
+
+/*!
+ * @brief Initializes an already allocated XMPPStoragePath with the specified
+ *	  components.
+ *
+ * @param components The components of the path, which may contain dots
+ * @return An initialized XMPPStoragePath
+ */
+- (instancetype)initWithComponents: (OFArray OF_GENERIC(OFString *) *)components
+    OF_DESIGNATED_INITIALIZER;
+
+/*!
+ * @brief Returns a new path handle with the specified component appended.
+ *
+ * @param component The component to append, which may contain dots
+ * @return A new, autoreleased XMPPStoragePath
+ */
+- (XMPPStoragePath *)pathByAppendingComponent: (OFString *)component;
+@end
+
+OF_ASSUME_NONNULL_END
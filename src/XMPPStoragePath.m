@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2026, Jonathan Schleifer <js@nil.im>
+ *
+ * https://nil.im/objxmpp/
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice is present in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#import "XMPPStoragePath.h"
+
+@implementation XMPPStoragePath
+@synthesize path = _path, components = _components;
+
++ (instancetype)pathWithString: (OFString *)path
+{
+	return [[[self alloc] initWithString: path] autorelease];
+}
+
++ (instancetype)pathWithComponents: (OFArray *)components
+{
+	return [[[self alloc] initWithComponents: components] autorelease];
+}
+
+- (instancetype)init
+{
+	OF_INVALID_INIT_METHOD
+}
+
+- (instancetype)initWithString: (OFString *)path
+{
+	void *pool = objc_autoreleasePoolPush();
+
+	self = [self initWithComponents:
+	    [path componentsSeparatedByString: @"."]];
+
+	objc_autoreleasePoolPop(pool);
+
+	return self;
+}
+
+- (instancetype)initWithComponents: (OFArray *)components
+{
+	self = [super init];
+
+	@try {
+		if (components.count == 0)
+			@throw [OFInvalidArgumentException exception];
+
+		_components = [components copy];
+		_path = [[_components componentsJoinedByString: @"."] copy];
+	} @catch (id e) {
+		[self release];
+		@throw e;
+	}
+
+	return self;
+}
+
+- (void)dealloc
+{
+	[_path release];
+	[_components release];
+
+	[super dealloc];
+}
+
+- copy
+{
+	return [self retain];
+}
+
+- (XMPPStoragePath *)pathByAppendingComponent: (OFString *)component
+{
+	void *pool = objc_autoreleasePoolPush();
+	XMPPStoragePath *path = [[XMPPStoragePath alloc] initWithComponents:
+	    [_components arrayByAddingObject: component]];
+
+	objc_autoreleasePoolPop(pool);
+
+	return [path autorelease];
+}
+
+- (bool)isEqual: (id)object
+{
+	if (object == self)
+		return true;
+
+	if (![object isKindOfClass: [XMPPStoragePath class]])
+		return false;
+
+	return [_components isEqual: ((XMPPStoragePath *)object)->_components];
+}
+
+- (unsigned long)hash
+{
+	return _components.hash;
+}
+
+- (OFString *)description
+{
+	return _path;
+}
+@end
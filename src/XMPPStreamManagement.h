@@ -25,14 +25,150 @@
 
 OF_ASSUME_NONNULL_BEGIN
 
+#define XMPPStreamManagementAckRequestStanzaInterval 10
+#define XMPPStreamManagementAckRequestTimeInterval 30
+#define XMPPStreamManagementAckRequestIdleDelay 1
+
+@class XMPPMulticastDelegate;
+@class XMPPStreamManagement;
+
+/*!
+ * @brief A protocol that should be (partially) implemented by delegates
+ *	  of a XMPPStreamManagement
+ */
+@protocol XMPPStreamManagementDelegate
+@optional
+/*!
+ * @brief This callback is called when the server acknowledged the receipt of
+ *	  messages.
+ *
+ * Only messages with an ID are reported.
+ *
+ * @param streamManagement The stream management that received the
+ *			   acknowledgement
+ * @param IDs The IDs of the messages that were acknowledged, in the order they
+ *	      were sent
+ */
+-              (void)streamManagement: (XMPPStreamManagement *)streamManagement
+  didConfirmDeliveryOfMessagesWithIDs: (OFArray OF_GENERIC(OFString *) *)IDs;
+
+/*!
+ * @brief This callback is called when stanzas the server did not acknowledge
+ *	  are given up on.
+ *
+ * This happens when the stream can not be resumed or the connection was
+ * closed without allowing resumption. The stanzas might not have been
+ * delivered and are not sent again automatically.
+ *
+ * @param streamManagement The stream management that gave up on the stanzas
+ * @param stanzas The stanzas that were not acknowledged, in the order they
+ *		  were sent
+ */
+-  (void)streamManagement: (XMPPStreamManagement *)streamManagement
+  didFailToDeliverStanzas: (OFArray OF_GENERIC(OFXMLElement *) *)stanzas;
+@end
+
+/*!
+ * @brief A class implementing Stream Management (XEP-0198).
+ *
+ * Outgoing stanzas are kept until the server acknowledged them. To not send
+ * one acknowledgement request per stanza, requests are sent according to
+ * @ref ackRequestStanzaInterval, @ref ackRequestTimeInterval and
+ * @ref ackRequestIdleDelay, whichever triggers first.
+ *
+ * If the server allows it, the stream is resumed when the connection is
+ * reconnected, instead of binding a new resource. Stanzas the server did not
+ * acknowledge before the connection was lost are then sent again. If the
+ * stream can not be resumed, they are reported to the delegates instead.
+ */
 @interface XMPPStreamManagement: OFObject <XMPPConnectionDelegate>
 {
 	XMPPConnection *_connection;
-	uint32_t _receivedCount;
+	XMPPMulticastDelegate *_delegates;
+	uint32_t _receivedCount, _acknowledgedCount;
+	bool _enabled, _requestsResumption, _resuming;
+	OFString *_Nullable _resumptionID, *_Nullable _resumptionLocation;
+	XMPPJID *_Nullable _JID;
+	OFXMLElement *_Nonnull *_Nullable _unacknowledgedStanzas;
+	size_t _unacknowledgedStanzasCapacity, _unacknowledgedStanzasStart;
+	size_t _unacknowledgedStanzasCount;
+	unsigned int _ackRequestStanzaInterval, _stanzasSinceAckRequest;
+	OFTimeInterval _ackRequestTimeInterval, _ackRequestIdleDelay;
+	OFTimer *_Nullable _ackRequestTimer, *_Nullable _ackRequestIdleTimer;
 }
 
+/*!
+ * @brief The number of stanzas after which an acknowledgement is requested,
+ *	  or 0 to not request acknowledgements based on the number of stanzas.
+ *
+ * Defaults to `XMPPStreamManagementAckRequestStanzaInterval`.
+ */
+@property (nonatomic) unsigned int ackRequestStanzaInterval;
+
+/*!
+ * @brief The maximum time a stanza stays unacknowledged before an
+ *	  acknowledgement is requested, or 0 for no maximum.
+ *
+ * Defaults to `XMPPStreamManagementAckRequestTimeInterval`.
+ */
+@property (nonatomic) OFTimeInterval ackRequestTimeInterval;
+
+/*!
+ * @brief The time without sending a stanza after which an acknowledgement is
+ *	  requested for the stanzas sent before, or 0 to not request
+ *	  acknowledgements when idle.
+ *
+ * Defaults to `XMPPStreamManagementAckRequestIdleDelay`.
+ */
+@property (nonatomic) OFTimeInterval ackRequestIdleDelay;
+
+/*!
+ * @brief Whether the server should allow resuming the stream.
+ *
+ * Defaults to true.
+ */
+@property (nonatomic) bool requestsResumption;
+
+/*!
+ * @brief The ID of the stream that can be resumed, or `nil` if there is none.
+ */
+@property OF_NULLABLE_PROPERTY (readonly, nonatomic) OFString *resumptionID;
+
+/*!
+ * @brief The location the server prefers to be used for resuming the stream,
+ *	  or `nil` if it has no preference.
+ *
+ * This can be used as the server of the connection before reconnecting.
+ */
+@property OF_NULLABLE_PROPERTY (readonly, nonatomic)
+    OFString *resumptionLocation;
+
+/*!
+ * @brief The number of sent stanzas that were not acknowledged yet.
+ */
+@property (readonly, nonatomic) size_t numberOfUnacknowledgedStanzas;
+
 - (instancetype)init OF_UNAVAILABLE;
 - (instancetype)initWithConnection: (XMPPConnection *)connection;
+
+/*!
+ * @brief Requests an acknowledgement for all stanzas sent so far.
+ */
+- (void)requestAcknowledgement;
+
+/*!
+ * @brief Adds the specified delegate.
+ *
+ * @param delegate The delegate to add
+ */
+- (void)addDelegate: (id <XMPPStreamManagementDelegate>)delegate;
+
+/*!
+ * @brief Removes the specified delegate.
+ *
+ * @param delegate The delegate to remove
+ */
+- (void)removeDelegate: (id <XMPPStreamManagementDelegate>)delegate;
 @end
 
 OF_ASSUME_NONNULL_END
@@ -21,12 +21,53 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "config.h"
+
 #include <inttypes.h>
 
 #import "XMPPStreamManagement.h"
+#import "XMPPConnection+Private.h"
+#import "XMPPJID.h"
+#import "XMPPMulticastDelegate.h"
 #import "namespaces.h"
 
+static bool
+isStanza(OFXMLElement *element)
+{
+	OFString *name;
+
+	if (![element.namespace isEqual: XMPPClientNS])
+		return false;
+
+	name = element.name;
+
+	return ([name isEqual: @"iq"] || [name isEqual: @"presence"] ||
+	    [name isEqual: @"message"]);
+}
+
+@interface XMPPStreamManagement ()
+- (void)xmpp_addUnacknowledgedStanza: (OFXMLElement *)stanza;
+- (void)xmpp_handleAcknowledgement: (OFXMLElement *)element;
+- (void)xmpp_handleResumed: (OFXMLElement *)element;
+- (void)xmpp_acknowledgeStanzas: (OFString *)h;
+- (OFArray *)xmpp_takeUnacknowledgedStanzas;
+- (void)xmpp_failUnacknowledgedStanzas;
+- (void)xmpp_removeUnacknowledgedStanzas: (size_t)count
+				     IDs: (nullable OFMutableArray *)IDs;
+- (void)xmpp_invalidateAckRequestTimers;
+- (void)xmpp_suspend;
+- (void)xmpp_reset;
+@end
+
 @implementation XMPPStreamManagement
+@synthesize ackRequestStanzaInterval = _ackRequestStanzaInterval;
+@synthesize ackRequestTimeInterval = _ackRequestTimeInterval;
+@synthesize ackRequestIdleDelay = _ackRequestIdleDelay;
+@synthesize numberOfUnacknowledgedStanzas = _unacknowledgedStanzasCount;
+@synthesize requestsResumption = _requestsResumption;
+@synthesize resumptionID = _resumptionID;
+@synthesize resumptionLocation = _resumptionLocation;
+
 - (instancetype)init
 {
 	OF_INVALID_INIT_METHOD
@@ -39,6 +80,13 @@
 	@try {
 		_connection = connection;
 		[_connection addDelegate: self];
+		_delegates = [[XMPPMulticastDelegate alloc] init];
+		_ackRequestStanzaInterval =
+		    XMPPStreamManagementAckRequestStanzaInterval;
+		_ackRequestTimeInterval =
+		    XMPPStreamManagementAckRequestTimeInterval;
+		_ackRequestIdleDelay = XMPPStreamManagementAckRequestIdleDelay;
+		_requestsResumption = true;
 	} @catch (id e) {
 		[self release];
 		@throw e;
@@ -50,10 +98,28 @@
 - (void)dealloc
 {
 	[_connection removeDelegate: self];
+	[self xmpp_invalidateAckRequestTimers];
+	[self xmpp_removeUnacknowledgedStanzas: _unacknowledgedStanzasCount
+					   IDs: nil];
+	OFFreeMemory(_unacknowledgedStanzas);
+	[_delegates release];
+	[_resumptionID release];
+	[_resumptionLocation release];
+	[_JID release];
 
 	[super dealloc];
 }
 
+- (void)addDelegate: (id <XMPPStreamManagementDelegate>)delegate
+{
+	[_delegates addDelegate: delegate];
+}
+
+- (void)removeDelegate: (id <XMPPStreamManagementDelegate>)delegate
+{
+	[_delegates removeDelegate: delegate];
+}
+
 - (void)connection: (XMPPConnection *)connection
  didReceiveElement: (OFXMLElement *)element
 {
@@ -62,12 +128,44 @@
 
 	if ([elementNS isEqual: XMPPSMNS]) {
 		if ([elementName isEqual: @"enabled"]) {
+			OFString *resume =
+			    [element attributeForName: @"resume"].stringValue;
+
 			_receivedCount = 0;
+
+			if ([resume isEqual: @"true"] ||
+			    [resume isEqual: @"1"]) {
+				_resumptionID = [[element
+				    attributeForName: @"id"].stringValue copy];
+				_resumptionLocation = [[element
+				    attributeForName: @"location"].stringValue
+				    copy];
+			}
+
+			return;
+		}
+
+		if ([elementName isEqual: @"resumed"]) {
+			[self xmpp_handleResumed: element];
 			return;
 		}
 
 		if ([elementName isEqual: @"failed"]) {
-			/* TODO: How do we handle this? */
+			bool resuming = _resuming;
+
+			if (resuming) {
+				/* The server may say what it received. */
+				[self xmpp_acknowledgeStanzas: [element
+				    attributeForName: @"h"].stringValue];
+				[self xmpp_failUnacknowledgedStanzas];
+			}
+
+			[self xmpp_reset];
+
+			/* The stream can't be resumed, so bind normally. */
+			if (resuming)
+				[connection xmpp_sendResourceBind];
+
 			return;
 		}
 
@@ -81,27 +179,319 @@
 				      stringValue: stringValue];
 			[connection sendStanza: ack];
 		}
+
+		if ([elementName isEqual: @"a"]) {
+			[self xmpp_handleAcknowledgement: element];
+			return;
+		}
 	}
 
-	if ([elementNS isEqual: XMPPClientNS] &&
-	    ([elementName isEqual: @"iq"] ||
-	     [elementName isEqual: @"presence"] ||
-	     [elementName isEqual: @"message"]))
+	if (isStanza(element))
 		_receivedCount++;
 }
 
-/* TODO: Count outgoing stanzas here and cache them, send own ACK requests
 - (void)connection: (XMPPConnection *)connection
     didSendElement: (OFXMLElement *)element
 {
+	if (!_enabled || !isStanza(element))
+		return;
+
+	[self xmpp_addUnacknowledgedStanza: element];
+
+	if (_ackRequestStanzaInterval > 0 &&
+	    ++_stanzasSinceAckRequest >= _ackRequestStanzaInterval) {
+		[self requestAcknowledgement];
+		return;
+	}
+
+	if (_ackRequestTimeInterval > 0 && _ackRequestTimer == nil)
+		_ackRequestTimer = [[OFTimer
+		    scheduledTimerWithTimeInterval: _ackRequestTimeInterval
+					    target: self
+					  selector: @selector(
+							requestAcknowledgement)
+					   repeats: false] retain];
+
+	if (_ackRequestIdleDelay > 0) {
+		if (_ackRequestIdleTimer == nil)
+			_ackRequestIdleTimer = [[OFTimer
+			    scheduledTimerWithTimeInterval: _ackRequestIdleDelay
+						    target: self
+						  selector: @selector(
+							requestAcknowledgement)
+						   repeats: false] retain];
+		else
+			_ackRequestIdleTimer.fireDate = [OFDate
+			    dateWithTimeIntervalSinceNow: _ackRequestIdleDelay];
+	}
 }
-*/
 
 - (void)connection: (XMPPConnection *)connection wasBoundToJID: (XMPPJID *)JID
 {
-	if (connection.supportsStreamManagement)
-		[connection sendStanza:
-		    [OFXMLElement elementWithName: @"enable"
-					namespace: XMPPSMNS]];
+	if (connection.supportsStreamManagement) {
+		OFXMLElement *enable = [OFXMLElement
+		    elementWithName: @"enable"
+			  namespace: XMPPSMNS];
+
+		if (_requestsResumption)
+			[enable addAttributeWithName: @"resume"
+					 stringValue: @"true"];
+
+		/* Stanzas are counted from the point <enable/> is sent. */
+		[self xmpp_reset];
+		_enabled = true;
+		_JID = [JID copy];
+
+		[connection sendStanza: enable];
+	}
+}
+
+- (bool)connectionWillBindResource: (XMPPConnection *)connection
+{
+	OFXMLElement *resume;
+
+	if (_resumptionID == nil || !connection.supportsStreamManagement)
+		return false;
+
+	[self xmpp_suspend];
+	_resuming = true;
+
+	resume = [OFXMLElement elementWithName: @"resume" namespace: XMPPSMNS];
+	[resume addAttributeWithName: @"h"
+			 stringValue: [OFString stringWithFormat:
+					  @"%" PRIu32, _receivedCount]];
+	[resume addAttributeWithName: @"previd" stringValue: _resumptionID];
+
+	[connection sendStanza: resume];
+
+	return true;
+}
+
+- (void)connectionWasClosed: (XMPPConnection *)connection
+		      error: (OFXMLElement *)error
+{
+	/* Keep the state so the stream can be resumed after reconnecting. */
+	if (_resumptionID != nil)
+		[self xmpp_suspend];
+	else {
+		[self xmpp_failUnacknowledgedStanzas];
+		[self xmpp_reset];
+	}
+}
+
+-  (void)connection: (XMPPConnection *)connection
+  didThrowException: (id)exception
+{
+	/* The connection is closed after throwing. */
+	if (_resumptionID != nil)
+		[self xmpp_suspend];
+	else {
+		[self xmpp_failUnacknowledgedStanzas];
+		[self xmpp_reset];
+	}
+}
+
+- (void)requestAcknowledgement
+{
+	[self xmpp_invalidateAckRequestTimers];
+
+	if (!_enabled)
+		return;
+
+	_stanzasSinceAckRequest = 0;
+
+	[_connection sendStanza: [OFXMLElement elementWithName: @"r"
+						     namespace: XMPPSMNS]];
+}
+
+- (void)xmpp_addUnacknowledgedStanza: (OFXMLElement *)stanza
+{
+	if (_unacknowledgedStanzasCount == _unacknowledgedStanzasCapacity) {
+		/* The capacity is kept a power of 2 to allow masking. */
+		size_t capacity = (_unacknowledgedStanzasCapacity > 0
+		    ? _unacknowledgedStanzasCapacity * 2 : 16);
+		size_t mask = _unacknowledgedStanzasCapacity - 1;
+		OFXMLElement **stanzas =
+		    OFAllocMemory(capacity, sizeof(*stanzas));
+
+		for (size_t i = 0; i < _unacknowledgedStanzasCount; i++)
+			stanzas[i] = _unacknowledgedStanzas[
+			    (_unacknowledgedStanzasStart + i) & mask];
+
+		OFFreeMemory(_unacknowledgedStanzas);
+		_unacknowledgedStanzas = stanzas;
+		_unacknowledgedStanzasCapacity = capacity;
+		_unacknowledgedStanzasStart = 0;
+	}
+
+	/*
+	 * Copied, as the sender might still modify the stanza, which must not
+	 * change what is sent again when the stream is resumed.
+	 */
+	_unacknowledgedStanzas[(_unacknowledgedStanzasStart +
+	    _unacknowledgedStanzasCount) &
+	    (_unacknowledgedStanzasCapacity - 1)] = [stanza copy];
+	_unacknowledgedStanzasCount++;
+}
+
+- (void)xmpp_handleAcknowledgement: (OFXMLElement *)element
+{
+	if (_enabled)
+		[self xmpp_acknowledgeStanzas:
+		    [element attributeForName: @"h"].stringValue];
+}
+
+- (void)xmpp_handleResumed: (OFXMLElement *)element
+{
+	OFArray *stanzas;
+
+	if (!_resuming)
+		return;
+
+	_resuming = false;
+
+	[self xmpp_acknowledgeStanzas:
+	    [element attributeForName: @"h"].stringValue];
+
+	/* The server did not receive these, so they need to be resent. */
+	stanzas = [self xmpp_takeUnacknowledgedStanzas];
+
+	_enabled = true;
+
+	[_connection xmpp_didResumeWithJID: _JID];
+
+	for (OFXMLElement *stanza in stanzas)
+		[_connection sendStanza: stanza];
+}
+
+- (void)xmpp_acknowledgeStanzas: (OFString *)stringValue
+{
+	OFMutableArray *IDs;
+	unsigned long long h;
+	uint32_t count;
+
+	if (stringValue == nil)
+		return;
+
+	h = stringValue.unsignedLongLongValue;
+	if (h > UINT32_MAX)
+		return;
+
+	/* h wraps around after 2^32 stanzas. */
+	count = (uint32_t)h - _acknowledgedCount;
+
+	/* The server acknowledged more than was sent. */
+	if (count > _unacknowledgedStanzasCount)
+		count = (uint32_t)_unacknowledgedStanzasCount;
+
+	if (count == 0)
+		return;
+
+	IDs = [OFMutableArray array];
+	[self xmpp_removeUnacknowledgedStanzas: count IDs: IDs];
+	_acknowledgedCount += count;
+
+	if (IDs.count > 0)
+		[_delegates
+		    broadcastSelector: @selector(streamManagement:
+				       didConfirmDeliveryOfMessagesWithIDs:)
+			   withObject: self
+			   withObject: IDs];
+}
+
+- (OFArray *)xmpp_takeUnacknowledgedStanzas
+{
+	OFMutableArray *stanzas = [OFMutableArray
+	    arrayWithCapacity: _unacknowledgedStanzasCount];
+	size_t mask = _unacknowledgedStanzasCapacity - 1;
+
+	for (size_t i = 0; i < _unacknowledgedStanzasCount; i++)
+		[stanzas addObject: _unacknowledgedStanzas[
+		    (_unacknowledgedStanzasStart + i) & mask]];
+
+	[self xmpp_removeUnacknowledgedStanzas: _unacknowledgedStanzasCount
+					   IDs: nil];
+
+	[stanzas makeImmutable];
+
+	return stanzas;
+}
+
+- (void)xmpp_failUnacknowledgedStanzas
+{
+	OFArray *stanzas;
+
+	if (_unacknowledgedStanzasCount == 0)
+		return;
+
+	stanzas = [self xmpp_takeUnacknowledgedStanzas];
+
+	[_delegates broadcastSelector: @selector(streamManagement:
+					   didFailToDeliverStanzas:)
+			   withObject: self
+			   withObject: stanzas];
+}
+
+- (void)xmpp_removeUnacknowledgedStanzas: (size_t)count
+				     IDs: (OFMutableArray *)IDs
+{
+	size_t mask = _unacknowledgedStanzasCapacity - 1;
+
+	for (size_t i = 0; i < count; i++) {
+		OFXMLElement *stanza = _unacknowledgedStanzas[
+		    (_unacknowledgedStanzasStart + i) & mask];
+
+		if (IDs != nil && [stanza.name isEqual: @"message"]) {
+			OFString *ID =
+			    [stanza attributeForName: @"id"].stringValue;
+
+			if (ID != nil)
+				[IDs addObject: ID];
+		}
+
+		[stanza release];
+	}
+
+	if (count > 0) {
+		_unacknowledgedStanzasStart =
+		    (_unacknowledgedStanzasStart + count) & mask;
+		_unacknowledgedStanzasCount -= count;
+	}
+}
+
+- (void)xmpp_invalidateAckRequestTimers
+{
+	[_ackRequestTimer invalidate];
+	[_ackRequestTimer release];
+	_ackRequestTimer = nil;
+
+	[_ackRequestIdleTimer invalidate];
+	[_ackRequestIdleTimer release];
+	_ackRequestIdleTimer = nil;
+}
+
+/* Stops counting, but keeps everything needed to resume the stream. */
+- (void)xmpp_suspend
+{
+	[self xmpp_invalidateAckRequestTimers];
+
+	_enabled = _resuming = false;
+	_stanzasSinceAckRequest = 0;
+}
+
+- (void)xmpp_reset
+{
+	[self xmpp_suspend];
+	[self xmpp_removeUnacknowledgedStanzas: _unacknowledgedStanzasCount
+					   IDs: nil];
+
+	_acknowledgedCount = 0;
+
+	[_resumptionID release];
+	_resumptionID = nil;
+	[_resumptionLocation release];
+	_resumptionLocation = nil;
+	[_JID release];
+	_JID = nil;
 }
 @end
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2026, Jonathan Schleifer <js@nil.im>
+ *
+ * https://nil.im/objxmpp/
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice is present in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#import <ObjFW/ObjFW.h>
+
+OF_ASSUME_NONNULL_BEGIN
+
+/*!
+ * @brief The stringprep profiles used by XMPP.
+ */
+typedef enum {
+	/*! Nodeprep, for the node part of a JID */
+	XMPPStringPrepProfileNodeprep,
+	/*! Nameprep, for the domain part of a JID */
+	XMPPStringPrepProfileNameprep,
+	/*! Resourceprep, for the resource part of a JID */
+	XMPPStringPrepProfileResourceprep,
+	/*! SASLprep, for user names and passwords */
+	XMPPStringPrepProfileSASLprep
+} XMPPStringPrepProfile;
+
+/*!
+ * @brief Checks whether the specified string is already in its prepared form
+ *	  for the specified profile without calling into libidn.
+ *
+ * This only accepts ASCII strings for which the profile is known to be the
+ * identity. Returning false does not mean the profile fails, only that the
+ * string needs to go through libidn.
+ *
+ * @param string The string to check
+ * @param profile The stringprep profile to check against
+ * @return Whether the string is known to be prepared
+ */
+extern bool XMPPStringIsPrepared(OFString *string,
+    XMPPStringPrepProfile profile);
+
+/*!
+ * @brief Applies the specified stringprep profile to the specified string.
+ *
+ * Strings for which @ref XMPPStringIsPrepared returns true are returned as
+ * is, all others are passed to libidn.
+ *
+ * @param string The string to prepare
+ * @param profile The stringprep profile to apply
+ * @return The prepared string or nil if the profile does not apply
+ */
+extern OFString *_Nullable XMPPStringPrep(OFString *string,
+    XMPPStringPrepProfile profile);
+
+/*!
+ * @brief Checks whether IDNA ToASCII is known to return the specified domain
+ *	  unchanged without calling into libidn.
+ *
+ * @param domain The domain to check
+ * @return Whether the domain is known to already be in ASCII form
+ */
+extern bool XMPPDomainIsASCII(OFString *domain);
+
+/*!
+ * @brief Applies IDNA ToASCII with the STD3 ASCII rules to the specified
+ *	  domain.
+ *
+ * @param domain The domain to convert
+ * @return The converted domain or nil if the conversion failed
+ */
+extern OFString *_Nullable XMPPIDNAToASCII(OFString *domain);
+
+OF_ASSUME_NONNULL_END
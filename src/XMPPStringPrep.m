@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2026, Jonathan Schleifer <js@nil.im>
+ *
+ * https://nil.im/objxmpp/
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice is present in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <stringprep.h>
+#include <idna.h>
+
+#import "XMPPStringPrep.h"
+
+/*
+ * For ASCII input, all profiles are the identity except for case folding and
+ * the prohibited code points, as no ASCII code point is mapped to nothing,
+ * changed by NFKC or unassigned, and bidi checks only affect RandALCat code
+ * points. Each profile gets a bitmask per ASCII character that is set if the
+ * character is passed through unchanged.
+ *
+ * Nodeprep:	  Folds A-Z, prohibits ASCII controls (C.2.1), space (C.1.1)
+ *		  and "&'/:<>@.
+ * Nameprep:	  Folds A-Z. ASCII controls and space are not prohibited.
+ * Resourceprep:  Prohibits ASCII controls (C.2.1).
+ * SASLprep:	  Prohibits ASCII controls (C.2.1).
+ *
+ * NUL is rejected for all profiles, as libidn only sees the string up to the
+ * first NUL.
+ */
+static uint8_t identityTable[128];
+
+static void
+initIdentityTable(void)
+{
+	for (uint8_t c = 1; c < 128; c++) {
+		bool control = (c < 0x20 || c == 0x7F);
+		bool upper = (c >= 'A' && c <= 'Z');
+		uint8_t mask = 0;
+
+		if (!control && !upper && c != ' ' &&
+		    strchr("\"&'/:<>@", c) == NULL)
+			mask |= 1 << XMPPStringPrepProfileNodeprep;
+		if (!upper)
+			mask |= 1 << XMPPStringPrepProfileNameprep;
+		if (!control) {
+			mask |= 1 << XMPPStringPrepProfileResourceprep;
+			mask |= 1 << XMPPStringPrepProfileSASLprep;
+		}
+
+		identityTable[c] = mask;
+	}
+}
+
+static const char *
+profileName(XMPPStringPrepProfile profile)
+{
+	switch (profile) {
+	case XMPPStringPrepProfileNodeprep:
+		return "Nodeprep";
+	case XMPPStringPrepProfileNameprep:
+		return "Nameprep";
+	case XMPPStringPrepProfileResourceprep:
+		return "Resourceprep";
+	case XMPPStringPrepProfileSASLprep:
+		return "SASLprep";
+	default:
+		@throw [OFInvalidArgumentException exception];
+	}
+}
+
+bool
+XMPPStringIsPrepared(OFString *string, XMPPStringPrepProfile profile)
+{
+	static OFOnceControl onceControl = OFOnceControlInitValue;
+	const unsigned char *UTF8String =
+	    (const unsigned char *)string.UTF8String;
+	size_t length = string.UTF8StringLength;
+	uint8_t acc = 1 << profile;
+	unsigned char high = 0;
+
+	OFOnce(&onceControl, initIdentityTable);
+
+	/*
+	 * Accumulate instead of branching on each byte so that the compiler can
+	 * vectorize the loop.
+	 */
+	for (size_t i = 0; i < length; i++) {
+		acc &= identityTable[UTF8String[i] & 0x7F];
+		high |= UTF8String[i];
+	}
+
+	return (acc != 0 && !(high & 0x80));
+}
+
+OFString *
+XMPPStringPrep(OFString *string, XMPPStringPrepProfile profile)
+{
+	char *prepared;
+	const char *name = profileName(profile);
+
+	if (XMPPStringIsPrepared(string, profile))
+		return [[string copy] autorelease];
+
+	if (stringprep_profile(string.UTF8String, &prepared, name, 0) !=
+	    STRINGPREP_OK)
+		return nil;
+
+	@try {
+		return [OFString stringWithUTF8StringNoCopy: prepared
+					       freeWhenDone: true];
+	} @catch (id e) {
+		free(prepared);
+		@throw e;
+	}
+}
+
+bool
+XMPPDomainIsASCII(OFString *domain)
+{
+	const char *UTF8String = domain.UTF8String;
+	size_t length = domain.UTF8StringLength;
+	size_t labelLength = 0;
+	char previous = '.';
+
+	/*
+	 * ToASCII skips Nameprep for labels that are all ASCII. With the STD3
+	 * rules, such labels are returned unchanged if they only consist of
+	 * letters, digits and hyphens, do not start or end with a hyphen and
+	 * are 1 to 63 characters long. Empty labels, including a trailing dot,
+	 * are left to libidn.
+	 */
+	if (length == 0)
+		return false;
+
+	for (size_t i = 0; i < length; i++) {
+		char c = UTF8String[i];
+
+		if (c == '.') {
+			if (previous == '.' || previous == '-')
+				return false;
+
+			labelLength = 0;
+		} else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+		    (c >= '0' && c <= '9') || c == '-') {
+			if (c == '-' && previous == '.')
+				return false;
+
+			if (++labelLength > 63)
+				return false;
+		} else
+			return false;
+
+		previous = c;
+	}
+
+	return (previous != '.' && previous != '-');
+}
+
+OFString *
+XMPPIDNAToASCII(OFString *domain)
+{
+	char *ASCIIDomain;
+
+	if (XMPPDomainIsASCII(domain))
+		return [[domain copy] autorelease];
+
+	if (idna_to_ascii_8z(domain.UTF8String, &ASCIIDomain,
+	    IDNA_USE_STD3_ASCII_RULES) != IDNA_SUCCESS)
+		return nil;
+
+	@try {
+		return [OFString stringWithUTF8StringNoCopy: ASCIIDomain
+					       freeWhenDone: true];
+	} @catch (id e) {
+		free(ASCIIDomain);
+		@throw e;
+	}
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2026, Jonathan Schleifer <js@nil.im>
+ *
+ * https://nil.im/objxmpp/
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice is present in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#import <ObjFW/OFObject.h>
+
+OF_ASSUME_NONNULL_BEGIN
+
+@class OFData;
+@class OFString;
+
+/*!
+ * @brief A file that is written without buffering and can be synced to disk.
+ *
+ * This is used by the storages and keeps the platform specific calls that
+ * are needed to make writes durable in one place.
+ */
+@interface XMPPSyncedFile: OFObject
+{
+	OFString *_path;
+	int _fd;
+}
+
+/*!
+ * @brief Atomically replaces the specified file with the specified data.
+ *
+ * The data is written to a temporary file next to it, which is synced and
+ * then renamed into place, so that the file is never left half written.
+ *
+ * @param path The path of the file to replace
+ * @param data The new contents of the file
+ * @throw OFOpenItemFailedException The temporary file could not be created
+ * @throw OFWriteFailedException The data could not be written or the file
+ *				 could not be replaced
+ */
++ (void)replaceFileAtPath: (OFString *)path withData: (OFData *)data;
+
+/*!
+ * @brief Syncs the directory containing the specified file, so that a file
+ *	  that was created or renamed survives a crash.
+ *
+ * This is best effort, as not all systems allow syncing directories.
+ *
+ * @param path The path of the file whose directory should be synced
+ */
++ (void)synchronizeDirectoryOfFileAtPath: (OFString *)path;
+
+/*!
+ * @brief Opens the specified file for writing, creating it if it does not
+ *	  exist.
+ *
+ * @param path The path of the file
+ * @param append Whether to append to the file instead of truncating it
+ * @return An opened file
+ * @throw OFOpenItemFailedException The file could not be opened
+ */
++ (instancetype)fileWithPath: (OFString *)path append: (bool)append;
+
+- (instancetype)init OF_UNAVAILABLE;
+
+/*!
+ * @brief Opens the specified file for writing, creating it if it does not
+ *	  exist.
+ *
+ * @param path The path of the file
+ * @param append Whether to append to the file instead of truncating it
+ * @return An initialized file
+ * @throw OFOpenItemFailedException The file could not be opened
+ */
+- (instancetype)initWithPath: (OFString *)path
+		      append: (bool)append OF_DESIGNATED_INITIALIZER;
+
+/*!
+ * @brief Writes the whole buffer to the file.
+ *
+ * @param buffer The buffer to write
+ * @param length The length of the buffer
+ * @throw OFWriteFailedException Not all of the buffer could be written
+ */
+- (void)writeBuffer: (const void *)buffer length: (size_t)length;
+
+/*!
+ * @brief Waits until everything written to the file has reached the disk.
+ *
+ * @throw OFWriteFailedException The file could not be synced
+ */
+- (void)synchronize;
+
+/*!
+ * @brief Truncates the file to the specified length.
+ *
+ * @param length The new length of the file
+ * @return Whether the file could be truncated
+ */
+- (bool)truncateToLength: (unsigned long long)length;
+
+/*!
+ * @brief Closes the file.
+ *
+ * This is done automatically when the file is deallocated.
+ */
+- (void)close;
+@end
+
+OF_ASSUME_NONNULL_END
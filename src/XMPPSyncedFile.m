@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2026, Jonathan Schleifer <js@nil.im>
+ *
+ * https://nil.im/objxmpp/
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice is present in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+
+#import <ObjFW/OFString.h>
+#import <ObjFW/OFData.h>
+#import <ObjFW/OFLocale.h>
+
+#ifdef OF_WINDOWS
+# include <io.h>
+# include <sys/stat.h>
+# include <windows.h>
+#else
+# include <unistd.h>
+#endif
+
+#import <ObjFW/OFInvalidArgumentException.h>
+#import <ObjFW/OFOpenItemFailedException.h>
+#import <ObjFW/OFWriteFailedException.h>
+
+#import "XMPPSyncedFile.h"
+
+#ifndef OF_WINDOWS
+static const char *
+nativePath(OFString *path)
+{
+	return [path cStringWithEncoding: [OFLocale encoding]];
+}
+#endif
+
+/* Removes a temporary file, ignoring errors as it is only cleanup. */
+static void
+removeFile(OFString *path)
+{
+#ifdef OF_WINDOWS
+	_wunlink((const wchar_t *)path.UTF16String);
+#else
+	unlink(nativePath(path));
+#endif
+}
+
+@implementation XMPPSyncedFile
++ (void)replaceFileAtPath: (OFString *)path withData: (OFData *)data
+{
+	void *pool = objc_autoreleasePoolPush();
+	OFString *temporaryPath = [path stringByAppendingString: @".tmp"];
+	XMPPSyncedFile *file = [self fileWithPath: temporaryPath append: false];
+	size_t length = data.count * data.itemSize;
+	int errNo = 0;
+
+	@try {
+		[file writeBuffer: data.items length: length];
+		[file synchronize];
+	} @catch (id e) {
+		[file close];
+		removeFile(temporaryPath);
+		@throw e;
+	}
+
+	[file close];
+
+#ifdef OF_WINDOWS
+	if (!MoveFileExW((const wchar_t *)temporaryPath.UTF16String,
+	    (const wchar_t *)path.UTF16String,
+	    MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+		errNo = EIO;
+#else
+	if (rename(nativePath(temporaryPath), nativePath(path)) != 0)
+		errNo = errno;
+#endif
+
+	if (errNo != 0) {
+		removeFile(temporaryPath);
+		@throw [OFWriteFailedException exceptionWithObject: path
+						   requestedLength: length
+						      bytesWritten: 0
+							     errNo: errNo];
+	}
+
+	[self synchronizeDirectoryOfFileAtPath: path];
+
+	objc_autoreleasePoolPop(pool);
+}
+
++ (void)synchronizeDirectoryOfFileAtPath: (OFString *)path
+{
+#ifndef OF_WINDOWS
+	/* Windows has no way to sync a directory and does not need it. */
+	void *pool = objc_autoreleasePoolPush();
+	OFString *directory = path.stringByDeletingLastPathComponent;
+	int fd;
+
+	if (directory.length == 0)
+		directory = @".";
+
+	/* Best effort, not all systems allow opening directories. */
+	if ((fd = open(nativePath(directory), O_RDONLY)) != -1) {
+		fsync(fd);
+		close(fd);
+	}
+
+	objc_autoreleasePoolPop(pool);
+#endif
+}
+
++ (instancetype)fileWithPath: (OFString *)path append: (bool)append
+{
+	return [[[self alloc] initWithPath: path append: append] autorelease];
+}
+
+- (instancetype)init
+{
+	OF_INVALID_INIT_METHOD
+}
+
+- (instancetype)initWithPath: (OFString *)path append: (bool)append
+{
+	self = [super init];
+
+	/* So that a failed open doesn't close a descriptor on dealloc. */
+	_fd = -1;
+
+	@try {
+		int flags = O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
+
+		_path = [path copy];
+
+#ifdef OF_WINDOWS
+		_fd = _wopen((const wchar_t *)path.UTF16String,
+		    flags | O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+		_fd = open(nativePath(path), flags, 0666);
+#endif
+		if (_fd == -1)
+			@throw [OFOpenItemFailedException
+			    exceptionWithPath: path
+					 mode: (append ? @"a" : @"w")
+					errNo: errno];
+	} @catch (id e) {
+		[self release];
+		@throw e;
+	}
+
+	return self;
+}
+
+- (void)dealloc
+{
+	[self close];
+
+	[_path release];
+
+	[super dealloc];
+}
+
+- (void)writeBuffer: (const void *)buffer length: (size_t)length
+{
+	const unsigned char *bytes = buffer;
+	size_t bytesWritten = 0;
+
+	if (_fd == -1)
+		@throw [OFInvalidArgumentException exception];
+
+	while (bytesWritten < length) {
+		size_t chunkLength = length - bytesWritten;
+#ifdef OF_WINDOWS
+		int ret;
+
+		if (chunkLength > INT_MAX)
+			chunkLength = INT_MAX;
+
+		ret = _write(_fd, bytes + bytesWritten,
+		    (unsigned int)chunkLength);
+#else
+		ssize_t ret;
+
+		if (chunkLength > SSIZE_MAX)
+			chunkLength = SSIZE_MAX;
+
+		ret = write(_fd, bytes + bytesWritten, chunkLength);
+#endif
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			@throw [OFWriteFailedException
+			    exceptionWithObject: _path
+				requestedLength: length
+				   bytesWritten: bytesWritten
+					  errNo: errno];
+		}
+
+		bytesWritten += ret;
+	}
+}
+
+- (void)synchronize
+{
+	int ret;
+
+	if (_fd == -1)
+		@throw [OFInvalidArgumentException exception];
+
+#if defined(OF_WINDOWS)
+	ret = _commit(_fd);
+#elif defined(F_FULLFSYNC)
+	/* fsync() does not flush the disk cache on Apple platforms. */
+	if ((ret = fcntl(_fd, F_FULLFSYNC)) == -1)
+		ret = fsync(_fd);
+#else
+	ret = fsync(_fd);
+#endif
+
+	if (ret != 0)
+		@throw [OFWriteFailedException exceptionWithObject: _path
+						   requestedLength: 0
+						      bytesWritten: 0
+							     errNo: errno];
+}
+
+- (bool)truncateToLength: (unsigned long long)length
+{
+	if (_fd == -1)
+		return false;
+
+#ifdef OF_WINDOWS
+	return (_chsize_s(_fd, (long long)length) == 0);
+#else
+	return (ftruncate(_fd, (off_t)length) == 0);
+#endif
+}
+
+- (void)close
+{
+	if (_fd == -1)
+		return;
+
+#ifdef OF_WINDOWS
+	_close(_fd);
+#else
+	close(_fd);
+#endif
+	_fd = -1;
+}
+@end
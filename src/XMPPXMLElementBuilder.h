@@ -24,7 +24,60 @@
 
 OF_ASSUME_NONNULL_BEGIN
 
+@class XMPPXMLElementBuilder;
+
+/*!
+ * @brief A protocol implemented by delegates of an XMPPXMLElementBuilder that
+ *	  want to handle the children of large payloads one by one.
+ */
+@protocol XMPPXMLElementBuilderDelegate <OFXMLElementBuilderDelegate>
+@optional
+/*!
+ * @brief This callback is called when a child element of a top-level element
+ *	  starts.
+ *
+ * If it returns true, the children of the element are passed to
+ * @ref elementBuilder:didBuildChildElement:ofElement:inElement: one by one
+ * once built instead of being added to it.
+ *
+ * @param builder The builder that started the element
+ * @param element The element without any children
+ * @param stanza The top-level element without any children
+ * @return Whether to pass the children of the element individually
+ */
+-		   (bool)elementBuilder: (XMPPXMLElementBuilder *)builder
+  shouldStreamChildrenOfElement: (OFXMLElement *)element
+		      inElement: (OFXMLElement *)stanza;
+
+/*!
+ * @brief This callback is called for each child of an element for which
+ *	  @ref elementBuilder:shouldStreamChildrenOfElement:inElement: returned
+ *	  true.
+ *
+ * @param builder The builder that built the child
+ * @param child The child element that was built
+ * @param element The element without any children
+ * @param stanza The top-level element without any children
+ */
+-     (void)elementBuilder: (XMPPXMLElementBuilder *)builder
+  didBuildChildElement: (OFXMLElement *)child
+	     ofElement: (OFXMLElement *)element
+	     inElement: (OFXMLElement *)stanza;
+@end
+
+/*!
+ * @brief An OFXMLElementBuilder that interns namespaces, rejects comments and
+ *	  processing instructions and can pass the children of large payloads
+ *	  to its delegate one by one.
+ */
 @interface XMPPXMLElementBuilder: OFXMLElementBuilder
+{
+	size_t _depth;
+	OFString *_stanzaName, *_stanzaNamespace;
+	OFArray OF_GENERIC(OFXMLAttribute *) *_stanzaAttributes;
+	OFXMLElement *_Nullable _streamedStanza, *_Nullable _streamedElement;
+	OFXMLElementBuilder *_childBuilder;
+}
 @end
 
 OF_ASSUME_NONNULL_END
@@ -23,10 +23,152 @@
 #include "config.h"
 
 #import "XMPPXMLElementBuilder.h"
+#import "namespaces.h"
 
 #import <ObjFW/OFMalformedXMLException.h>
 
+@interface XMPPXMLElementBuilder () <OFXMLElementBuilderDelegate>
+@end
+
+static OFXMLElement *
+elementWithoutChildren(OFString *name, OFString *namespace,
+    OFArray OF_GENERIC(OFXMLAttribute *) *attributes)
+{
+	OFXMLElement *element = [OFXMLElement elementWithName: name
+						    namespace: namespace];
+
+	for (OFXMLAttribute *attribute in attributes)
+		[element addAttribute: attribute];
+
+	return element;
+}
+
 @implementation XMPPXMLElementBuilder
+- (void)dealloc
+{
+	[_stanzaName release];
+	[_stanzaNamespace release];
+	[_stanzaAttributes release];
+	[_streamedStanza release];
+	[_streamedElement release];
+	[_childBuilder release];
+
+	[super dealloc];
+}
+
+-    (void)parser: (OFXMLParser *)parser
+  didStartElement: (OFString *)name
+	   prefix: (OFString *)prefix
+	namespace: (OFString *)namespace
+       attributes: (OFArray OF_GENERIC(OFXMLAttribute *) *)attributes
+{
+	id delegate = self.delegate;
+
+	/* Allows looking up the handler of elements by pointer. */
+	name = XMPPInternedString(name);
+	namespace = XMPPInternedString(namespace);
+
+	if (_streamedElement != nil && _depth >= 2) {
+		[_childBuilder parser: parser
+		      didStartElement: name
+			       prefix: prefix
+			    namespace: namespace
+			   attributes: attributes];
+		_depth++;
+		return;
+	}
+
+	if (_depth == 0) {
+		OFString *oldName = _stanzaName;
+		OFString *oldNamespace = _stanzaNamespace;
+		OFArray *oldAttributes = _stanzaAttributes;
+
+		_stanzaName = [name copy];
+		_stanzaNamespace = [namespace copy];
+		_stanzaAttributes = [attributes copy];
+
+		[oldName release];
+		[oldNamespace release];
+		[oldAttributes release];
+	} else if (_depth == 1 && [delegate respondsToSelector: @selector(
+	    elementBuilder:shouldStreamChildrenOfElement:inElement:)]) {
+		OFXMLElement *stanza = elementWithoutChildren(_stanzaName,
+		    _stanzaNamespace, _stanzaAttributes);
+		OFXMLElement *element =
+		    elementWithoutChildren(name, namespace, attributes);
+
+		if ([delegate elementBuilder: self
+		    shouldStreamChildrenOfElement: element
+					inElement: stanza]) {
+			_streamedStanza = [stanza retain];
+			_streamedElement = [element retain];
+
+			if (_childBuilder == nil) {
+				_childBuilder =
+				    [[OFXMLElementBuilder alloc] init];
+				_childBuilder.delegate = self;
+			}
+		}
+	}
+
+	[super parser: parser
+	  didStartElement: name
+		   prefix: prefix
+		namespace: namespace
+	       attributes: attributes];
+	_depth++;
+}
+
+-  (void)parser: (OFXMLParser *)parser
+  didEndElement: (OFString *)name
+	 prefix: (OFString *)prefix
+      namespace: (OFString *)namespace
+{
+	if (_depth > 0)
+		_depth--;
+
+	if (_streamedElement != nil && _depth >= 2) {
+		[_childBuilder parser: parser
+			didEndElement: name
+			       prefix: prefix
+			    namespace: namespace];
+		return;
+	}
+
+	if (_streamedElement != nil && _depth == 1) {
+		[_streamedStanza release];
+		_streamedStanza = nil;
+		[_streamedElement release];
+		_streamedElement = nil;
+	}
+
+	[super parser: parser
+	didEndElement: name
+	       prefix: prefix
+	    namespace: namespace];
+}
+
+- (void)parser: (OFXMLParser *)parser foundCharacters: (OFString *)characters
+{
+	if (_streamedElement != nil && _depth > 2)
+		[_childBuilder parser: parser foundCharacters: characters];
+	/*
+	 * Whitespace between the streamed children would otherwise still be
+	 * collected in the streamed element.
+	 */
+	else if (_streamedElement == nil || _depth != 2 ||
+	    characters.stringByDeletingEnclosingWhitespaces.length > 0)
+		[super parser: parser foundCharacters: characters];
+}
+
+- (void)parser: (OFXMLParser *)parser foundCDATA: (OFString *)CDATA
+{
+	if (_streamedElement != nil && _depth > 2)
+		[_childBuilder parser: parser foundCDATA: CDATA];
+	else
+		[super parser: parser foundCDATA: CDATA];
+}
+
 -		 (void)parser: (OFXMLParser *)parser
   foundProcessingInstructions: (OFString *)pi
 {
@@ -37,4 +179,15 @@
 {
 	@throw [OFMalformedXMLException exception];
 }
+
+- (void)elementBuilder: (OFXMLElementBuilder *)builder
+       didBuildElement: (OFXMLElement *)element
+{
+	id delegate = self.delegate;
+
+	[delegate elementBuilder: self
+	    didBuildChildElement: element
+		       ofElement: _streamedElement
+		       inElement: _streamedStanza];
+}
 @end
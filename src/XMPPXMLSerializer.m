@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2026, Jonathan Schleifer <js@nil.im>
+ *
+ * https://nil.im/objxmpp/
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice is present in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#import "XMPPXMLSerializer.h"
+#import "namespaces.h"
+
+#define XML_NS @"http://www.w3.org/XML/1998/namespace"
+#define XMLNS_NS @"http://www.w3.org/2000/xmlns/"
+
+static void
+appendCString(OFMutableData *data, const char *string)
+{
+	[data addItems: string count: strlen(string)];
+}
+
+static void
+appendString(OFMutableData *data, OFString *string)
+{
+	[data addItems: string.UTF8String count: string.UTF8StringLength];
+}
+
+static void
+appendEscapedString(OFMutableData *data, OFString *string, bool isAttribute)
+{
+	const char *UTF8String = string.UTF8String;
+	size_t length = string.UTF8StringLength, last = 0;
+
+	for (size_t i = 0; i < length; i++) {
+		const char *replacement;
+
+		switch (UTF8String[i]) {
+		case '<':
+			replacement = "&lt;";
+			break;
+		case '>':
+			replacement = "&gt;";
+			break;
+		case '&':
+			replacement = "&amp;";
+			break;
+		case '\'':
+			replacement = "&apos;";
+			break;
+		case '"':
+			replacement = "&quot;";
+			break;
+		case '\r':
+			replacement = "&#xD;";
+			break;
+		case '\n':
+			/* Would be normalized to a space inside an attribute */
+			if (!isAttribute)
+				continue;
+
+			replacement = "&#xA;";
+			break;
+		case '\t':
+			if (!isAttribute)
+				continue;
+
+			replacement = "&#x9;";
+			break;
+		default:
+			continue;
+		}
+
+		[data addItems: UTF8String + last count: i - last];
+		appendCString(data, replacement);
+		last = i + 1;
+	}
+
+	[data addItems: UTF8String + last count: length - last];
+}
+
+static void
+appendElement(OFMutableData *data, OFXMLElement *element,
+    OFString *defaultNamespace)
+{
+	OFString *name = element.name, *namespace = element.namespace;
+	OFArray OF_GENERIC(OFXMLNode *) *children = element.children;
+	bool isStreamElement = false;
+	unsigned int prefixCount = 0;
+
+	if ([namespace isEqual: XMPPStreamNS])
+		isStreamElement = true;
+	else if (namespace != nil && ![namespace isEqual: defaultNamespace])
+		defaultNamespace = namespace;
+	else
+		namespace = nil;
+
+	appendCString(data, (isStreamElement ? "<stream:" : "<"));
+	appendString(data, name);
+
+	if (!isStreamElement && namespace != nil) {
+		appendCString(data, " xmlns='");
+		appendEscapedString(data, namespace, true);
+		appendCString(data, "'");
+	}
+
+	for (OFXMLAttribute *attribute in element.attributes) {
+		OFString *attributeNS = attribute.namespace;
+
+		if (attributeNS == nil) {
+			/* Namespaces are declared by the serializer itself */
+			if ([attribute.name isEqual: @"xmlns"])
+				continue;
+
+			appendCString(data, " ");
+		} else if ([attributeNS isEqual: XML_NS])
+			appendCString(data, " xml:");
+		else if ([attributeNS isEqual: XMLNS_NS])
+			continue;
+		else {
+			char prefix[16];
+
+			snprintf(prefix, sizeof(prefix), "ns%u", prefixCount++);
+
+			appendCString(data, " xmlns:");
+			appendCString(data, prefix);
+			appendCString(data, "='");
+			appendEscapedString(data, attributeNS, true);
+			appendCString(data, "' ");
+			appendCString(data, prefix);
+			appendCString(data, ":");
+		}
+
+		appendString(data, attribute.name);
+		appendCString(data, "='");
+		appendEscapedString(data, attribute.stringValue, true);
+		appendCString(data, "'");
+	}
+
+	if (children.count == 0) {
+		appendCString(data, "/>");
+		return;
+	}
+
+	appendCString(data, ">");
+
+	for (OFXMLNode *child in children) {
+		if ([child isKindOfClass: [OFXMLElement class]])
+			appendElement(data, (OFXMLElement *)child,
+			    defaultNamespace);
+		else if ([child isKindOfClass: [OFXMLCharacters class]] ||
+		    [child isKindOfClass: [OFXMLCDATA class]])
+			appendEscapedString(data, child.stringValue, false);
+		/* Comments and processing instructions are not allowed */
+	}
+
+	appendCString(data, (isStreamElement ? "</stream:" : "</"));
+	appendString(data, name);
+	appendCString(data, ">");
+}
+
+@implementation XMPPXMLSerializer
++ (void)appendElement: (OFXMLElement *)element toData: (OFMutableData *)data
+{
+	void *pool = objc_autoreleasePoolPush();
+
+	appendElement(data, element, XMPPClientNS);
+
+	objc_autoreleasePoolPop(pool);
+}
+@end
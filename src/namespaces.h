@@ -37,3 +37,31 @@ extern OFString *const XMPPStanzasNS;
 extern OFString *const XMPPStartTLSNS;
 extern OFString *const XMPPStreamNS;
 extern OFString *const XMPPXMPPStreamNS;
+
+/*!
+ * @brief Returns the interned string equal to the specified string, interning
+ *	  it if it has not been interned yet.
+ *
+ * This is used for the namespaces and element names that handlers are
+ * registered for. The namespace constants above are always interned.
+ * Interned strings are never freed, so this must not be used for strings
+ * received from the network.
+ *
+ * @param string The string to intern, or nil
+ * @return The interned string equal to the specified string
+ */
+extern OFString *XMPPInternString(OFString *string);
+
+/*!
+ * @brief Returns the interned string equal to the specified string without
+ *	  interning it.
+ *
+ * This allows comparing namespaces and element names returned by the parser
+ * to interned strings by pointer instead of by content. It does not take a
+ * lock and is therefore cheap enough to be called for every parsed element.
+ *
+ * @param string The string to look up, or nil
+ * @return The interned string equal to the specified string, or the specified
+ *	   string if it has not been interned
+ */
+extern OFString *XMPPInternedString(OFString *string);
@@ -22,6 +22,10 @@
 
 #import "namespaces.h"
 
+#ifdef OF_HAVE_THREADS
+# import <ObjFW/OFAtomic.h>
+#endif
+
 OFString *const XMPPBindNS = @"urn:ietf:params:xml:ns:xmpp-bind";
 OFString *const XMPPCapsNS = @"http://jabber.org/protocol/caps";
 OFString *const XMPPClientNS = @"jabber:client";
@@ -37,3 +41,101 @@ OFString *const XMPPStanzasNS = @"urn:ietf:params:xml:ns:xmpp-stanzas";
 OFString *const XMPPStartTLSNS = @"urn:ietf:params:xml:ns:xmpp-tls";
 OFString *const XMPPStreamNS = @"http://etherx.jabber.org/streams";
 OFString *const XMPPXMPPStreamNS = @"urn:ietf:params:xml:ns:xmpp-streams";
+
+/*
+ * The table of interned strings is never mutated once it has been published,
+ * so that looking up a string does not need to take a lock. Interning a new
+ * string replaces the table with a copy instead.
+ */
+static OFDictionary OF_GENERIC(OFString *, OFString *) *volatile
+    internedStrings;
+/* A replaced table might still be in use by a reader, so it is kept. */
+static OFMutableArray OF_GENERIC(OFDictionary *) *replacedInternedStrings;
+#ifdef OF_HAVE_THREADS
+static OFMutex *internedStringsMutex;
+#endif
+static OFOnceControl internedStringsOnceControl = OFOnceControlInitValue;
+
+static void
+initInternedStrings(void)
+{
+	OFString *namespaces[] = {
+		XMPPBindNS, XMPPCapsNS, XMPPClientNS, XMPPDiscoInfoNS,
+		XMPPDiscoItemsNS, XMPPMUCNS, XMPPRosterNS, XMPPRosterVerNS,
+		XMPPSASLNS, XMPPSessionNS, XMPPSMNS, XMPPStanzasNS,
+		XMPPStartTLSNS, XMPPStreamNS, XMPPXMPPStreamNS
+	};
+	size_t count = sizeof(namespaces) / sizeof(*namespaces);
+
+	internedStrings = [[OFDictionary alloc] initWithObjects: namespaces
+							forKeys: namespaces
+							  count: count];
+	replacedInternedStrings = [[OFMutableArray alloc] init];
+#ifdef OF_HAVE_THREADS
+	internedStringsMutex = [[OFMutex alloc] init];
+#endif
+}
+
+OFString *
+XMPPInternString(OFString *string)
+{
+	OFString *interned;
+
+	if (string == nil)
+		return nil;
+
+	OFOnce(&internedStringsOnceControl, initInternedStrings);
+
+#ifdef OF_HAVE_THREADS
+	[internedStringsMutex lock];
+	@try {
+#endif
+		interned = [internedStrings objectForKey: string];
+
+		/* Interned strings are never removed. */
+		if (interned == nil) {
+			OFDictionary *oldTable = internedStrings;
+			OFMutableDictionary *table =
+			    [[oldTable mutableCopy] autorelease];
+
+			interned = [[string copy] autorelease];
+			[table setObject: interned forKey: interned];
+			[table makeImmutable];
+
+			[replacedInternedStrings addObject: oldTable];
+			[table retain];
+#ifdef OF_HAVE_THREADS
+			/* Publish the table only once it is complete. */
+			OFReleaseMemoryBarrier();
+#endif
+			internedStrings = table;
+			[oldTable release];
+		}
+#ifdef OF_HAVE_THREADS
+	} @finally {
+		[internedStringsMutex unlock];
+	}
+#endif
+
+	return interned;
+}
+
+OFString *
+XMPPInternedString(OFString *string)
+{
+	OFDictionary *table;
+	OFString *interned;
+
+	if (string == nil)
+		return nil;
+
+	OFOnce(&internedStringsOnceControl, initInternedStrings);
+
+	table = internedStrings;
+#ifdef OF_HAVE_THREADS
+	OFAcquireMemoryBarrier();
+#endif
+	interned = [table objectForKey: string];
+
+	return (interned != nil ? interned : string);
+}
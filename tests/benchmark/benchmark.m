@@ -0,0 +1,1265 @@
+/*
+ * Copyright (c) 2026, Jonathan Schleifer <js@nil.im>
+ *
+ * https://nil.im/objxmpp/
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice is present in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#import <ObjFW/ObjFW.h>
+
+#import "XMPPConnection.h"
+#import "XMPPContactManager.h"
+#import "XMPPFileStorage.h"
+#import "XMPPIQ.h"
+#import "XMPPJID.h"
+#import "XMPPJIDCache.h"
+#import "XMPPJournalStorage.h"
+#import "XMPPMessage.h"
+#import "XMPPMulticastDelegate.h"
+#import "XMPPPresence.h"
+#import "XMPPRoster.h"
+#import "XMPPRosterItem.h"
+#import "XMPPStoragePath.h"
+#import "XMPPXMLSerializer.h"
+#import "namespaces.h"
+
+/*
+ * Micro-benchmarks for the hot paths. Each benchmark prints one line per
+ * variant, so that the numbers before and after a change can be compared.
+ */
+@interface Benchmark: OFObject <OFApplicationDelegate>
+@end
+
+@interface XMPPConnection (Private)
+- (void)xmpp_startStream;
+- (void)xmpp_asyncRead;
+- (bool)xmpp_adaptReadBufferToLength: (size_t)length;
+@end
+
+@interface XMPPRoster (Private)
+- (void)xmpp_handleInitialRosterForConnection: (XMPPConnection *)connection
+					   IQ: (XMPPIQ *)IQ;
+@end
+
+/* Feeds a recorded stream to the parser the way reads would deliver it. */
+@interface ReplayConnection: XMPPConnection
+- (size_t)replayData: (OFData *)data;
+@end
+
+@interface MessageCounter: OFObject <XMPPConnectionDelegate>
+{
+@public
+	size_t messages;
+}
+@end
+
+@interface BroadcastReceiver: OFObject
+{
+@public
+	size_t received;
+}
+- (bool)receiveObject: (id)object;
+@end
+
+/*
+ * A local server that answers the steps before TLS with a delay, as if it
+ * was far away.
+ */
+@interface ScriptedServer: OFObject <OFTCPSocketDelegate>
+{
+@public
+	OFTCPSocket *_socket, *_client;
+	uint16_t _port;
+	OFTimeInterval _roundTripTime;
+	char _buffer[512];
+}
+- (void)stop;
+@end
+
+@interface TLSUpgradeObserver: OFObject <XMPPConnectionDelegate>
+{
+@public
+	OFTimeInterval _upgradeTime;
+}
+@end
+
+@interface ContactEventCounter: OFObject <XMPPContactManagerDelegate>
+{
+@public
+	size_t _added, _removed, _updated;
+}
+@end
+
+/* Saves the roster version on every push and drops what is sent. */
+@interface VersionedConnection: XMPPConnection
+@end
+
+/*
+ * Delivers one roster push per timer and records how long the run loop was
+ * kept from delivering it, including the time it took to handle it.
+ */
+@interface RosterPushStorm: OFObject
+{
+@public
+	XMPPConnection *_connection;
+	XMPPRoster *_roster;
+	size_t _remaining;
+	OFTimeInterval _interval, _scheduledAt, _maxStall, _totalStall;
+}
+- (void)schedule;
+@end
+
+OF_APPLICATION_DELEGATE(Benchmark)
+
+static OFTimeInterval
+now(void)
+{
+	return [OFDate date].timeIntervalSince1970;
+}
+
+static void
+report(OFString *name, OFTimeInterval duration, OFString *details)
+{
+	[OFStdOut writeFormat: @"%@: %.3f ms (%@)\n",
+			       name, duration * 1000, details];
+}
+
+static OFData *
+recordedStream(size_t messages)
+{
+	OFMutableData *data = [OFMutableData data];
+	OFString *header = @"<stream:stream xmlns='jabber:client' "
+	    @"xmlns:stream='http://etherx.jabber.org/streams' version='1.0'>";
+
+	[data addItems: header.UTF8String count: header.UTF8StringLength];
+
+	for (size_t i = 0; i < messages; i++) {
+		void *pool = objc_autoreleasePoolPush();
+		OFString *message = [OFString stringWithFormat:
+		    @"<message from='juliet@capulet.lit/balcony' "
+		    @"to='romeo@montague.lit/orchard' type='chat' id='m%zu'>"
+		    @"<body>Wherefore art thou, Romeo? Deny thy father and "
+		    @"refuse thy name; or if thou wilt not, be but sworn my "
+		    @"love.</body></message>", i];
+
+		[data addItems: message.UTF8String
+			 count: message.UTF8StringLength];
+
+		objc_autoreleasePoolPop(pool);
+	}
+
+	return data;
+}
+
+static void
+benchmarkReadBuffer(void)
+{
+	void *pool = objc_autoreleasePoolPush();
+	OFData *stream = recordedStream(5000);
+	double megabytes = stream.count / 1048576.0;
+	/* A fixed buffer of the old size and the adaptive buffer. */
+	const size_t maximumSizes[] = {
+		XMPPConnectionBufferLength, XMPPConnectionMaximumBufferLength
+	};
+
+	for (size_t i = 0; i < sizeof(maximumSizes) / sizeof(*maximumSizes);
+	    i++) {
+		ReplayConnection *connection =
+		    [[[ReplayConnection alloc] init] autorelease];
+		MessageCounter *counter =
+		    [[[MessageCounter alloc] init] autorelease];
+		OFTimeInterval start, duration;
+		size_t reads;
+
+		connection.maximumReadBufferSize = maximumSizes[i];
+		[connection addDelegate: counter];
+
+		start = now();
+		reads = [connection replayData: stream];
+		duration = now() - start;
+
+		report([OFString stringWithFormat:
+		    @"Replay with read buffer up to %zu bytes",
+		    maximumSizes[i]], duration, [OFString stringWithFormat:
+		    @"%.0f stanzas/s, %.1f reads/MB",
+		    counter->messages / duration, reads / megabytes]);
+
+		[connection removeDelegate: counter];
+	}
+
+	objc_autoreleasePoolPop(pool);
+}
+
+static void
+benchmarkSerializer(void)
+{
+	void *pool = objc_autoreleasePoolPush();
+	const size_t iterations = 100000;
+	OFMutableString *body = [OFMutableString string];
+	XMPPMessage *message = [XMPPMessage messageWithType: @"chat"
+							 ID: @"m1"];
+	OFMutableData *data = [OFMutableData data];
+	OFTimeInterval start;
+	size_t length = 0;
+
+	/* A large body with characters that need to be escaped. */
+	for (size_t i = 0; i < 64; i++)
+		[body appendString: @"Romeo & Juliet <3 \"O Romeo, Romeo!\" "
+		    @"wherefore art thou Romeo? "];
+
+	message.to = [XMPPJID JIDWithString: @"romeo@montague.lit/orchard"];
+	message.body = body;
+
+	start = now();
+	for (size_t i = 0; i < iterations; i++) {
+		void *pool2 = objc_autoreleasePoolPush();
+		OFString *string = message.XMLString;
+
+		/* What sending a stanza did before. */
+		[data removeAllItems];
+		[data addItems: string.UTF8String
+			 count: string.UTF8StringLength];
+		length += data.count;
+
+		objc_autoreleasePoolPop(pool2);
+	}
+	report(@"Serialize with XMLString", now() - start,
+	    [OFString stringWithFormat: @"%zu stanzas, %zu bytes",
+	    iterations, length]);
+
+	length = 0;
+	start = now();
+	for (size_t i = 0; i < iterations; i++) {
+		void *pool2 = objc_autoreleasePoolPush();
+
+		[data removeAllItems];
+		[XMPPXMLSerializer appendElement: message toData: data];
+		length += data.count;
+
+		objc_autoreleasePoolPop(pool2);
+	}
+	report(@"Serialize with XMPPXMLSerializer", now() - start,
+	    [OFString stringWithFormat: @"%zu stanzas, %zu bytes",
+	    iterations, length]);
+
+	objc_autoreleasePoolPop(pool);
+}
+
+static void
+benchmarkJIDCache(void)
+{
+	void *pool = objc_autoreleasePoolPush();
+	const size_t contacts = 2000, stanzas = 200000;
+	XMPPJIDCache *cache = [XMPPJIDCache sharedCache];
+	OFMutableArray *elements = [OFMutableArray array];
+
+	/* A presence storm, in which every contact sends several presences. */
+	for (size_t i = 0; i < contacts; i++) {
+		OFXMLElement *element =
+		    [OFXMLElement elementWithName: @"presence"
+					namespace: XMPPClientNS];
+
+		[element addAttributeWithName: @"from"
+				  stringValue: [OFString stringWithFormat:
+						   @"Contact%zu@Example.com/"
+						   @"Resource%zu", i, i % 3]];
+		[element addAttributeWithName: @"to"
+				  stringValue: @"user@example.com/client"];
+		[elements addObject: element];
+	}
+
+	for (int enabled = 0; enabled <= 1; enabled++) {
+		unsigned long long hits, misses;
+		OFTimeInterval start, duration;
+
+		cache.enabled = enabled;
+		[cache removeAllEntries];
+		hits = cache.numberOfHits;
+		misses = cache.numberOfMisses;
+
+		start = now();
+		for (size_t i = 0; i < stanzas; i++) {
+			void *pool2 = objc_autoreleasePoolPush();
+
+			[XMPPPresence stanzaWithElement:
+			    [elements objectAtIndex: i % contacts]];
+
+			objc_autoreleasePoolPop(pool2);
+		}
+		duration = now() - start;
+
+		report([OFString stringWithFormat:
+		    @"Decode presences with JID cache %@",
+		    (enabled ? @"enabled" : @"disabled")], duration,
+		    [OFString stringWithFormat: @"%.0f stanzas/s, "
+		    @"%llu hits, %llu misses, %zu bytes cached",
+		    stanzas / duration, cache.numberOfHits - hits,
+		    cache.numberOfMisses - misses, cache.memoryUsage]);
+	}
+
+	objc_autoreleasePoolPop(pool);
+}
+
+static void
+benchmarkPresenceSort(void)
+{
+	void *pool = objc_autoreleasePoolPush();
+	const size_t count = 1000000;
+	/* Includes no show and an unknown one. */
+	OFString *shows[] = { nil, @"chat", @"away", @"xa", @"dnd", @"bogus" };
+	OFMutableArray *presences = [OFMutableArray arrayWithCapacity: count];
+	OFArray *sorted;
+	OFTimeInterval start, duration;
+
+	for (size_t i = 0; i < count; i++) {
+		XMPPPresence *presence = [[XMPPPresence alloc] init];
+
+		/* 7919 is prime, so the order is scrambled. */
+		presence.show = shows[(i * 7919) % 6];
+		presence.priority = [OFNumber numberWithChar:
+		    (char)((i * 7919) % 11) - 5];
+		[presences addObject: presence];
+		[presence release];
+	}
+
+	start = now();
+	sorted = [presences sortedArray];
+	duration = now() - start;
+
+	report(@"Sort presences", duration, [OFString stringWithFormat:
+	    @"%zu presences, %.0f presences/s", sorted.count,
+	    count / duration]);
+
+	objc_autoreleasePoolPop(pool);
+}
+
+static void
+benchmarkDispatch(void)
+{
+	void *pool = objc_autoreleasePoolPush();
+	const size_t iterations = 1000000;
+	/* The elements that are received most often. */
+	const char *names[] = { "message", "presence", "iq", "r", "a" };
+	const char *namespaces[] = {
+		"jabber:client", "jabber:client", "jabber:client",
+		"urn:xmpp:sm:3", "urn:xmpp:sm:3"
+	};
+	const size_t count = sizeof(names) / sizeof(*names);
+	OFString *variants[] = {
+		@"Dispatch by name and namespace",
+		@"Dispatch by locked interned namespace",
+		@"Dispatch by lock-free interned name and namespace"
+	};
+	OFMutableArray *tables = [OFMutableArray array];
+	const OFMapTableFunctions pointerFunctions = { NULL };
+	OFMutableDictionary *byString = [OFMutableDictionary dictionary];
+	OFMapTable *byNamespace = [OFMapTable
+	    mapTableWithKeyFunctions: pointerFunctions
+		     objectFunctions: pointerFunctions];
+	OFMapTable *byPointer = [OFMapTable
+	    mapTableWithKeyFunctions: pointerFunctions
+		     objectFunctions: pointerFunctions];
+	OFMutex *mutex = [OFMutex mutex];
+
+	for (size_t i = 0; i < count; i++) {
+		OFString *name = XMPPInternString(
+		    [OFString stringWithUTF8String: names[i]]);
+		OFString *namespace = XMPPInternString(
+		    [OFString stringWithUTF8String: namespaces[i]]);
+		OFMutableDictionary *dictionary =
+		    [byString objectForKey: namespace];
+		OFMapTable *mapTable = [byPointer objectForKey: namespace];
+
+		if (dictionary == nil) {
+			dictionary = [OFMutableDictionary dictionary];
+			[byString setObject: dictionary forKey: namespace];
+			[byNamespace setObject: dictionary forKey: namespace];
+
+			mapTable = [OFMapTable
+			    mapTableWithKeyFunctions: pointerFunctions
+				     objectFunctions: pointerFunctions];
+			[byPointer setObject: mapTable forKey: namespace];
+			[tables addObject: mapTable];
+		}
+
+		/* The name stands in for the handler. */
+		[dictionary setObject: name forKey: name];
+		[mapTable setObject: name forKey: name];
+	}
+
+	for (size_t variant = 0; variant < 3; variant++) {
+		OFTimeInterval start = now();
+		size_t found = 0;
+
+		for (size_t i = 0; i < iterations; i++) {
+			void *pool2 = objc_autoreleasePoolPush();
+			/* The parser creates new strings for every element. */
+			OFString *name = [OFString
+			    stringWithUTF8String: names[i % count]];
+			OFString *namespace = [OFString
+			    stringWithUTF8String: namespaces[i % count]];
+			id handler = nil;
+
+			switch (variant) {
+			case 0:
+				handler = [[byString objectForKey: namespace]
+				    objectForKey: name];
+				break;
+			case 1:
+				/* What XMPPXMLElementBuilder did before. */
+				[mutex lock];
+				namespace = XMPPInternedString(namespace);
+				[mutex unlock];
+
+				handler = [(OFDictionary *)[byNamespace
+				    objectForKey: namespace]
+				    objectForKey: name];
+				break;
+			case 2:
+				/* What XMPPXMLElementBuilder does now. */
+				name = XMPPInternedString(name);
+				namespace = XMPPInternedString(namespace);
+
+				handler = [(OFMapTable *)[byPointer
+				    objectForKey: namespace]
+				    objectForKey: name];
+				break;
+			}
+
+			if (handler != nil)
+				found++;
+
+			objc_autoreleasePoolPop(pool2);
+		}
+
+		report(variants[variant], now() - start,
+		    [OFString stringWithFormat:
+		    @"%zu of %zu elements dispatched", found, iterations]);
+	}
+
+	objc_autoreleasePoolPop(pool);
+}
+
+static void
+benchmarkBroadcast(void)
+{
+	void *pool = objc_autoreleasePoolPush();
+	const size_t iterations = 1000000, count = 10;
+	XMPPMulticastDelegate *multicastDelegate =
+	    [[[XMPPMulticastDelegate alloc] init] autorelease];
+	OFMutableData *delegates = [OFMutableData dataWithItemSize: sizeof(id)];
+	OFMutableArray *receivers = [OFMutableArray array];
+	SEL selector = @selector(receiveObject:);
+	OFTimeInterval start, duration;
+
+	for (size_t i = 0; i < count; i++) {
+		BroadcastReceiver *receiver =
+		    [[[BroadcastReceiver alloc] init] autorelease];
+
+		[receivers addObject: receiver];
+		[delegates addItem: &receiver];
+		[multicastDelegate addDelegate: receiver];
+	}
+
+	start = now();
+	for (size_t i = 0; i < iterations; i++) {
+		/* What broadcasting did before the responders were cached. */
+		void *pool2 = objc_autoreleasePoolPush();
+		OFData *currentDelegates = [[delegates copy] autorelease];
+		id const *items = currentDelegates.items;
+
+		for (size_t j = 0; j < count; j++) {
+			bool (*imp)(id, SEL, id);
+
+			if (![items[j] respondsToSelector: selector])
+				continue;
+
+			imp = (bool (*)(id, SEL, id))
+			    [items[j] methodForSelector: selector];
+			imp(items[j], selector, nil);
+		}
+
+		objc_autoreleasePoolPop(pool2);
+	}
+	duration = now() - start;
+	report(@"Broadcast to 10 delegates without cache", duration,
+	    [OFString stringWithFormat: @"%.0f ns per broadcast",
+	    duration * 1e9 / iterations]);
+
+	start = now();
+	for (size_t i = 0; i < iterations; i++)
+		[multicastDelegate broadcastSelector: selector withObject: nil];
+	duration = now() - start;
+	report(@"Broadcast to 10 delegates with cache", duration,
+	    [OFString stringWithFormat: @"%.0f ns per broadcast",
+	    duration * 1e9 / iterations]);
+
+	/* The part of the above that is spent on the autorelease pool. */
+	start = now();
+	for (size_t i = 0; i < iterations; i++)
+		objc_autoreleasePoolPop(objc_autoreleasePoolPush());
+	duration = now() - start;
+	report(@"Autorelease pool per broadcast", duration,
+	    [OFString stringWithFormat: @"%.0f ns per broadcast",
+	    duration * 1e9 / iterations]);
+
+	objc_autoreleasePoolPop(pool);
+}
+
+/*
+ * Returns the result of a roster request with the specified number of items,
+ * which are not sent in the order of their names.
+ */
+static XMPPIQ *
+rosterResult(size_t count)
+{
+	XMPPIQ *IQ = [XMPPIQ IQWithType: @"result" ID: @"roster"];
+	OFXMLElement *query = [OFXMLElement elementWithName: @"query"
+						  namespace: XMPPRosterNS];
+
+	for (size_t i = 0; i < count; i++) {
+		void *pool = objc_autoreleasePoolPush();
+		/* 7919 is prime and thus coprime to count. */
+		size_t number = (i * 7919) % count;
+		OFXMLElement *item =
+		    [OFXMLElement elementWithName: @"item"
+					namespace: XMPPRosterNS];
+
+		[item addAttributeWithName: @"jid"
+			       stringValue: [OFString stringWithFormat:
+						@"contact%zu@example.com",
+						number]];
+		[item addAttributeWithName: @"name"
+			       stringValue: [OFString stringWithFormat:
+						@"Contact %06zu", number]];
+		[item addAttributeWithName: @"subscription"
+			       stringValue: @"both"];
+		[item addChild: [OFXMLElement
+		    elementWithName: @"group"
+			  namespace: XMPPRosterNS
+			stringValue: [OFString stringWithFormat:
+					 @"Group %zu", number % 100]]];
+		[query addChild: item];
+
+		objc_autoreleasePoolPop(pool);
+	}
+
+	[IQ addChild: query];
+
+	return IQ;
+}
+
+static void
+benchmarkRosterLookups(void)
+{
+	void *pool = objc_autoreleasePoolPush();
+	const size_t count = 100000, lookups = 100;
+	XMPPConnection *connection = [[XMPPConnection alloc] init];
+	XMPPRoster *roster =
+	    [[XMPPRoster alloc] initWithConnection: connection];
+	OFArray *rosterItems;
+	OFTimeInterval start, duration;
+	size_t found;
+
+	[roster xmpp_handleInitialRosterForConnection: connection
+						   IQ: rosterResult(count)];
+	rosterItems = roster.rosterItems.allObjects;
+
+	/* Each prefix matches 10 items. */
+	found = 0;
+	start = now();
+	for (size_t i = 0; i < lookups; i++) {
+		void *pool2 = objc_autoreleasePoolPush();
+		OFString *prefix = [OFString stringWithFormat:
+		    @"contact %05zu", (i * 97) % (count / 10)];
+
+		found += [roster rosterItemsWithNamePrefix: prefix].count;
+
+		objc_autoreleasePoolPop(pool2);
+	}
+	duration = now() - start;
+	report(@"Name prefix lookup with index", duration,
+	    [OFString stringWithFormat: @"%zu items, %.1f us per lookup, "
+	    @"%zu found", count, duration * 1e6 / lookups, found]);
+
+	found = 0;
+	start = now();
+	for (size_t i = 0; i < lookups; i++) {
+		void *pool2 = objc_autoreleasePoolPush();
+		OFString *prefix = [OFString stringWithFormat:
+		    @"contact %05zu", (i * 97) % (count / 10)];
+
+		for (XMPPRosterItem *rosterItem in rosterItems)
+			if ([rosterItem.name.lowercaseString
+			    hasPrefix: prefix])
+				found++;
+
+		objc_autoreleasePoolPop(pool2);
+	}
+	duration = now() - start;
+	report(@"Name prefix lookup by scanning", duration,
+	    [OFString stringWithFormat: @"%zu items, %.1f us per lookup, "
+	    @"%zu found", count, duration * 1e6 / lookups, found]);
+
+	/* Each group has 1000 members. */
+	found = 0;
+	start = now();
+	for (size_t i = 0; i < lookups; i++) {
+		void *pool2 = objc_autoreleasePoolPush();
+		OFString *group =
+		    [OFString stringWithFormat: @"Group %zu", i % 100];
+
+		found += [roster rosterItemsInGroup: group].count;
+
+		objc_autoreleasePoolPop(pool2);
+	}
+	duration = now() - start;
+	report(@"Group lookup with index", duration,
+	    [OFString stringWithFormat: @"%zu items, %.1f us per lookup, "
+	    @"%zu found", count, duration * 1e6 / lookups, found]);
+
+	found = 0;
+	start = now();
+	for (size_t i = 0; i < lookups; i++) {
+		void *pool2 = objc_autoreleasePoolPush();
+		OFString *group =
+		    [OFString stringWithFormat: @"Group %zu", i % 100];
+
+		for (XMPPRosterItem *rosterItem in rosterItems)
+			if ([rosterItem.groups containsObject: group])
+				found++;
+
+		objc_autoreleasePoolPop(pool2);
+	}
+	duration = now() - start;
+	report(@"Group lookup by scanning", duration,
+	    [OFString stringWithFormat: @"%zu items, %.1f us per lookup, "
+	    @"%zu found", count, duration * 1e6 / lookups, found]);
+
+	[roster release];
+	[connection release];
+
+	objc_autoreleasePoolPop(pool);
+}
+
+/* Creates an empty directory for the files of a benchmark. */
+static OFString *
+createTemporaryDirectory(OFString *name)
+{
+	OFFileManager *fileManager = [OFFileManager defaultManager];
+	OFIRI *temporaryDirectoryIRI = [OFSystemInfo temporaryDirectoryIRI];
+	OFString *directory = (temporaryDirectoryIRI != nil
+	    ? temporaryDirectoryIRI.fileSystemRepresentation : @".");
+
+	directory = [directory stringByAppendingPathComponent:
+	    [OFString stringWithFormat: @"objxmpp-%@-%08" PRIx32,
+	    name, OFRandom32()]];
+
+	if ([fileManager directoryExistsAtPath: directory])
+		[fileManager removeItemAtPath: directory];
+
+	[fileManager createDirectoryAtPath: directory];
+
+	return directory;
+}
+
+/* Returns roster items the way XMPPRoster stores them. */
+static OFDictionary *
+storedRosterItems(size_t count)
+{
+	OFMutableDictionary *items =
+	    [OFMutableDictionary dictionaryWithCapacity: count];
+
+	for (size_t i = 0; i < count; i++) {
+		void *pool = objc_autoreleasePoolPush();
+		OFString *JID = [OFString stringWithFormat:
+		    @"contact%zu@example.com", i];
+
+		[items setObject: [OFDictionary dictionaryWithKeysAndObjects:
+		    @"JID", JID,
+		    @"name", [OFString stringWithFormat: @"Contact %zu", i],
+		    @"subscription", @"both",
+		    @"groups", [OFArray arrayWithObject: @"Friends"], nil]
+			  forKey: JID];
+
+		objc_autoreleasePoolPop(pool);
+	}
+
+	return items;
+}
+
+static void
+benchmarkStorageSaves(void)
+{
+	void *pool = objc_autoreleasePoolPush();
+	OFFileManager *fileManager = [OFFileManager defaultManager];
+	OFString *directory = createTemporaryDirectory(@"benchmark");
+	const size_t sizes[] = { 1000, 10000, 100000 };
+	const size_t saves = 100;
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+		OFDictionary *items = storedRosterItems(sizes[i]);
+
+		/* Saving a roster push, which changes a single item. */
+		for (int journal = 0; journal <= 1; journal++) {
+			void *pool2 = objc_autoreleasePoolPush();
+			OFString *file = [directory
+			    stringByAppendingPathComponent: [OFString
+			    stringWithFormat: @"%zu-%d.binarypack",
+			    sizes[i], journal]];
+			id <XMPPStorage> storage;
+			XMPPStoragePath *itemsPath;
+			OFTimeInterval start, duration;
+
+			if (journal)
+				storage = [[[XMPPJournalStorage alloc]
+				    initWithFile: file] autorelease];
+			else
+				storage = [[[XMPPFileStorage alloc]
+				    initWithFile: file] autorelease];
+
+			[storage setDictionary: items forPath: @"roster.items"];
+			[storage save];
+			if (journal)
+				[(XMPPJournalStorage *)storage compact];
+
+			/* JIDs contain dots, so they need path handles. */
+			itemsPath =
+			    [storage pathHandleForPath: @"roster.items"];
+
+			start = now();
+			for (size_t j = 0; j < saves; j++) {
+				void *pool3 = objc_autoreleasePoolPush();
+				XMPPStoragePath *path = [[itemsPath
+				    pathByAppendingComponent: [OFString
+				    stringWithFormat: @"contact%zu@example.com",
+				    j]] pathByAppendingComponent: @"name"];
+
+				[storage setStringValue: @"Renamed"
+					  forPathHandle: path];
+				[storage save];
+
+				objc_autoreleasePoolPop(pool3);
+			}
+			duration = now() - start;
+
+			report([OFString stringWithFormat:
+			    @"Save with %@ at %zu roster items",
+			    (journal ? @"XMPPJournalStorage"
+				     : @"XMPPFileStorage"), sizes[i]],
+			    duration, [OFString stringWithFormat:
+			    @"%.3f ms per save", duration * 1000 / saves]);
+
+			objc_autoreleasePoolPop(pool2);
+		}
+	}
+
+	[fileManager removeItemAtPath: directory];
+
+	objc_autoreleasePoolPop(pool);
+}
+
+static void
+benchmarkRosterReconciliation(void)
+{
+	void *pool = objc_autoreleasePoolPush();
+	const size_t count = 10000, removed = 100;
+	XMPPConnection *connection = [[XMPPConnection alloc] init];
+	XMPPRoster *roster =
+	    [[XMPPRoster alloc] initWithConnection: connection];
+	XMPPContactManager *manager = [[XMPPContactManager alloc]
+	    initWithConnection: connection
+			roster: roster];
+	ContactEventCounter *counter =
+	    [[[ContactEventCounter alloc] init] autorelease];
+	/* A reconnect that changes nothing and one that removes contacts. */
+	XMPPIQ *results[] = {
+		rosterResult(count), rosterResult(count),
+		rosterResult(count - removed)
+	};
+	OFString *names[] = {
+		@"Initial roster", @"Unchanged roster on reconnect",
+		@"Roster with removed contacts on reconnect"
+	};
+
+	[manager addDelegate: counter];
+
+	for (size_t i = 0; i < sizeof(results) / sizeof(*results); i++) {
+		OFTimeInterval start, duration;
+
+		counter->_added = counter->_removed = counter->_updated = 0;
+
+		start = now();
+		[roster xmpp_handleInitialRosterForConnection: connection
+							   IQ: results[i]];
+		duration = now() - start;
+
+		report([OFString stringWithFormat: @"%@ with %zu contacts",
+		    names[i], count], duration, [OFString stringWithFormat:
+		    @"%zu events: %zu added, %zu removed, %zu updated",
+		    counter->_added + counter->_removed + counter->_updated,
+		    counter->_added, counter->_removed, counter->_updated]);
+	}
+
+	[manager removeDelegate: counter];
+	[manager release];
+	[roster release];
+	[connection release];
+
+	objc_autoreleasePoolPop(pool);
+}
+
+static void
+benchmarkInitialRosterLoad(void)
+{
+	void *pool = objc_autoreleasePoolPush();
+	OFFileManager *fileManager = [OFFileManager defaultManager];
+	OFString *directory = createTemporaryDirectory(@"roster");
+	const size_t sizes[] = { 1000, 10000, 100000 };
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+		void *pool2 = objc_autoreleasePoolPush();
+		OFString *file = [directory
+		    stringByAppendingPathComponent: [OFString
+		    stringWithFormat: @"roster-%zu.binarypack", sizes[i]]];
+		XMPPFileStorage *storage = [[[XMPPFileStorage alloc]
+		    initWithFile: file] autorelease];
+		VersionedConnection *connection =
+		    [[VersionedConnection alloc] init];
+		XMPPRoster *roster;
+		XMPPIQ *result = rosterResult(sizes[i]);
+		OFTimeInterval start, duration;
+
+		/* Every item is also stored, as roster versioning is used. */
+		connection.dataStorage = storage;
+		roster = [[XMPPRoster alloc] initWithConnection: connection];
+
+		start = now();
+		[roster xmpp_handleInitialRosterForConnection: connection
+							   IQ: result];
+		duration = now() - start;
+
+		report([OFString stringWithFormat:
+		    @"Initial roster load of %zu items", sizes[i]], duration,
+		    [OFString stringWithFormat: @"%.2f us per item, "
+		    @"including the save", duration * 1e6 / sizes[i]]);
+
+		[roster release];
+		[connection release];
+
+		objc_autoreleasePoolPop(pool2);
+	}
+
+	[fileManager removeItemAtPath: directory];
+
+	objc_autoreleasePoolPop(pool);
+}
+
+/* Returns a roster push that renames the specified contact. */
+static XMPPIQ *
+rosterPush(size_t number, size_t version)
+{
+	XMPPIQ *IQ = [XMPPIQ IQWithType: @"set"
+				     ID: [OFString stringWithFormat:
+					     @"push%zu", version]];
+	OFXMLElement *query = [OFXMLElement elementWithName: @"query"
+						  namespace: XMPPRosterNS];
+	OFXMLElement *item = [OFXMLElement elementWithName: @"item"
+						 namespace: XMPPRosterNS];
+
+	[item addAttributeWithName: @"jid"
+		       stringValue: [OFString stringWithFormat:
+					@"contact%zu@example.com", number]];
+	[item addAttributeWithName: @"name"
+		       stringValue: [OFString stringWithFormat:
+					@"Renamed %06zu", number]];
+	[item addAttributeWithName: @"subscription" stringValue: @"both"];
+	[query addAttributeWithName: @"ver"
+			stringValue: [OFString stringWithFormat:
+					 @"%zu", version]];
+	[query addChild: item];
+	[IQ addChild: query];
+
+	return IQ;
+}
+
+static void
+benchmarkRosterPushStorm(void)
+{
+	void *pool = objc_autoreleasePoolPush();
+	OFFileManager *fileManager = [OFFileManager defaultManager];
+	OFString *directory = createTemporaryDirectory(@"storm");
+	const size_t count = 10000, pushes = 200;
+
+	for (int asynchronous = 0; asynchronous <= 1; asynchronous++) {
+		void *pool2 = objc_autoreleasePoolPush();
+		OFString *file = [directory
+		    stringByAppendingPathComponent: [OFString
+		    stringWithFormat: @"storm-%d.binarypack", asynchronous]];
+		XMPPFileStorage *storage = [[[XMPPFileStorage alloc]
+		    initWithFile: file] autorelease];
+		VersionedConnection *connection =
+		    [[VersionedConnection alloc] init];
+		RosterPushStorm *storm =
+		    [[[RosterPushStorm alloc] init] autorelease];
+		XMPPRoster *roster;
+		OFTimeInterval start, duration;
+
+		connection.dataStorage = storage;
+		roster = [[XMPPRoster alloc] initWithConnection: connection];
+		[roster
+		    xmpp_handleInitialRosterForConnection: connection
+						       IQ: rosterResult(count)];
+
+		/* Short enough to also write during the storm. */
+		storage.saveDelay = 0.02;
+		storage.savesAsynchronously = asynchronous;
+
+		storm->_connection = connection;
+		storm->_roster = roster;
+		storm->_remaining = pushes;
+		storm->_interval = 0.001;
+
+		[storm schedule];
+		while (storm->_remaining > 0)
+			[[OFRunLoop currentRunLoop] runUntilDate:
+			    [OFDate dateWithTimeIntervalSinceNow: 0.001]];
+
+		report([OFString stringWithFormat:
+		    @"Run loop stall with %@ saves during roster pushes",
+		    (asynchronous ? @"asynchronous" : @"synchronous")],
+		    storm->_totalStall, [OFString stringWithFormat:
+		    @"%zu pushes at %zu roster items, %.3f ms average, "
+		    @"%.3f ms maximum", pushes, count,
+		    storm->_totalStall * 1000 / pushes,
+		    storm->_maxStall * 1000]);
+
+		start = now();
+		[storage flushSynchronously];
+		duration = now() - start;
+		report([OFString stringWithFormat:
+		    @"Flush after %@ saves",
+		    (asynchronous ? @"asynchronous" : @"synchronous")],
+		    duration, @"pending save written on the caller's thread");
+
+		[roster release];
+		[connection release];
+
+		objc_autoreleasePoolPop(pool2);
+	}
+
+	[fileManager removeItemAtPath: directory];
+
+	objc_autoreleasePoolPop(pool);
+}
+
+static void
+benchmarkDirectTLS(void)
+{
+	void *pool = objc_autoreleasePoolPush();
+	const size_t connections = 10;
+	const OFTimeInterval roundTripTime = 0.05;
+
+	/*
+	 * The TLS handshake itself is the same for both, so only the time
+	 * until it starts is measured.
+	 */
+	for (int directTLS = 0; directTLS <= 1; directTLS++) {
+		OFTimeInterval total = 0;
+
+		for (size_t i = 0; i < connections; i++) {
+			void *pool2 = objc_autoreleasePoolPush();
+			ScriptedServer *server =
+			    [[[ScriptedServer alloc] init] autorelease];
+			XMPPConnection *connection =
+			    [[[XMPPConnection alloc] init] autorelease];
+			TLSUpgradeObserver *observer =
+			    [[[TLSUpgradeObserver alloc] init] autorelease];
+			OFTimeInterval start, deadline;
+
+			server->_roundTripTime = roundTripTime;
+			connection.domain = @"example.com";
+			connection.server = @"127.0.0.1";
+			connection.port = server->_port;
+			connection.usesDirectTLS = directTLS;
+			[connection addDelegate: observer];
+
+			start = now();
+			deadline = start + 5;
+			[connection asyncConnect];
+			while (observer->_upgradeTime == 0 && now() < deadline)
+				[[OFRunLoop currentRunLoop] runUntilDate:
+				    [OFDate dateWithTimeIntervalSinceNow:
+				    0.001]];
+			total += observer->_upgradeTime - start;
+
+			[connection removeDelegate: observer];
+			[connection close];
+			[server stop];
+
+			objc_autoreleasePoolPop(pool2);
+		}
+
+		report(directTLS ? @"Connect with direct TLS"
+				 : @"Connect with STARTTLS", total,
+		    [OFString stringWithFormat:
+		    @"%zu connections, %.0f ms round trip time, "
+		    @"%.1f ms until TLS per connection", connections,
+		    roundTripTime * 1000, total * 1000 / connections]);
+	}
+
+	objc_autoreleasePoolPop(pool);
+}
+
+@implementation Benchmark
+- (void)applicationDidFinishLaunching: (OFNotification *)notification
+{
+	benchmarkReadBuffer();
+	benchmarkSerializer();
+	benchmarkJIDCache();
+	benchmarkPresenceSort();
+	benchmarkDispatch();
+	benchmarkBroadcast();
+	benchmarkRosterLookups();
+	benchmarkRosterReconciliation();
+	benchmarkStorageSaves();
+	benchmarkInitialRosterLoad();
+	benchmarkRosterPushStorm();
+	benchmarkDirectTLS();
+
+	[OFApplication terminate];
+}
+@end
+
+@implementation ReplayConnection
+- (size_t)replayData: (OFData *)data
+{
+	const char *items = data.items;
+	size_t length = data.count, reads = 0;
+
+	[self xmpp_startStream];
+	/* Only allocates the buffer, as there is no stream to read from. */
+	[self xmpp_asyncRead];
+
+	while (length > 0) {
+		/* Each read returns as much as fits into the buffer. */
+		size_t readLength =
+		    (length < _bufferLength ? length : _bufferLength);
+
+		[self parseBuffer: items length: readLength];
+		[self xmpp_adaptReadBufferToLength: readLength];
+
+		items += readLength;
+		length -= readLength;
+		reads++;
+	}
+
+	return reads;
+}
+@end
+
+@implementation MessageCounter
+-  (void)connection: (XMPPConnection *)connection
+  didReceiveMessage: (XMPPMessage *)message
+{
+	messages++;
+}
+@end
+
+@implementation BroadcastReceiver
+- (bool)receiveObject: (id)object
+{
+	received++;
+
+	return false;
+}
+@end
+
+@implementation ScriptedServer
+- (instancetype)init
+{
+	self = [super init];
+
+	@try {
+		OFSocketAddress address;
+
+		_socket = [[OFTCPSocket alloc] init];
+		_socket.delegate = self;
+		address = [_socket bindToHost: @"127.0.0.1" port: 0];
+		_port = OFSocketAddressIPPort(&address);
+		[_socket listen];
+		[_socket asyncAccept];
+	} @catch (id e) {
+		[self release];
+		@throw e;
+	}
+
+	return self;
+}
+
+- (void)dealloc
+{
+	[self stop];
+
+	[_socket release];
+	[_client release];
+
+	[super dealloc];
+}
+
+- (void)stop
+{
+	[_client cancelAsyncRequests];
+	[_client close];
+	[_client release];
+	_client = nil;
+
+	if (_socket.delegate != nil) {
+		_socket.delegate = nil;
+		[_socket cancelAsyncRequests];
+		[_socket close];
+	}
+}
+
+-    (bool)socket: (OFStreamSocket *)sock
+  didAcceptSocket: (OFStreamSocket *)acceptedSocket
+	exception: (id)exception
+{
+	if (exception != nil)
+		return false;
+
+	_client = [acceptedSocket retain];
+	_client.delegate = self;
+	[_client asyncReadIntoBuffer: _buffer length: sizeof(_buffer)];
+
+	return false;
+}
+
+-      (bool)stream: (OFStream *)stream
+  didReadIntoBuffer: (void *)buffer
+	     length: (size_t)length
+	  exception: (id)exception
+{
+	OFString *string;
+	OFString *response = nil;
+
+	if (exception != nil || length == 0)
+		return false;
+
+	/* The TLS handshake is binary and not valid UTF-8. */
+	string = [OFString stringWithCString: buffer
+				    encoding: OFStringEncodingISO8859_1
+				      length: length];
+
+	if ([string containsString: @"<stream:stream"])
+		response = @"<stream:stream xmlns='jabber:client' "
+		    @"xmlns:stream='http://etherx.jabber.org/streams' "
+		    @"version='1.0'><stream:features>"
+		    @"<starttls xmlns='urn:ietf:params:xml:ns:xmpp-tls'/>"
+		    @"</stream:features>";
+	else if ([string containsString: @"<starttls"])
+		response =
+		    @"<proceed xmlns='urn:ietf:params:xml:ns:xmpp-tls'/>";
+
+	if (response != nil)
+		[OFTimer scheduledTimerWithTimeInterval: _roundTripTime
+						 target: self
+					       selector: @selector(sendString:)
+						 object: response
+						repeats: false];
+
+	return true;
+}
+
+- (void)sendString: (OFString *)string
+{
+	[_client writeString: string];
+}
+@end
+
+@implementation TLSUpgradeObserver
+- (void)connectionWillUpgradeToTLS: (XMPPConnection *)connection
+{
+	_upgradeTime = now();
+}
+@end
+
+@implementation ContactEventCounter
+- (void)contactManager: (XMPPContactManager *)manager
+	 didAddContact: (XMPPContact *)contact
+{
+	_added++;
+}
+
+- (void)contactManager: (XMPPContactManager *)manager
+      didRemoveContact: (XMPPContact *)contact
+{
+	_removed++;
+}
+
+-	     (void)contact: (XMPPContact *)contact
+  willUpdateWithRosterItem: (XMPPRosterItem *)rosterItem
+{
+	_updated++;
+}
+@end
+
+@implementation VersionedConnection
+- (bool)supportsRosterVersioning
+{
+	return true;
+}
+
+- (void)sendStanza: (OFXMLElement *)element
+{
+}
+@end
+
+@implementation RosterPushStorm
+- (void)schedule
+{
+	_scheduledAt = now();
+	[OFTimer scheduledTimerWithTimeInterval: _interval
+					 target: self
+				       selector: @selector(push)
+					repeats: false];
+}
+
+- (void)push
+{
+	void *pool = objc_autoreleasePoolPush();
+	OFTimeInterval start = now();
+	OFTimeInterval stall = start - _scheduledAt - _interval;
+
+	if (stall < 0)
+		stall = 0;
+
+	[_roster connection: _connection
+		   handleIQ: rosterPush(_remaining, _remaining)];
+
+	stall += now() - start;
+	_totalStall += stall;
+	if (stall > _maxStall)
+		_maxStall = stall;
+
+	objc_autoreleasePoolPop(pool);
+
+	if (--_remaining > 0)
+		[self schedule];
+}
+@end
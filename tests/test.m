@@ -22,20 +22,35 @@
  */
 
 #include <assert.h>
+#include <stdlib.h>
+
+#include <stringprep.h>
+#include <idna.h>
 
 #import <ObjFW/ObjFW.h>
 
 #import "XMPPConnection.h"
+#import "XMPPContact.h"
+#import "XMPPContact+Private.h"
+#import "XMPPContactManager.h"
 #import "XMPPDiscoEntity.h"
 #import "XMPPDiscoIdentity.h"
 #import "XMPPJID.h"
+#import "XMPPJIDCache.h"
 #import "XMPPStanza.h"
 #import "XMPPIQ.h"
 #import "XMPPMessage.h"
 #import "XMPPPresence.h"
 #import "XMPPRoster.h"
+#import "XMPPRosterItem.h"
 #import "XMPPStreamManagement.h"
+#import "namespaces.h"
+#import "XMPPStringPrep.h"
 #import "XMPPFileStorage.h"
+#import "XMPPJournalStorage.h"
+#import "XMPPStoragePath.h"
+#import "XMPPXMLElementBuilder.h"
+#import "XMPPXMLSerializer.h"
 
 @interface AppDelegate: OFObject
     <OFApplicationDelegate, XMPPConnectionDelegate, XMPPRosterDelegate>
@@ -45,13 +60,1181 @@
 }
 @end
 
+@interface StreamingTest: OFObject <XMPPXMLElementBuilderDelegate>
+{
+@public
+	OFXMLElement *stanza;
+	size_t streamedChildren;
+}
+@end
+
+@interface PresenceBatchTest: OFObject <XMPPContactManagerDelegate>
+{
+@public
+	size_t presences, batches;
+	OFSet *contacts;
+}
+@end
+
+@interface RosterResetTest: OFObject <XMPPContactManagerDelegate>
+{
+@public
+	OFMutableArray *removedJIDs;
+}
+@end
+
+@interface IQCallbackTest: OFObject
+{
+@public
+	OFMutableArray *responses;
+}
+@end
+
+/* Answers SRV queries with fixed records instead of asking a server. */
+@interface StubResolver: OFDNSResolver
+{
+@public
+	OFArray OF_GENERIC(OFSRVDNSResourceRecord *) *records;
+}
+@end
+
+/* A local server that records what the connection sends. */
+@interface TestListener: OFObject <OFTCPSocketDelegate>
+{
+@public
+	OFTCPSocket *socket;
+	uint16_t port;
+	OFMutableArray *acceptedSockets;
+	OFMutableData *received;
+	size_t closedSockets;
+	char buffer[512];
+}
+- (void)stop;
+@end
+
+@interface XMPPConnection (Private)
+- (void)xmpp_asyncRead;
+- (bool)xmpp_adaptReadBufferToLength: (size_t)length;
+- (void)xmpp_handleIQ: (XMPPIQ *)IQ;
+@end
+
+@interface XMPPRoster (Private)
+- (void)xmpp_handleInitialRosterForConnection: (XMPPConnection *)connection
+					   IQ: (XMPPIQ *)IQ;
+@end
+
+/* A connection that is never connected and only records sent stanzas. */
+@interface OfflineConnection: XMPPConnection
+{
+@public
+	OFMutableArray *sentStanzas;
+}
+@end
+
+@interface StreamManagementTest: OFObject <XMPPStreamManagementDelegate>
+{
+@public
+	OFMutableArray *confirmedIDs;
+	size_t confirmations;
+	OFArray *failedStanzas;
+}
+@end
+
 OF_APPLICATION_DELEGATE(AppDelegate)
 
+static OFString *
+serialize(OFXMLElement *element)
+{
+	OFMutableData *data = [OFMutableData data];
+
+	[XMPPXMLSerializer appendElement: element toData: data];
+
+	return [OFString stringWithUTF8String: data.items length: data.count];
+}
+
+/* Compares the ASCII fast path with libidn. */
+static void
+checkStringPrep(OFString *string)
+{
+	static const char *const names[] = {
+		"Nodeprep", "Nameprep", "Resourceprep", "SASLprep"
+	};
+	char *out;
+
+	for (size_t i = 0; i < sizeof(names) / sizeof(*names); i++) {
+		OFString *expected = nil, *prepared;
+
+		if (stringprep_profile(string.UTF8String, &out, names[i], 0) ==
+		    STRINGPREP_OK) {
+			expected = [OFString stringWithUTF8String: out];
+			free(out);
+		}
+
+		if (XMPPStringIsPrepared(string, (XMPPStringPrepProfile)i))
+			assert([expected isEqual: string]);
+
+		prepared = XMPPStringPrep(string, (XMPPStringPrepProfile)i);
+		assert(prepared == expected || [prepared isEqual: expected]);
+	}
+
+	if (idna_to_ascii_8z(string.UTF8String, &out,
+	    IDNA_USE_STD3_ASCII_RULES) == IDNA_SUCCESS) {
+		assert([XMPPIDNAToASCII(string) isEqual:
+		    [OFString stringWithUTF8String: out]]);
+		free(out);
+	} else
+		assert(!XMPPDomainIsASCII(string) &&
+		    XMPPIDNAToASCII(string) == nil);
+}
+
+static void
+testStringPrep(void)
+{
+	void *pool = objc_autoreleasePoolPush();
+	OFString *corpus[] = {
+		@"", @"romeo", @"Romeo", @"montague.lit", @"Montague.LIT",
+		@"orchard", @"Orchard Balcony", @"a b", @"a@b", @"a/b",
+		@"a:b", @"a<b>", @"a&b", @"a'b", @"a\"b", @"ex-ample.com",
+		@"-example.com", @"example-.com", @"example..com", @".com",
+		@"example.com.", @"xn--bcher-kva.example", @"b\u00FCcher",
+		@"B\u00FCcher.example", @"\u00DF", @"caf\u00E9",
+		@"\u2163", @"\uFB01", @"\u3002", @"a\u00A0b",
+		@"\u05D0\u05D1", @"a\u05D0", @"under_score.example",
+		@"0123456789012345678901234567890123456789012345678901234567890"
+		@"12.example",
+		@"0123456789012345678901234567890123456789012345678901234567890"
+		@"123.example"
+	};
+
+	for (size_t i = 0; i < sizeof(corpus) / sizeof(*corpus); i++)
+		checkStringPrep(corpus[i]);
+
+	/* Every ASCII character on its own and inside a string. */
+	for (int c = 1; c < 128; c++) {
+		checkStringPrep([OFString stringWithFormat: @"%c", c]);
+		checkStringPrep([OFString stringWithFormat: @"ab%ccd.ef", c]);
+	}
+
+	objc_autoreleasePoolPop(pool);
+}
+
+static void
+testStreamingBuilder(void)
+{
+	void *pool = objc_autoreleasePoolPush();
+	OFXMLParser *parser = [OFXMLParser parser];
+	XMPPXMLElementBuilder *builder =
+	    [[[XMPPXMLElementBuilder alloc] init] autorelease];
+	StreamingTest *test = [[[StreamingTest alloc] init] autorelease];
+
+	builder.delegate = test;
+	parser.delegate = builder;
+	[parser parseString: @"<iq xmlns='jabber:client' type='result' id='1'>"
+	    @"<query xmlns='jabber:iq:roster' ver='2'>"
+	    @"<item jid='a@example.com'><group>A</group></item>"
+	    @"<item jid='b@example.com'/></query></iq>"];
+
+	assert(test->streamedChildren == 2);
+	assert([test->stanza elementForName: @"query"
+				  namespace: @"jabber:iq:roster"]
+	    .children.count == 0);
+	assert([[[test->stanza elementForName: @"query"
+				    namespace: @"jabber:iq:roster"]
+	    attributeForName: @"ver"].stringValue isEqual: @"2"]);
+
+	/* Whitespace between the streamed children is dropped. */
+	parser = [OFXMLParser parser];
+	builder = [[[XMPPXMLElementBuilder alloc] init] autorelease];
+	test = [[[StreamingTest alloc] init] autorelease];
+	builder.delegate = test;
+	parser.delegate = builder;
+	[parser parseString:
+	    @"<iq xmlns='jabber:client' type='result' id='1'>\n"
+	    @"  <query xmlns='jabber:iq:roster' ver='2'>\n"
+	    @"    <item jid='a@example.com'>\n"
+	    @"      <group>A</group>\n"
+	    @"    </item>\n"
+	    @"    <item jid='b@example.com'/>\n"
+	    @"  </query>\n"
+	    @"</iq>"];
+
+	assert(test->streamedChildren == 2);
+	assert([test->stanza elementForName: @"query"
+				  namespace: @"jabber:iq:roster"]
+	    .children.count == 0);
+
+	objc_autoreleasePoolPop(pool);
+}
+
+static void
+testContactPresences(void)
+{
+	void *pool = objc_autoreleasePoolPush();
+	XMPPContact *contact = [[[XMPPContact alloc] init] autorelease];
+	XMPPRosterItem *rosterItem = [XMPPRosterItem rosterItem];
+	XMPPPresence *phone = [XMPPPresence presence];
+	XMPPPresence *desktop = [XMPPPresence presence];
+	XMPPPresence *laptop = [XMPPPresence presence];
+
+	rosterItem.JID = [XMPPJID JIDWithString: @"juliet@capulet.lit"];
+	contact.rosterItem = rosterItem;
+	assert(contact.highestPriorityPresence == nil);
+	assert([contact.routingJID isEqual: rosterItem.JID]);
+
+	phone.from = [XMPPJID JIDWithString: @"juliet@capulet.lit/phone"];
+	phone.priority = [OFNumber numberWithChar: -1];
+	[contact xmpp_setPresence: phone resource: @"phone"];
+	assert(contact.highestPriorityPresence == phone);
+	assert([contact.routingJID isEqual: rosterItem.JID]);
+
+	desktop.from = [XMPPJID JIDWithString: @"juliet@capulet.lit/desktop"];
+	desktop.show = @"away";
+	[contact xmpp_setPresence: desktop resource: @"desktop"];
+	laptop.from = [XMPPJID JIDWithString: @"juliet@capulet.lit/laptop"];
+	[contact xmpp_setPresence: laptop resource: @"laptop"];
+	assert(contact.highestPriorityPresence == laptop);
+	assert([contact.routingJID isEqual: laptop.from]);
+
+	[contact xmpp_removePresenceForResource: @"laptop"];
+	assert(contact.highestPriorityPresence == desktop);
+	[contact xmpp_removePresenceForResource: nil];
+	assert(contact.highestPriorityPresence == nil);
+	assert(contact.presences.count == 0);
+
+	objc_autoreleasePoolPop(pool);
+}
+
+static void
+testPresenceBatching(void)
+{
+	void *pool = objc_autoreleasePoolPush();
+	XMPPConnection *connection = [[XMPPConnection alloc] init];
+	XMPPRoster *roster =
+	    [[XMPPRoster alloc] initWithConnection: connection];
+	XMPPContactManager *manager = [[XMPPContactManager alloc]
+	    initWithConnection: connection
+			roster: roster];
+	PresenceBatchTest *test =
+	    [[[PresenceBatchTest alloc] init] autorelease];
+	XMPPRosterItem *rosterItem = [XMPPRosterItem rosterItem];
+	XMPPContact *contact;
+	XMPPPresence *presence;
+
+	rosterItem.JID = [XMPPJID JIDWithString: @"juliet@capulet.lit"];
+	rosterItem.subscription = @"both";
+	[manager roster: roster didReceiveRosterItem: rosterItem];
+	contact = [manager.contacts objectForKey: @"juliet@capulet.lit"];
+	[manager addDelegate: test];
+	manager.batchesPresenceUpdates = true;
+
+	for (int i = 0; i < 3; i++) {
+		presence = [XMPPPresence presence];
+		presence.from =
+		    [XMPPJID JIDWithString: @"juliet@capulet.lit/balcony"];
+		presence.priority = [OFNumber numberWithInt: i];
+		[manager connection: connection didReceivePresence: presence];
+	}
+
+	assert(test->presences == 0 && test->batches == 0);
+	assert(contact.highestPriorityPresence == presence);
+
+	[manager flushPresenceUpdates];
+	assert(test->presences == 0 && test->batches == 1);
+	assert(test->contacts.count == 1 &&
+	    [test->contacts containsObject: contact]);
+	assert(contact.presences.count == 1);
+
+	[manager flushPresenceUpdates];
+	assert(test->batches == 1);
+
+	/* Without an explicit flush, the timer delivers the batch. */
+	manager.presenceBatchInterval = 0.01;
+	[manager connection: connection didReceivePresence: presence];
+	assert(test->batches == 1);
+	[[OFRunLoop currentRunLoop] runUntilDate:
+	    [OFDate dateWithTimeIntervalSinceNow: 0.1]];
+	assert(test->presences == 0 && test->batches == 2);
+	assert(test->contacts.count == 1 &&
+	    [test->contacts containsObject: contact]);
+
+	manager.batchesPresenceUpdates = false;
+	[manager connection: connection didReceivePresence: presence];
+	assert(test->presences == 1 && test->batches == 1);
+
+	[manager removeDelegate: test];
+	[manager release];
+	[roster release];
+	[connection release];
+
+	objc_autoreleasePoolPop(pool);
+}
+
+static void
+testReadBuffer(void)
+{
+	void *pool = objc_autoreleasePoolPush();
+	XMPPConnection *connection = [[XMPPConnection alloc] init];
+
+	connection.readBufferSize = 512;
+	connection.maximumReadBufferSize = 4096;
+
+	/* Only allocates the buffer, as there is no stream to read from. */
+	[connection xmpp_asyncRead];
+
+	/*
+	 * The buffer only grows if a read filled it completely, so a resize
+	 * for a full read shows the current size.
+	 */
+	assert([connection xmpp_adaptReadBufferToLength: 512]);
+	assert([connection xmpp_adaptReadBufferToLength: 1024]);
+	assert(![connection xmpp_adaptReadBufferToLength: 1024]);
+	assert([connection xmpp_adaptReadBufferToLength: 2048]);
+	assert(![connection xmpp_adaptReadBufferToLength: 4096]);
+
+	/* Only several short reads in a row shrink it. */
+	for (int i = 0; i < 7; i++)
+		assert(![connection xmpp_adaptReadBufferToLength: 100]);
+	assert(![connection xmpp_adaptReadBufferToLength: 2000]);
+	for (int i = 0; i < 7; i++)
+		assert(![connection xmpp_adaptReadBufferToLength: 100]);
+	assert([connection xmpp_adaptReadBufferToLength: 100]);
+	assert(![connection xmpp_adaptReadBufferToLength: 4096]);
+	assert([connection xmpp_adaptReadBufferToLength: 2048]);
+
+	/* It never shrinks below readBufferSize. */
+	for (int i = 0; i < 3 * 8; i++)
+		[connection xmpp_adaptReadBufferToLength: 1];
+	for (int i = 0; i < 8; i++)
+		assert(![connection xmpp_adaptReadBufferToLength: 1]);
+	assert([connection xmpp_adaptReadBufferToLength: 512]);
+
+	[connection release];
+
+	objc_autoreleasePoolPop(pool);
+}
+
+static void
+sendIQs(XMPPConnection *connection, IQCallbackTest *test, OFString *const *IDs,
+    size_t count, OFTimeInterval timeout)
+{
+	for (size_t i = 0; i < count; i++)
+		[connection sendIQ: [XMPPIQ IQWithType: @"get" ID: IDs[i]]
+		    callbackTarget: test
+			  selector: @selector(connection:
+					didReceiveResponse:)
+			   timeout: timeout];
+}
+
+static bool
+responsesAre(IQCallbackTest *test, OFString *type, OFString *condition,
+    OFString *const *IDs, size_t count)
+{
+	if (test->responses.count != count)
+		return false;
+
+	for (size_t i = 0; i < count; i++) {
+		XMPPIQ *response = [test->responses objectAtIndex: i];
+		OFXMLElement *error = [response elementForName: @"error"
+						     namespace: XMPPClientNS];
+
+		if (![response.ID isEqual: IDs[i]] ||
+		    ![response.type isEqual: type])
+			return false;
+
+		if (condition != nil &&
+		    [error elementForName: condition
+				namespace: XMPPStanzasNS] == nil)
+			return false;
+	}
+
+	[test->responses removeAllObjects];
+
+	return true;
+}
+
+static void
+testPendingIQs(void)
+{
+	void *pool = objc_autoreleasePoolPush();
+	OfflineConnection *connection = [[OfflineConnection alloc] init];
+	IQCallbackTest *test = [[[IQCallbackTest alloc] init] autorelease];
+	OFString *generatedID = [connection generateStanzaID];
+	unsigned long long lastID =
+	    [generatedID substringFromIndex: 8].unsignedLongLongValue;
+	OFString *foreignID, *collidingID, *IDs[3];
+
+	/*
+	 * A foreign ID is mapped to the next number. An ID made up by the
+	 * caller that uses the same number must not replace it.
+	 */
+	foreignID = @"foreign";
+	collidingID = [OFString stringWithFormat: @"objxmpp_%llu", lastID + 1];
+	IDs[0] = foreignID;
+	IDs[1] = collidingID;
+	sendIQs(connection, test, IDs, 2, 0);
+	IDs[0] = collidingID;
+	IDs[1] = foreignID;
+	[connection xmpp_handleIQ: [XMPPIQ IQWithType: @"result" ID: IDs[0]]];
+	[connection xmpp_handleIQ: [XMPPIQ IQWithType: @"result" ID: IDs[1]]];
+	assert(responsesAre(test, @"result", nil, IDs, 2));
+
+	/* The oldest IQ fails if there are too many. */
+	connection.maximumPendingIQs = 2;
+	IDs[0] = @"a";
+	IDs[1] = @"b";
+	IDs[2] = @"c";
+	sendIQs(connection, test, IDs, 3, 0);
+	assert(responsesAre(test, @"error", @"resource-constraint", IDs, 1));
+
+	/* Closing the connection fails the remaining IQs in order. */
+	[connection close];
+	assert(responsesAre(test, @"error", @"recipient-unavailable",
+	    IDs + 1, 2));
+
+	/* IQs without a response time out, others don't. */
+	IDs[0] = @"timeout";
+	IDs[1] = @"no-timeout";
+	sendIQs(connection, test, IDs, 1, 0.01);
+	sendIQs(connection, test, IDs + 1, 1, 0);
+	[[OFRunLoop currentRunLoop] runUntilDate:
+	    [OFDate dateWithTimeIntervalSinceNow: 1.5]];
+	assert(responsesAre(test, @"error", @"remote-server-timeout", IDs, 1));
+
+	[connection cancelCallbackForIQWithID: @"no-timeout"];
+	[connection release];
+
+	objc_autoreleasePoolPop(pool);
+}
+
+static OFSRVDNSResourceRecord *
+SRVRecord(uint16_t priority, uint16_t weight, uint16_t port)
+{
+	return [[[OFSRVDNSResourceRecord alloc]
+	    initWithName: @"_xmpp-client._tcp.example.com"
+		DNSClass: OFDNSClassIN
+		priority: priority
+		  weight: weight
+		  target: @"127.0.0.1"
+		    port: port
+		     TTL: 60] autorelease];
+}
+
+static void
+connectWithSRVRecords(OFArray *records, OFTimeInterval attemptDelay)
+{
+	void *pool = objc_autoreleasePoolPush();
+	XMPPConnection *connection = [[XMPPConnection alloc] init];
+	StubResolver *resolver = [[[StubResolver alloc] init] autorelease];
+
+	resolver->records = [records retain];
+	connection.domain = @"example.com";
+	connection.DNSResolver = resolver;
+	connection.connectionAttemptDelay = attemptDelay;
+	[connection asyncConnect];
+
+	[[OFRunLoop currentRunLoop] runUntilDate:
+	    [OFDate dateWithTimeIntervalSinceNow: 0.5]];
+
+	[connection close];
+	[connection release];
+
+	objc_autoreleasePoolPop(pool);
+}
+
+static void
+testConnectionAttempts(void)
+{
+	void *pool = objc_autoreleasePoolPush();
+	TestListener *first, *second, *refused;
+
+	/* Lower priorities are tried first, regardless of the order. */
+	first = [[[TestListener alloc] init] autorelease];
+	second = [[[TestListener alloc] init] autorelease];
+	connectWithSRVRecords([OFArray arrayWithObjects:
+	    SRVRecord(10, 0, second->port), SRVRecord(5, 0, first->port), nil],
+	    10);
+	assert(first->received.count > 0);
+	assert(second->acceptedSockets.count == 0);
+	[first stop];
+	[second stop];
+
+	/*
+	 * Within a priority, the record with weight 0 only comes first with
+	 * a chance of 1 in 65536.
+	 */
+	first = [[[TestListener alloc] init] autorelease];
+	second = [[[TestListener alloc] init] autorelease];
+	connectWithSRVRecords([OFArray arrayWithObjects:
+	    SRVRecord(0, 0, second->port), SRVRecord(0, 65535, first->port),
+	    nil], 10);
+	assert(first->received.count > 0);
+	assert(second->acceptedSockets.count == 0);
+	[first stop];
+	[second stop];
+
+	/* A failed attempt does not wait for the delay. */
+	refused = [[[TestListener alloc] init] autorelease];
+	[refused stop];
+	first = [[[TestListener alloc] init] autorelease];
+	connectWithSRVRecords([OFArray arrayWithObjects:
+	    SRVRecord(0, 0, refused->port), SRVRecord(1, 0, first->port), nil],
+	    10);
+	assert(first->received.count > 0);
+	[first stop];
+
+	/*
+	 * Without a delay, both attempts race. Only the winner is used and
+	 * the other one is closed once it connected.
+	 */
+	first = [[[TestListener alloc] init] autorelease];
+	second = [[[TestListener alloc] init] autorelease];
+	connectWithSRVRecords([OFArray arrayWithObjects:
+	    SRVRecord(0, 0, first->port), SRVRecord(1, 0, second->port), nil],
+	    0);
+	assert((first->received.count > 0) != (second->received.count > 0));
+	if (first->received.count > 0)
+		assert(second->acceptedSockets.count ==
+		    second->closedSockets);
+	else
+		assert(first->acceptedSockets.count == first->closedSockets);
+	[first stop];
+	[second stop];
+
+	objc_autoreleasePoolPop(pool);
+}
+
+static XMPPIQ *
+rosterResult(OFArray *JIDs)
+{
+	XMPPIQ *IQ = [XMPPIQ IQWithType: @"result" ID: @"roster"];
+	OFXMLElement *query = [OFXMLElement elementWithName: @"query"
+						  namespace: XMPPRosterNS];
+
+	for (OFString *JID in JIDs) {
+		OFXMLElement *item =
+		    [OFXMLElement elementWithName: @"item"
+					namespace: XMPPRosterNS];
+
+		[item addAttributeWithName: @"jid" stringValue: JID];
+		[item addAttributeWithName: @"subscription"
+			       stringValue: @"both"];
+		[item addChild: [OFXMLElement elementWithName: @"group"
+						    namespace: XMPPRosterNS
+						  stringValue: @"Friends"]];
+		[query addChild: item];
+	}
+
+	[IQ addChild: query];
+
+	return IQ;
+}
+
+static void
+testRosterReset(void)
+{
+	void *pool = objc_autoreleasePoolPush();
+	OfflineConnection *connection = [[OfflineConnection alloc] init];
+	XMPPRoster *roster =
+	    [[XMPPRoster alloc] initWithConnection: connection];
+	XMPPContactManager *manager = [[XMPPContactManager alloc]
+	    initWithConnection: connection
+			roster: roster];
+	RosterResetTest *test = [[[RosterResetTest alloc] init] autorelease];
+
+	[manager addDelegate: test];
+
+	[roster xmpp_handleInitialRosterForConnection: connection
+						   IQ: rosterResult([OFArray
+	    arrayWithObjects: @"romeo@montague.lit", @"juliet@capulet.lit",
+	    @"nurse@capulet.lit", nil])];
+	assert(roster.rosterItems.count == 3);
+	assert(manager.contacts.count == 3);
+	assert(test->removedJIDs.count == 0);
+
+	/* Reconnecting with a smaller roster removes the missing contacts. */
+	[roster xmpp_handleInitialRosterForConnection: connection
+						   IQ: rosterResult([OFArray
+	    arrayWithObject: @"juliet@capulet.lit"])];
+	assert(roster.rosterItems.count == 1);
+	assert([roster rosterItemsInGroup: @"Friends"].count == 1);
+	assert([roster rosterItemsWithNamePrefix: @""].count == 1);
+	assert(manager.contacts.count == 1);
+	assert(test->removedJIDs.count == 2);
+	assert([test->removedJIDs containsObject: @"romeo@montague.lit"]);
+	assert([test->removedJIDs containsObject: @"nurse@capulet.lit"]);
+
+	[manager removeDelegate: test];
+	[manager release];
+	[roster release];
+	[connection release];
+
+	objc_autoreleasePoolPop(pool);
+}
+
+static OFXMLElement *
+rosterItemElement(OFString *JID, OFString *name, OFString *group,
+    OFString *subscription)
+{
+	OFXMLElement *item = [OFXMLElement elementWithName: @"item"
+						 namespace: XMPPRosterNS];
+
+	[item addAttributeWithName: @"jid" stringValue: JID];
+	if (name != nil)
+		[item addAttributeWithName: @"name" stringValue: name];
+	[item addAttributeWithName: @"subscription" stringValue: subscription];
+	if (group != nil)
+		[item addChild: [OFXMLElement elementWithName: @"group"
+						    namespace: XMPPRosterNS
+						  stringValue: group]];
+
+	return item;
+}
+
+static void
+pushRosterItem(XMPPRoster *roster, XMPPConnection *connection,
+    OFXMLElement *item)
+{
+	XMPPIQ *IQ = [XMPPIQ IQWithType: @"set" ID: @"push"];
+	OFXMLElement *query = [OFXMLElement elementWithName: @"query"
+						  namespace: XMPPRosterNS];
+
+	[query addChild: item];
+	[IQ addChild: query];
+
+	assert([roster connection: connection handleIQ: IQ]);
+}
+
+/* The names of the roster items, or the bare JID if they have no name. */
+static OFArray *
+rosterItemNames(OFArray *rosterItems)
+{
+	OFMutableArray *names = [OFMutableArray array];
+
+	for (XMPPRosterItem *rosterItem in rosterItems)
+		[names addObject: (rosterItem.name != nil
+		    ? rosterItem.name : rosterItem.JID.bareJID)];
+
+	return names;
+}
+
+static void
+testRosterIndexes(void)
+{
+	void *pool = objc_autoreleasePoolPush();
+	OfflineConnection *connection = [[OfflineConnection alloc] init];
+	XMPPRoster *roster =
+	    [[XMPPRoster alloc] initWithConnection: connection];
+	XMPPIQ *IQ = [XMPPIQ IQWithType: @"result" ID: @"roster"];
+	OFXMLElement *query = [OFXMLElement elementWithName: @"query"
+						  namespace: XMPPRosterNS];
+
+	/* Not in order, and one item is sent twice. */
+	[query addChild: rosterItemElement(@"romeo@montague.lit", @"Romeo",
+	    @"Montague", @"both")];
+	[query addChild: rosterItemElement(@"juliet@capulet.lit", @"Juliet",
+	    @"Capulet", @"both")];
+	[query addChild: rosterItemElement(@"tybalt@capulet.lit", @"Tybalt",
+	    @"Capulet", @"both")];
+	[query addChild: rosterItemElement(@"nurse@capulet.lit", nil, nil,
+	    @"to")];
+	[query addChild: rosterItemElement(@"benvolio@montague.lit",
+	    @"Benvolio", @"Montague", @"both")];
+	[query addChild: rosterItemElement(@"rosaline@capulet.lit",
+	    @"Rosaline", @"Capulet", @"from")];
+	[query addChild: rosterItemElement(@"juliet@capulet.lit", @"Jules",
+	    @"Capulet", @"both")];
+	[IQ addChild: query];
+
+	[roster xmpp_handleInitialRosterForConnection: connection IQ: IQ];
+	assert(roster.rosterItems.count == 6);
+	assert([rosterItemNames([roster rosterItemsWithNamePrefix: @""])
+	    isEqual: [OFArray arrayWithObjects: @"Benvolio", @"Jules",
+	    @"nurse@capulet.lit", @"Romeo", @"Rosaline", @"Tybalt", nil]]);
+	assert([rosterItemNames([roster rosterItemsWithNamePrefix: @"RO"])
+	    isEqual: [OFArray arrayWithObjects: @"Romeo", @"Rosaline", nil]]);
+	assert([roster rosterItemsWithNamePrefix: @"Juliet"].count == 0);
+	assert([roster rosterItemsWithNamePrefix: @"z"].count == 0);
+	assert(roster.groups.count == 2);
+	assert([roster rosterItemsInGroup: @"Capulet"].count == 3);
+	assert([roster rosterItemsInGroup: @"Montague"].count == 2);
+	assert([roster rosterItemsInGroup: @"Verona"].count == 0);
+
+	/* Pushes keep the indexes in order. */
+	pushRosterItem(roster, connection, rosterItemElement(
+	    @"mercutio@verona.lit", @"Mercutio", @"Montague", @"both"));
+	pushRosterItem(roster, connection, rosterItemElement(
+	    @"tybalt@capulet.lit", nil, nil, @"remove"));
+	pushRosterItem(roster, connection, rosterItemElement(
+	    @"nurse@capulet.lit", @"Angelica", @"Capulet", @"both"));
+	assert([rosterItemNames([roster rosterItemsWithNamePrefix: @""])
+	    isEqual: [OFArray arrayWithObjects: @"Angelica", @"Benvolio",
+	    @"Jules", @"Mercutio", @"Romeo", @"Rosaline", nil]]);
+	assert([rosterItemNames([roster rosterItemsWithNamePrefix: @"m"])
+	    isEqual: [OFArray arrayWithObject: @"Mercutio"]]);
+	assert([roster rosterItemsInGroup: @"Capulet"].count == 3);
+	assert([roster rosterItemsInGroup: @"Montague"].count == 3);
+
+	[roster release];
+	[connection release];
+
+	objc_autoreleasePoolPop(pool);
+}
+
+/*
+ * Requests the roster and streams the items of the result to the roster.
+ * Returns the rest of the result, which completes the roster.
+ */
+static XMPPIQ *
+streamRoster(XMPPRoster *roster, OfflineConnection *connection,
+    OFArray *JIDs)
+{
+	XMPPIQ *request, *result;
+	OFXMLElement *query = [OFXMLElement elementWithName: @"query"
+						  namespace: XMPPRosterNS];
+
+	[roster requestRoster];
+	request = connection->sentStanzas.lastObject;
+	result = [XMPPIQ IQWithType: @"result" ID: request.ID];
+
+	assert([roster	       connection: connection
+	    shouldStreamChildrenOfElement: query
+				 inStanza: result]);
+
+	for (OFString *JID in JIDs)
+		[roster	      connection: connection
+		  didReceiveChildElement: rosterItemElement(JID, nil,
+					      @"Friends", @"both")
+			       ofElement: query
+				inStanza: result];
+
+	[result addChild: query];
+
+	return result;
+}
+
+static void
+testRosterStreamingFailure(void)
+{
+	void *pool = objc_autoreleasePoolPush();
+	OfflineConnection *connection = [[OfflineConnection alloc] init];
+	XMPPRoster *roster =
+	    [[XMPPRoster alloc] initWithConnection: connection];
+	XMPPIQ *result;
+
+	[roster xmpp_handleInitialRosterForConnection: connection
+						   IQ: rosterResult([OFArray
+	    arrayWithObjects: @"romeo@montague.lit", @"juliet@capulet.lit",
+	    nil])];
+	assert(roster.rosterItems.count == 2);
+
+	/* The connection is lost while the roster is streamed. */
+	streamRoster(roster, connection, [OFArray arrayWithObjects:
+	    @"nurse@capulet.lit", @"tybalt@capulet.lit", nil]);
+	assert(roster.rosterItems.count == 2);
+	[connection close];
+
+	/* The previous roster is kept as it was. */
+	assert(roster.rosterItems.count == 2);
+	assert([roster.rosterItems objectForKey: @"romeo@montague.lit"] != nil);
+	assert([roster.rosterItems objectForKey: @"nurse@capulet.lit"] == nil);
+	assert([roster rosterItemsInGroup: @"Friends"].count == 2);
+	assert([roster rosterItemsWithNamePrefix: @""].count == 2);
+
+	/* Once complete, the streamed roster replaces the previous one. */
+	result = streamRoster(roster, connection, [OFArray arrayWithObjects:
+	    @"nurse@capulet.lit", @"tybalt@capulet.lit",
+	    @"benvolio@montague.lit", nil]);
+	assert(roster.rosterItems.count == 2);
+	[connection xmpp_handleIQ: result];
+
+	assert(roster.rosterItems.count == 3);
+	assert([roster.rosterItems objectForKey: @"romeo@montague.lit"] == nil);
+	assert([roster rosterItemsInGroup: @"Friends"].count == 3);
+	assert([rosterItemNames([roster rosterItemsWithNamePrefix: @""])
+	    isEqual: [OFArray arrayWithObjects: @"benvolio@montague.lit",
+	    @"nurse@capulet.lit", @"tybalt@capulet.lit", nil]]);
+
+	[roster release];
+	[connection release];
+
+	objc_autoreleasePoolPop(pool);
+}
+
+static void
+acknowledge(XMPPStreamManagement *streamManagement,
+    XMPPConnection *connection, OFString *h)
+{
+	OFXMLElement *ack = [OFXMLElement elementWithName: @"a"
+						namespace: XMPPSMNS];
+
+	[ack addAttributeWithName: @"h" stringValue: h];
+	[streamManagement connection: connection didReceiveElement: ack];
+}
+
+static void
+sendMessages(XMPPStreamManagement *streamManagement,
+    XMPPConnection *connection, int first, int count)
+{
+	for (int i = first; i < first + count; i++) {
+		XMPPMessage *message = [XMPPMessage messageWithID:
+		    [OFString stringWithFormat: @"m%d", i]];
+
+		[streamManagement connection: connection
+			      didSendElement: message];
+	}
+}
+
+static bool
+confirmedIDsAre(StreamManagementTest *test, int first, int count)
+{
+	if (test->confirmedIDs.count != (size_t)count)
+		return false;
+
+	for (int i = 0; i < count; i++)
+		if (![[test->confirmedIDs objectAtIndex: i] isEqual:
+		    [OFString stringWithFormat: @"m%d", first + i]])
+			return false;
+
+	[test->confirmedIDs removeAllObjects];
+
+	return true;
+}
+
+static void
+testStreamManagementAcks(void)
+{
+	void *pool = objc_autoreleasePoolPush();
+	OfflineConnection *connection = [[OfflineConnection alloc] init];
+	XMPPStreamManagement *streamManagement = [[XMPPStreamManagement alloc]
+	    initWithConnection: connection];
+	StreamManagementTest *test =
+	    [[[StreamManagementTest alloc] init] autorelease];
+
+	streamManagement.ackRequestStanzaInterval = 0;
+	streamManagement.ackRequestTimeInterval = 0;
+	streamManagement.ackRequestIdleDelay = 0;
+	[streamManagement addDelegate: test];
+	[streamManagement connection: connection
+		       wasBoundToJID: [XMPPJID JIDWithString: @"a@b/c"]];
+
+	/* More than the initial capacity of 16. */
+	sendMessages(streamManagement, connection, 0, 20);
+	assert(streamManagement.numberOfUnacknowledgedStanzas == 20);
+
+	acknowledge(streamManagement, connection, @"15");
+	assert(confirmedIDsAre(test, 0, 15));
+	assert(streamManagement.numberOfUnacknowledgedStanzas == 5);
+
+	/* Wraps around the end of the buffer, then grows while wrapped. */
+	sendMessages(streamManagement, connection, 20, 20);
+	acknowledge(streamManagement, connection, @"16");
+	assert(confirmedIDsAre(test, 15, 1));
+	sendMessages(streamManagement, connection, 40, 10);
+	assert(streamManagement.numberOfUnacknowledgedStanzas == 34);
+
+	acknowledge(streamManagement, connection, @"45");
+	assert(confirmedIDsAre(test, 16, 29));
+
+	/* Repeated acknowledgements don't confirm anything. */
+	acknowledge(streamManagement, connection, @"45");
+	assert(test->confirmations == 3);
+	assert(streamManagement.numberOfUnacknowledgedStanzas == 5);
+
+	/* h does not fit into 32 bits and is ignored. */
+	acknowledge(streamManagement, connection, @"4294967296");
+	assert(test->confirmations == 3);
+
+	/* More than was sent only acknowledges what was sent. */
+	acknowledge(streamManagement, connection, @"1000");
+	assert(confirmedIDsAre(test, 45, 5));
+	assert(streamManagement.numberOfUnacknowledgedStanzas == 0);
+
+	[streamManagement removeDelegate: test];
+	[streamManagement release];
+	[connection release];
+
+	objc_autoreleasePoolPop(pool);
+}
+
+static void
+testStreamManagementFailedResumption(void)
+{
+	void *pool = objc_autoreleasePoolPush();
+	OfflineConnection *connection = [[OfflineConnection alloc] init];
+	XMPPStreamManagement *streamManagement = [[XMPPStreamManagement alloc]
+	    initWithConnection: connection];
+	StreamManagementTest *test =
+	    [[[StreamManagementTest alloc] init] autorelease];
+	OFXMLElement *enabled = [OFXMLElement elementWithName: @"enabled"
+						    namespace: XMPPSMNS];
+	OFXMLElement *failed = [OFXMLElement elementWithName: @"failed"
+						   namespace: XMPPSMNS];
+
+	streamManagement.ackRequestStanzaInterval = 0;
+	streamManagement.ackRequestTimeInterval = 0;
+	streamManagement.ackRequestIdleDelay = 0;
+	[streamManagement addDelegate: test];
+	[streamManagement connection: connection
+		       wasBoundToJID: [XMPPJID JIDWithString: @"a@b/c"]];
+	[enabled addAttributeWithName: @"resume" stringValue: @"true"];
+	[enabled addAttributeWithName: @"id" stringValue: @"stream"];
+	[streamManagement connection: connection didReceiveElement: enabled];
+
+	sendMessages(streamManagement, connection, 0, 5);
+	[streamManagement connectionWasClosed: connection error: nil];
+	assert(test->failedStanzas == nil);
+
+	assert([streamManagement connectionWillBindResource: connection]);
+	[failed addAttributeWithName: @"h" stringValue: @"2"];
+	[streamManagement connection: connection didReceiveElement: failed];
+
+	assert(confirmedIDsAre(test, 0, 2));
+	assert(test->failedStanzas.count == 3);
+	assert([[[test->failedStanzas objectAtIndex: 0]
+	    attributeForName: @"id"].stringValue isEqual: @"m2"]);
+	assert(streamManagement.numberOfUnacknowledgedStanzas == 0);
+	assert(streamManagement.resumptionID == nil);
+
+	[streamManagement removeDelegate: test];
+	[streamManagement release];
+	[connection release];
+
+	objc_autoreleasePoolPop(pool);
+}
+
+static void
+testStreamManagementResumption(void)
+{
+	void *pool = objc_autoreleasePoolPush();
+	OfflineConnection *connection = [[OfflineConnection alloc] init];
+	XMPPStreamManagement *streamManagement = [[XMPPStreamManagement alloc]
+	    initWithConnection: connection];
+	StreamManagementTest *test =
+	    [[[StreamManagementTest alloc] init] autorelease];
+	OFXMLElement *enabled = [OFXMLElement elementWithName: @"enabled"
+						    namespace: XMPPSMNS];
+	OFXMLElement *resumed = [OFXMLElement elementWithName: @"resumed"
+						    namespace: XMPPSMNS];
+	XMPPMessage *message = [XMPPMessage messageWithID: @"m3"];
+	OFXMLElement *resume;
+	size_t sent;
+
+	streamManagement.ackRequestStanzaInterval = 0;
+	streamManagement.ackRequestTimeInterval = 0;
+	streamManagement.ackRequestIdleDelay = 0;
+	[streamManagement addDelegate: test];
+	[streamManagement connection: connection
+		       wasBoundToJID: [XMPPJID JIDWithString: @"a@b/c"]];
+	[enabled addAttributeWithName: @"resume" stringValue: @"true"];
+	[enabled addAttributeWithName: @"id" stringValue: @"stream"];
+	[streamManagement connection: connection didReceiveElement: enabled];
+
+	sendMessages(streamManagement, connection, 0, 3);
+	message.body = @"sent";
+	[streamManagement connection: connection didSendElement: message];
+	sendMessages(streamManagement, connection, 4, 1);
+
+	/* Changing a sent stanza must not change what is sent again. */
+	message.body = @"changed";
+
+	[streamManagement connectionWasClosed: connection error: nil];
+	assert(test->failedStanzas == nil);
+	assert(streamManagement.numberOfUnacknowledgedStanzas == 5);
+
+	/* The server asks for the stream to be resumed on reconnect. */
+	sent = connection->sentStanzas.count;
+	assert([streamManagement connectionWillBindResource: connection]);
+	assert(connection->sentStanzas.count == sent + 1);
+	resume = connection->sentStanzas.lastObject;
+	assert([resume.name isEqual: @"resume"]);
+	assert([[resume attributeForName: @"previd"].stringValue
+	    isEqual: @"stream"]);
+	assert([[resume attributeForName: @"h"].stringValue isEqual: @"0"]);
+
+	/* The server received the first two, so the tail is sent again. */
+	[resumed addAttributeWithName: @"h" stringValue: @"2"];
+	[resumed addAttributeWithName: @"previd" stringValue: @"stream"];
+	[streamManagement connection: connection didReceiveElement: resumed];
+
+	assert(confirmedIDsAre(test, 0, 2));
+	assert(test->failedStanzas == nil);
+	assert(connection->sentStanzas.count == sent + 4);
+	for (size_t i = 0; i < 3; i++) {
+		OFXMLElement *stanza =
+		    [connection->sentStanzas objectAtIndex: sent + 1 + i];
+
+		assert([[stanza attributeForName: @"id"].stringValue isEqual:
+		    [OFString stringWithFormat: @"m%zu", i + 2]]);
+	}
+	assert([[[connection->sentStanzas objectAtIndex: sent + 2]
+	    elementForName: @"body"
+		 namespace: XMPPClientNS].stringValue isEqual: @"sent"]);
+	assert(streamManagement.resumptionID != nil);
+
+	[streamManagement removeDelegate: test];
+	[streamManagement release];
+	[connection release];
+
+	objc_autoreleasePoolPop(pool);
+}
+
+/* Creates an empty directory for the files of a test. */
+static OFString *
+createTemporaryDirectory(OFString *name)
+{
+	OFFileManager *fileManager = [OFFileManager defaultManager];
+	OFIRI *temporaryDirectoryIRI = [OFSystemInfo temporaryDirectoryIRI];
+	OFString *directory = (temporaryDirectoryIRI != nil
+	    ? temporaryDirectoryIRI.fileSystemRepresentation : @".");
+
+	directory = [directory stringByAppendingPathComponent:
+	    [OFString stringWithFormat: @"objxmpp-%@-%08" PRIx32,
+	    name, OFRandom32()]];
+
+	if ([fileManager directoryExistsAtPath: directory])
+		[fileManager removeItemAtPath: directory];
+
+	[fileManager createDirectoryAtPath: directory];
+
+	return directory;
+}
+
+static void
+testFileStorage(void)
+{
+	/* Outside of the pool, as the directory is removed after popping it. */
+	OFFileManager *fileManager = [OFFileManager defaultManager];
+	OFString *directory = createTemporaryDirectory(@"file");
+	void *pool = objc_autoreleasePoolPush();
+	OFString *file = [directory
+	    stringByAppendingPathComponent: @"storage.binarypack"];
+	XMPPFileStorage *storage;
+
+	storage = [[[XMPPFileStorage alloc] initWithFile: file] autorelease];
+	storage.savesAsynchronously = true;
+	[storage setStringValue: @"1" forPath: @"roster.ver"];
+	[storage save];
+	[storage setStringValue: @"2" forPath: @"roster.ver"];
+	[storage save];
+	[storage flushSynchronously];
+
+	/* Without a pending save, neither of these writes the file. */
+	[fileManager removeItemAtPath: file];
+	[storage flushSynchronously];
+	storage.savesAsynchronously = false;
+	assert(![fileManager fileExistsAtPath: file]);
+
+	[storage save];
+	storage = [[[XMPPFileStorage alloc] initWithFile: file] autorelease];
+	assert([[storage stringValueForPath: @"roster.ver"] isEqual: @"2"]);
+
+	objc_autoreleasePoolPop(pool);
+
+	[fileManager removeItemAtPath: directory];
+}
+
+static void
+testJournalStorage(void)
+{
+	/* Outside of the pool, as the directory is removed after popping it. */
+	OFFileManager *fileManager = [OFFileManager defaultManager];
+	OFString *directory = createTemporaryDirectory(@"journal");
+	void *pool = objc_autoreleasePoolPush();
+	OFString *file = [directory
+	    stringByAppendingPathComponent: @"storage.binarypack"];
+	OFString *journal = [file stringByAppendingString: @".journal.0"];
+	XMPPJournalStorage *storage;
+	XMPPStoragePath *path;
+	OFFileStream *stream;
+	unsigned long long journalSize;
+
+	storage = [[[XMPPJournalStorage alloc] initWithFile: file] autorelease];
+	[storage setStringValue: @"1" forPath: @"roster.ver"];
+	[storage setDictionary: [OFDictionary dictionaryWithObject: @"both"
+							    forKey: @"a"]
+		       forPath: @"roster.items"];
+	[storage setStringValue: @"2" forPath: @"roster.ver"];
+	[storage setBooleanValue: true forPath: @"roster.items.b"];
+	path = [[storage pathHandleForPath: @"roster.items"]
+	    pathByAppendingComponent: @"romeo@montague.lit"];
+	[storage setStringValue: @"to" forPathHandle: path];
+	[storage save];
+	journalSize = [fileManager attributesOfItemAtPath: journal].fileSize;
+
+	/* Simulate a crash in the middle of appending a record. */
+	stream = [OFFileStream fileStreamWithPath: journal mode: @"a"];
+	[stream writeBuffer: "\0\0\0\x7Ftorn" length: 8];
+	[stream close];
+
+	/* The torn record is cut off instead of starting a new journal. */
+	storage = [[[XMPPJournalStorage alloc] initWithFile: file] autorelease];
+	assert([fileManager attributesOfItemAtPath: journal].fileSize ==
+	    journalSize);
+	storage = [[[XMPPJournalStorage alloc] initWithFile: file] autorelease];
+	assert([[storage stringValueForPath: @"roster.ver"] isEqual: @"2"]);
+	assert([[storage stringValueForPath: @"roster.items.a"]
+	    isEqual: @"both"]);
+	assert([storage booleanValueForPath: @"roster.items.b"]);
+	assert([[storage stringValueForPathHandle: path] isEqual: @"to"]);
+	assert([[[storage dictionaryForPath: @"roster.items"]
+	    objectForKey: @"romeo@montague.lit"] isEqual: @"to"]);
+
+	[storage setStringValue: nil forPath: @"roster.ver"];
+	[storage save];
+	assert(![fileManager fileExistsAtPath:
+	    [file stringByAppendingString: @".journal.1"]]);
+	[storage compact];
+	assert(![fileManager fileExistsAtPath: journal]);
+
+	storage = [[[XMPPJournalStorage alloc] initWithFile: file] autorelease];
+	assert([storage stringValueForPath: @"roster.ver"] == nil);
+	assert([[storage stringValueForPath: @"roster.items.a"]
+	    isEqual: @"both"]);
+
+	/* A zeroed tail, e.g. from a failed write, is a torn record too. */
+	[storage setStringValue: @"3" forPath: @"roster.ver"];
+	[storage save];
+	stream = [OFFileStream fileStreamWithPath:
+	    [file stringByAppendingString: @".journal.1"] mode: @"a"];
+	[stream writeBuffer: "\0\0\0\0\0\0\0\0" length: 8];
+	[stream close];
+
+	storage = [[[XMPPJournalStorage alloc] initWithFile: file] autorelease];
+	assert([[storage stringValueForPath: @"roster.ver"] isEqual: @"3"]);
+	[storage setStringValue: @"4" forPath: @"roster.ver"];
+	[storage save];
+	assert(![fileManager fileExistsAtPath:
+	    [file stringByAppendingString: @".journal.2"]]);
+
+	storage = [[[XMPPJournalStorage alloc] initWithFile: file] autorelease];
+	assert([[storage stringValueForPath: @"roster.ver"] isEqual: @"4"]);
+
+	objc_autoreleasePoolPop(pool);
+
+	[fileManager removeItemAtPath: directory];
+}
+
 @implementation AppDelegate
 - (void)applicationDidFinishLaunching: (OFNotification *)notification
 {
 	OFArray *arguments = [OFApplication arguments];
 
+	testStringPrep();
+	testStreamingBuilder();
+	testContactPresences();
+	testPresenceBatching();
+	testRosterReset();
+	testRosterIndexes();
+	testRosterStreamingFailure();
+	testReadBuffer();
+	testPendingIQs();
+	testConnectionAttempts();
+	testStreamManagementAcks();
+	testStreamManagementFailedResumption();
+	testStreamManagementResumption();
+	testFileStorage();
+	testJournalStorage();
+
 	XMPPPresence *pres = [XMPPPresence presence];
 	pres.show = @"xa";
 	pres.status = @"Bored";
@@ -62,6 +1245,7 @@ OF_APPLICATION_DELEGATE(AppDelegate)
 	    @"from='bob@example.org'><show>xa</show>"
 	    @"<status>Bored</status><priority>20</priority>"
 	    @"</presence>"]);
+	assert([serialize(pres) isEqual: pres.XMLString]);
 
 	XMPPPresence *pres2 = [XMPPPresence presence];
 	pres2.show = @"away";
@@ -72,6 +1256,16 @@ OF_APPLICATION_DELEGATE(AppDelegate)
 
 	assert([pres compare: pres2] == OFOrderedAscending);
 
+	XMPPPresence *pres3 = [XMPPPresence presence];
+	pres3.priority = [OFNumber numberWithChar: 23];
+	assert([pres2 compare: pres3] == OFOrderedDescending);
+	pres3.show = @"chat";
+	assert([pres3 compare: pres2] == OFOrderedAscending);
+	pres3.show = @"unknown";
+	assert([pres3 compare: pres2] == OFOrderedDescending);
+	pres2.show = @"invalid";
+	assert([pres3 compare: pres2] == OFOrderedSame);
+
 	XMPPMessage *msg = [XMPPMessage messageWithType: @"chat"];
 	msg.body = @"Hello everyone";
 	msg.to = [XMPPJID JIDWithString: @"jdev@conference.jabber.org"];
@@ -80,6 +1274,7 @@ OF_APPLICATION_DELEGATE(AppDelegate)
 	    @"to='jdev@conference.jabber.org' "
 	    @"from='alice@example.com'><body>Hello everyone</body>"
 	    @"</message>"]);
+	assert([serialize(msg) isEqual: msg.XMLString]);
 
 	XMPPIQ *IQ = [XMPPIQ IQWithType: @"set" ID: @"128"];
 	IQ.to = [XMPPJID JIDWithString: @"juliet@capulet.lit"];
@@ -87,6 +1282,7 @@ OF_APPLICATION_DELEGATE(AppDelegate)
 	assert([IQ.XMLString isEqual: @"<iq type='set' id='128' "
 	    @"to='juliet@capulet.lit' "
 	    @"from='romeo@montague.lit'/>"]);
+	assert([serialize(IQ) isEqual: IQ.XMLString]);
 
 	OFXMLElement *elem = [OFXMLElement elementWithName: @"iq"];
 	[elem addAttributeWithName: @"from" stringValue: @"bob@localhost"];
@@ -95,10 +1291,32 @@ OF_APPLICATION_DELEGATE(AppDelegate)
 	[elem addAttributeWithName: @"id" stringValue: @"42"];
 	XMPPStanza *stanza = [XMPPStanza stanzaWithElement: elem];
 	assert([elem.XMLString isEqual: [stanza XMLString]]);
+	assert([serialize(stanza) isEqual: elem.XMLString]);
 	assert(([[OFString stringWithFormat: @"%@, %@, %@, %@",
 	    stanza.from.fullJID, stanza.to.fullJID, stanza.type, stanza.ID]
 	    isEqual: @"bob@localhost, alice@localhost, get, 42"]));
 
+	XMPPJIDCache *JIDCache = [XMPPJIDCache sharedCache];
+	unsigned long long JIDCacheHits = JIDCache.numberOfHits;
+	XMPPJID *JID = [XMPPJID JIDWithString: @"Romeo@Montague.lit/Orchard"];
+	assert([JID.fullJID isEqual: @"romeo@montague.lit/Orchard"]);
+	assert([[XMPPJID JIDWithString: @"Romeo@Montague.lit/Orchard"]
+	    isEqual: JID]);
+	assert(JIDCache.numberOfHits == JIDCacheHits + 1);
+	assert([JID isEqualToBareJID:
+	    [XMPPJID JIDWithString: @"romeo@montague.lit"]]);
+	JID.resource = @"Balcony";
+	assert([JID.fullJID isEqual: @"romeo@montague.lit/Balcony"]);
+
+	XMPPRosterItem *rosterItem = [XMPPRosterItem rosterItem];
+	rosterItem.JID = JID;
+	rosterItem.subscription = @"both";
+	rosterItem.groups = [OFArray arrayWithObject: @"Friends"];
+	XMPPRosterItem *rosterItem2 = [[rosterItem copy] autorelease];
+	assert([rosterItem2 isEqual: rosterItem]);
+	assert(rosterItem2.hash == rosterItem.hash);
+	rosterItem2.name = @"Romeo";
+	assert(![rosterItem2 isEqual: rosterItem]);
 
 	conn = [[XMPPConnection alloc] init];
 	[conn addDelegate: self];
@@ -254,3 +1472,287 @@ OF_APPLICATION_DELEGATE(AppDelegate)
 	OFLog(@"Connection was closed: %@", error);
 }
 @end
+
+@implementation StreamingTest
+- (void)dealloc
+{
+	[stanza release];
+
+	[super dealloc];
+}
+
+-		   (bool)elementBuilder: (XMPPXMLElementBuilder *)builder
+  shouldStreamChildrenOfElement: (OFXMLElement *)element
+		      inElement: (OFXMLElement *)stanza_
+{
+	return [element.namespace isEqual: @"jabber:iq:roster"];
+}
+
+-     (void)elementBuilder: (XMPPXMLElementBuilder *)builder
+  didBuildChildElement: (OFXMLElement *)child
+	     ofElement: (OFXMLElement *)element
+	     inElement: (OFXMLElement *)stanza_
+{
+	assert([child.name isEqual: @"item"]);
+	assert([[stanza_ attributeForName: @"id"].stringValue isEqual: @"1"]);
+	streamedChildren++;
+}
+
+- (void)elementBuilder: (OFXMLElementBuilder *)builder
+       didBuildElement: (OFXMLElement *)element
+{
+	[stanza release];
+	stanza = [element retain];
+}
+@end
+
+@implementation PresenceBatchTest
+- (void)dealloc
+{
+	[contacts release];
+
+	[super dealloc];
+}
+
+-   (void)contact: (XMPPContact *)contact
+  didSendPresence: (XMPPPresence *)presence
+{
+	presences++;
+}
+
+-         (void)contactManager: (XMPPContactManager *)manager
+  didUpdatePresencesOfContacts: (OFSet *)contacts_
+{
+	[contacts release];
+	contacts = [contacts_ retain];
+	batches++;
+}
+@end
+
+@implementation RosterResetTest
+- (instancetype)init
+{
+	self = [super init];
+
+	removedJIDs = [[OFMutableArray alloc] init];
+
+	return self;
+}
+
+- (void)dealloc
+{
+	[removedJIDs release];
+
+	[super dealloc];
+}
+
+- (void)contactManager: (XMPPContactManager *)manager
+      didRemoveContact: (XMPPContact *)contact
+{
+	[removedJIDs addObject: contact.rosterItem.JID.bareJID];
+}
+@end
+
+@implementation IQCallbackTest
+- (instancetype)init
+{
+	self = [super init];
+
+	responses = [[OFMutableArray alloc] init];
+
+	return self;
+}
+
+- (void)dealloc
+{
+	[responses release];
+
+	[super dealloc];
+}
+
+-   (void)connection: (XMPPConnection *)connection
+  didReceiveResponse: (XMPPIQ *)IQ
+{
+	[responses addObject: IQ];
+}
+@end
+
+@implementation StubResolver
+- (void)dealloc
+{
+	[records release];
+
+	[super dealloc];
+}
+
+- (void)asyncPerformQuery: (OFDNSQuery *)query
+		 delegate: (id <OFDNSResolverQueryDelegate>)delegate
+{
+	OFString *domainName = query.domainName;
+	OFMutableArray *answers = [OFMutableArray array];
+	OFDNSResponse *response;
+
+	for (OFSRVDNSResourceRecord *record in records)
+		if ([record.name isEqual: domainName])
+			[answers addObject: record];
+
+	response = [OFDNSResponse
+	    responseWithDomainName: domainName
+		     answerRecords: [OFDictionary
+					dictionaryWithObject: answers
+						      forKey: domainName]
+		  authorityRecords: [OFDictionary dictionary]
+		 additionalRecords: [OFDictionary dictionary]];
+
+	[delegate resolver: self
+	   didPerformQuery: domainName
+		  response: response
+		 exception: nil];
+}
+@end
+
+@implementation TestListener
+- (instancetype)init
+{
+	self = [super init];
+
+	@try {
+		OFSocketAddress address;
+
+		acceptedSockets = [[OFMutableArray alloc] init];
+		received = [[OFMutableData alloc] init];
+
+		socket = [[OFTCPSocket alloc] init];
+		socket.delegate = self;
+		address = [socket bindToHost: @"127.0.0.1" port: 0];
+		port = OFSocketAddressIPPort(&address);
+		[socket listen];
+		[socket asyncAccept];
+	} @catch (id e) {
+		[self release];
+		@throw e;
+	}
+
+	return self;
+}
+
+- (void)dealloc
+{
+	[self stop];
+
+	[socket release];
+	[acceptedSockets release];
+	[received release];
+
+	[super dealloc];
+}
+
+- (void)stop
+{
+	/* The delegate is removed once a socket has been closed. */
+	for (OFTCPSocket *acceptedSocket in acceptedSockets) {
+		if (acceptedSocket.delegate == nil)
+			continue;
+
+		acceptedSocket.delegate = nil;
+		[acceptedSocket cancelAsyncRequests];
+		[acceptedSocket close];
+	}
+
+	if (socket.delegate != nil) {
+		socket.delegate = nil;
+		[socket cancelAsyncRequests];
+		[socket close];
+	}
+}
+
+-    (bool)socket: (OFStreamSocket *)sock
+  didAcceptSocket: (OFStreamSocket *)acceptedSocket
+	exception: (id)exception
+{
+	if (exception != nil)
+		return false;
+
+	[acceptedSockets addObject: acceptedSocket];
+	acceptedSocket.delegate = self;
+	[acceptedSocket asyncReadIntoBuffer: buffer length: sizeof(buffer)];
+
+	return true;
+}
+
+-      (bool)stream: (OFStream *)stream
+  didReadIntoBuffer: (void *)buffer_
+	     length: (size_t)length
+	  exception: (id)exception
+{
+	if (exception != nil || (length == 0 && stream.atEndOfStream)) {
+		closedSockets++;
+		return false;
+	}
+
+	[received addItems: buffer_ count: length];
+
+	return true;
+}
+@end
+
+@implementation OfflineConnection
+- (instancetype)init
+{
+	self = [super init];
+
+	sentStanzas = [[OFMutableArray alloc] init];
+
+	return self;
+}
+
+- (void)dealloc
+{
+	[sentStanzas release];
+
+	[super dealloc];
+}
+
+- (bool)supportsStreamManagement
+{
+	return true;
+}
+
+- (void)sendStanza: (OFXMLElement *)element
+{
+	[sentStanzas addObject: element];
+}
+@end
+
+@implementation StreamManagementTest
+- (instancetype)init
+{
+	self = [super init];
+
+	confirmedIDs = [[OFMutableArray alloc] init];
+
+	return self;
+}
+
+- (void)dealloc
+{
+	[confirmedIDs release];
+	[failedStanzas release];
+
+	[super dealloc];
+}
+
+-              (void)streamManagement: (XMPPStreamManagement *)streamManagement
+  didConfirmDeliveryOfMessagesWithIDs: (OFArray *)IDs
+{
+	[confirmedIDs addObjectsFromArray: IDs];
+	confirmations++;
+}
+
+-  (void)streamManagement: (XMPPStreamManagement *)streamManagement
+  didFailToDeliverStanzas: (OFArray *)stanzas
+{
+	[failedStanzas release];
+	failedStanzas = [stanzas retain];
+}
+@end